@@ -0,0 +1,313 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * bench.c - Benchmarks umalloc over a whole trace suite in one process.
+ * Each trace is loaded once and replayed many times on the same heap,
+ * which ureset empties between runs, so process startup, trace parsing
+ * and first-touch page faults stay out of the numbers. After a few
+ * warmup runs every run is timed, and the median, its median absolute
+ * deviation and a distribution-free 95% confidence interval are reported.
+ * Results can be saved as a baseline and later runs compared against it.
+ **************************************************************************/
+
+#include "umalloc.h"
+#include "support.h"
+#include <glob.h>
+#include <math.h>
+
+#define DEFAULT_ITERATIONS 31
+#define DEFAULT_WARMUPS 3
+#define DEFAULT_THRESHOLD 5.0 /* percent a median must move to count */
+#define MAX_BASELINE 256
+
+typedef struct {
+    char name[MAXLINE];
+    int num_ops;
+    double median_ns;
+    double mad_ns;
+    double low_ns;  /* 95% confidence interval of the median */
+    double high_ns;
+} result_t;
+
+static result_t baseline[MAX_BASELINE];
+static int num_baseline;
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static int by_value(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * median - median of n sorted samples.
+ */
+static double median(double *sorted, int n) {
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+/*
+ * replay - runs every op of the trace in file once on a freshly reset heap
+ * and returns how long that took. A heap that cannot be reset ends the
+ * benchmark, since runs on a used heap would not be comparable.
+ */
+static double replay(char *file, trace_t *trace, void **payloads) {
+    struct timespec start, end;
+    char err_msg[MAXLINE];
+    if (ureset() == -1) {
+        snprintf(err_msg, sizeof(err_msg), "ureset refused to empty the heap before a run of %s: "
+            "a heap segment could not be recorded, so the heap cannot be reused.", file);
+        appl_error(err_msg);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t op = trace->ops[i];
+        if (op.type == ALLOC) {
+            payloads[op.index] = umalloc_fast(op.size);
+            if (payloads[op.index] == NULL) {
+                appl_error("umalloc failed.");
+            }
+        } else if (op.type == REALLOC) {
+            payloads[op.index] = urealloc(payloads[op.index], op.size);
+        } else {
+            ufree_fast(payloads[op.index]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_ns(&start, &end);
+}
+
+/*
+ * bench_trace - replays a trace warmups times untimed and iterations times
+ * timed, and summarizes the timed runs. The confidence interval of the
+ * median is given by the order statistics around n/2, which holds
+ * whatever the distribution of the run times.
+ */
+static void bench_trace(char *file, int iterations, int warmups, result_t *result) {
+    trace_t *trace = read_trace(file, 0);
+    void **payloads = calloc(trace->num_ids, sizeof(void *));
+    double *samples = malloc(iterations * sizeof(double));
+    if (payloads == NULL || samples == NULL) {
+        appl_error("Failed to allocate the sample arrays");
+    }
+    for (int i = 0; i < warmups; i++) {
+        replay(file, trace, payloads);
+    }
+    for (int i = 0; i < iterations; i++) {
+        samples[i] = replay(file, trace, payloads);
+    }
+
+    qsort(samples, iterations, sizeof(double), by_value);
+    snprintf(result->name, sizeof(result->name), "%s", file);
+    result->num_ops = trace->num_ops;
+    result->median_ns = median(samples, iterations);
+    double spread = 1.96 * sqrt(iterations) / 2;
+    int low = floor(iterations / 2.0 - spread);
+    int high = ceil(iterations / 2.0 + spread);
+    result->low_ns = samples[low < 0 ? 0 : low];
+    result->high_ns = samples[high >= iterations ? iterations - 1 : high];
+    for (int i = 0; i < iterations; i++) {
+        samples[i] = fabs(samples[i] - result->median_ns);
+    }
+    qsort(samples, iterations, sizeof(double), by_value);
+    result->mad_ns = median(samples, iterations);
+
+    free(samples);
+    free(payloads);
+    free_trace(trace);
+}
+
+/*
+ * load_baseline - reads results saved by -o: one line per trace with its
+ * name, median, MAD and interval in nanoseconds.
+ */
+static void load_baseline(char *file) {
+    char line[MAXLINE];
+    char err_msg[MAXLINE];
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        sprintf(err_msg, "Could not open baseline %s", file);
+        appl_error(err_msg);
+    }
+    while (fgets(line, sizeof(line), f) && num_baseline < MAX_BASELINE) {
+        result_t *r = &baseline[num_baseline];
+        if (line[0] != '#' && sscanf(line, "%1023s %lf %lf %lf %lf",
+                r->name, &r->median_ns, &r->mad_ns, &r->low_ns, &r->high_ns) == 5) {
+            num_baseline++;
+        }
+    }
+    fclose(f);
+}
+
+static result_t *find_baseline(char *name) {
+    for (int i = 0; i < num_baseline; i++) {
+        if (strcmp(baseline[i].name, name) == 0) {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * compare - how a result stands against its baseline. A change counts only
+ * when the two confidence intervals do not overlap and the median moved
+ * by more than threshold percent. Returns 1 for a regression.
+ */
+static int compare(result_t *r, double threshold, char *verdict) {
+    result_t *base = find_baseline(r->name);
+    if (base == NULL) {
+        strcpy(verdict, "no baseline");
+        return 0;
+    }
+    double change = 100.0 * (r->median_ns - base->median_ns) / base->median_ns;
+    if (r->low_ns > base->high_ns && change > threshold) {
+        sprintf(verdict, "REGRESSED %+.1f%%", change);
+        return 1;
+    }
+    if (r->high_ns < base->low_ns && change < -threshold) {
+        sprintf(verdict, "improved %+.1f%%", change);
+    } else {
+        sprintf(verdict, "same %+.1f%%", change);
+    }
+    return 0;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: bench [-r] [-n runs] [-w runs] [-f policy] [-b file] [-o file] [-t pct] [trace...]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-n runs    Timed runs per trace (default %d).\n", DEFAULT_ITERATIONS);
+    fprintf(stderr, "\t-w runs    Untimed warmup runs per trace (default %d).\n", DEFAULT_WARMUPS);
+    fprintf(stderr, "\t-f policy  Placement policy: best (the default), good, first or adaptive.\n");
+    fprintf(stderr, "\t-b file    Compare against a saved baseline; exit 1 on a regression.\n");
+    fprintf(stderr, "\t-o file    Save the results as a baseline.\n");
+    fprintf(stderr, "\t-t pct     Smallest change of the median to report (default %.0f%%).\n", DEFAULT_THRESHOLD);
+    fprintf(stderr, "\t-r         Print one line per trace for scripts: trace, median ops/ms, interval.\n");
+    fprintf(stderr, "Without traces, every .rep trace in traces/ but the short ones is run.\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    int iterations = DEFAULT_ITERATIONS;
+    int warmups = DEFAULT_WARMUPS;
+    double threshold = DEFAULT_THRESHOLD;
+    policy_t policy = BEST_FIT;
+    char *save_file = NULL;
+    bool raw = false;
+    glob_t found = {0};
+    char **files;
+    int num_files;
+
+    while ((c = getopt(argc, argv, "rn:w:f:b:o:t:")) != -1) {
+        switch (c) {
+        case 'r':
+            raw = true;
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'w':
+            warmups = atoi(optarg);
+            break;
+        case 'f':
+            policy = parse_placement_policy(optarg);
+            if (policy == NUM_POLICIES) {
+                usage();
+                appl_error("Unknown placement policy.");
+            }
+            break;
+        case 'b':
+            load_baseline(optarg);
+            break;
+        case 'o':
+            save_file = optarg;
+            break;
+        case 't':
+            threshold = atof(optarg);
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (iterations < 1 || warmups < 0) {
+        usage();
+        appl_error("Need at least one timed run.");
+    }
+
+    if (optind < argc) {
+        files = argv + optind;
+        num_files = argc - optind;
+    } else {
+        glob("./traces/*.rep", 0, NULL, &found);
+        num_files = 0;
+        files = found.gl_pathv;
+        for (size_t i = 0; i < found.gl_pathc; i++) {
+            if (!strstr(found.gl_pathv[i], "short")) {
+                files[num_files++] = found.gl_pathv[i];
+            }
+        }
+        if (num_files == 0) {
+            appl_error("No traces found in traces/.");
+        }
+    }
+    result_t *results = calloc(num_files, sizeof(result_t));
+    if (results == NULL) {
+        appl_error("Failed to allocate the results");
+    }
+
+    if (uinit() == -1) {
+        appl_error("uinit failed.");
+    }
+    set_placement_policy(policy);
+    if (!raw) {
+        printf("%d runs after %d warmups per trace\n", iterations, warmups);
+        printf("%-28s %10s %10s %10s %21s  %s\n",
+            "trace", "median us", "MAD us", "ops/ms", "95% CI ops/ms", num_baseline ? "vs baseline" : "");
+    }
+    int regressions = 0;
+    double total_rate = 0;
+    for (int i = 0; i < num_files; i++) {
+        result_t *r = &results[i];
+        char verdict[MAXLINE] = "";
+        bench_trace(files[i], iterations, warmups, r);
+        int num_ops = r->num_ops;
+        double rate = num_ops / (r->median_ns / 1e6);
+        total_rate += rate;
+        if (num_baseline) {
+            regressions += compare(r, threshold, verdict);
+        }
+        if (raw) {
+            printf("%s %.2f %.2f %.2f\n", r->name, rate, num_ops / (r->high_ns / 1e6), num_ops / (r->low_ns / 1e6));
+        } else {
+            printf("%-28s %10.1f %10.2f %10.0f %10.0f - %-8.0f  %s\n", r->name, r->median_ns / 1e3,
+                r->mad_ns / 1e3, rate, num_ops / (r->high_ns / 1e6), num_ops / (r->low_ns / 1e6), verdict);
+        }
+    }
+    if (!raw) {
+        printf("%-28s %32.0f\n", "Average", total_rate / num_files);
+        if (num_baseline) {
+            printf("%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+        }
+    }
+
+    if (save_file) {
+        FILE *f = fopen(save_file, "w");
+        if (f == NULL) {
+            appl_error("Could not write the baseline.");
+        }
+        fprintf(f, "# trace median_ns mad_ns ci_low_ns ci_high_ns\n");
+        for (int i = 0; i < num_files; i++) {
+            result_t *r = &results[i];
+            fprintf(f, "%s %.0f %.0f %.0f %.0f\n", r->name, r->median_ns, r->mad_ns, r->low_ns, r->high_ns);
+        }
+        fclose(f);
+    }
+    free(results);
+    globfree(&found);
+    return regressions ? 1 : 0;
+}
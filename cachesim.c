@@ -0,0 +1,405 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * cachesim.c - Estimates the locality the allocator's placement gives the
+ * program using it. A trace is replayed through umalloc and every payload
+ * it hands out is touched the way a program would use it: written whole
+ * when allocated, read whole before it is freed, copied on realloc. Those
+ * touches run through a simulated set-associative L1 and L2 and a reuse
+ * distance histogram, so placement policies can be compared by the cache
+ * misses they cause the program rather than by their own speed.
+ **************************************************************************/
+
+#include "umalloc.h"
+#include "support.h"
+
+#define MAX_ASSOC 64
+#define REUSE_BINS 40 /* log2 bins of the reuse distance in lines */
+
+typedef struct {
+    size_t sets;
+    int assoc;
+    int line_shift;
+    uint64_t *tags;     /* per set, most recently used first; 0 is empty */
+    uint64_t accesses;
+    uint64_t misses;
+} cache_t;
+
+typedef struct {
+    const char *name;
+    policy_t policy;
+    bool class_caches;  /* ops go through the inline fast path */
+} config_t;
+
+static const config_t configs[] = {
+    {"best", BEST_FIT, true},
+    {"adaptive", ADAPTIVE, true},
+    {"good", GOOD_FIT, true},
+    {"first", FIRST_FIT, true},
+    {"best, no caches", BEST_FIT, false},
+    {"adaptive, no caches", ADAPTIVE, false},
+    {"good, no caches", GOOD_FIT, false},
+    {"first, no caches", FIRST_FIT, false},
+};
+#define NUM_CONFIGS (sizeof(configs) / sizeof(configs[0]))
+
+/*
+ * Reuse distance: the distinct lines touched since the line was last
+ * touched. Each line's last touch is kept in a hash map and marked in a
+ * Fenwick tree over time, so the distance is the marks after it.
+ */
+typedef struct {
+    uint64_t line;      /* line + 1, 0 for a free slot */
+    uint32_t last;
+} reuse_slot_t;
+
+static reuse_slot_t *reuse_slots;
+static size_t reuse_capacity;
+static size_t reuse_count;
+static int32_t *fenwick;
+static size_t fenwick_size;
+static uint32_t now;
+static uint64_t reuse_hist[REUSE_BINS];
+static uint64_t cold_touches;
+
+static cache_t l1, l2;
+
+/*
+ * parse_cache - reads a size:assoc:line spec, the size with an optional K
+ * or M suffix. Returns false if it is malformed.
+ */
+static bool parse_cache(cache_t *cache, char *spec) {
+    long size, line;
+    int assoc;
+    char unit = 0;
+    if (sscanf(spec, "%ld%c", &size, &unit) == 2 && (unit == 'K' || unit == 'k' || unit == 'M' || unit == 'm')) {
+        size <<= unit == 'K' || unit == 'k' ? 10 : 20;
+        spec = strchr(spec, unit) + 1;
+        if (sscanf(spec, ":%d:%ld", &assoc, &line) != 2) {
+            return false;
+        }
+    } else if (sscanf(spec, "%ld:%d:%ld", &size, &assoc, &line) != 3) {
+        return false;
+    }
+    if (line <= 0 || (line & (line - 1)) || assoc <= 0 || assoc > MAX_ASSOC || size % (line * assoc)) {
+        return false;
+    }
+    cache->sets = size / (line * assoc);
+    cache->assoc = assoc;
+    for (cache->line_shift = 0; (1L << cache->line_shift) < line; cache->line_shift++)
+        ;
+    return cache->sets > 0;
+}
+
+static void reset_cache(cache_t *cache) {
+    free(cache->tags);
+    if ((cache->tags = calloc(cache->sets * cache->assoc, sizeof(uint64_t))) == NULL) {
+        appl_error("Failed to allocate the cache");
+    }
+    cache->accesses = cache->misses = 0;
+}
+
+/*
+ * cache_access - looks a line up in an LRU set. Returns true on a hit.
+ */
+static bool cache_access(cache_t *cache, uint64_t addr) {
+    uint64_t tag = (addr >> cache->line_shift) + 1;
+    uint64_t *set = &cache->tags[(tag % cache->sets) * cache->assoc];
+    int way;
+    cache->accesses++;
+    for (way = 0; way < cache->assoc - 1 && set[way] != tag; way++)
+        ;
+    bool hit = set[way] == tag;
+    cache->misses += !hit;
+    memmove(set + 1, set, way * sizeof(uint64_t));
+    set[0] = tag;
+    return hit;
+}
+
+static reuse_slot_t *reuse_slot(uint64_t line) {
+    uint64_t h = line * 0x9E3779B97F4A7C15ULL;
+    size_t i = (h ^ (h >> 32)) & (reuse_capacity - 1);
+    while (reuse_slots[i].line && reuse_slots[i].line != line) {
+        i = (i + 1) & (reuse_capacity - 1);
+    }
+    return &reuse_slots[i];
+}
+
+static void reuse_resize(size_t capacity) {
+    reuse_slot_t *old = reuse_slots;
+    size_t old_capacity = reuse_capacity;
+    if ((reuse_slots = calloc(capacity, sizeof(reuse_slot_t))) == NULL) {
+        appl_error("Failed to grow the line map");
+    }
+    reuse_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].line) {
+            *reuse_slot(old[i].line) = old[i];
+        }
+    }
+    free(old);
+}
+
+static void fenwick_add(size_t i, int32_t delta) {
+    for (i++; i <= fenwick_size; i += i & -i) {
+        fenwick[i - 1] += delta;
+    }
+}
+
+/* marks in [0, i) */
+static int64_t fenwick_sum(size_t i) {
+    int64_t sum = 0;
+    for (; i > 0; i -= i & -i) {
+        sum += fenwick[i - 1];
+    }
+    return sum;
+}
+
+static void reset_reuse(size_t touches) {
+    free(reuse_slots);
+    free(fenwick);
+    reuse_slots = NULL;
+    reuse_capacity = reuse_count = 0;
+    reuse_resize(1024);
+    fenwick_size = touches;
+    if ((fenwick = calloc(fenwick_size, sizeof(int32_t))) == NULL) {
+        appl_error("Failed to allocate the reuse tree");
+    }
+    now = 0;
+    cold_touches = 0;
+    memset(reuse_hist, 0, sizeof(reuse_hist));
+}
+
+static void record_reuse(uint64_t line) {
+    if (2 * (reuse_count + 1) > reuse_capacity) {
+        reuse_resize(2 * reuse_capacity);
+    }
+    reuse_slot_t *slot = reuse_slot(line + 1);
+    if (slot->line) {
+        int64_t distance = fenwick_sum(now) - fenwick_sum(slot->last + 1);
+        int bin = 0;
+        while (bin < REUSE_BINS - 1 && (1LL << bin) <= distance) {
+            bin++;
+        }
+        reuse_hist[bin]++;
+        fenwick_add(slot->last, -1);
+    } else {
+        slot->line = line + 1;
+        reuse_count++;
+        cold_touches++;
+    }
+    slot->last = now;
+    fenwick_add(now++, 1);
+}
+
+/*
+ * touch - the program using size bytes at payload, a line at a time.
+ */
+static void touch(void *payload, size_t size) {
+    uint64_t first = (uintptr_t)payload >> l1.line_shift;
+    uint64_t last = ((uintptr_t)payload + (size ? size : 1) - 1) >> l1.line_shift;
+    for (uint64_t line = first; line <= last; line++) {
+        uint64_t addr = line << l1.line_shift;
+        if (!cache_access(&l1, addr)) {
+            cache_access(&l2, addr);
+        }
+        record_reuse(line);
+    }
+}
+
+/* an upper bound on the lines a touch of size bytes spans */
+static size_t max_lines(size_t size) {
+    return (size >> l1.line_shift) + 2;
+}
+
+/*
+ * simulate - replays the trace under a configuration on a fresh heap.
+ */
+static void simulate(trace_t *trace, const config_t *config, void **payloads, size_t *sizes, size_t touches) {
+    if (ureset() == -1) {
+        appl_error("ureset failed.");
+    }
+    set_placement_policy(config->policy);
+    reset_cache(&l1);
+    reset_cache(&l2);
+    reset_reuse(touches);
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t op = trace->ops[i];
+        void *payload;
+        switch (op.type) {
+        case ALLOC:
+            payload = config->class_caches ? umalloc_fast(op.size) : umalloc_slow(op.size);
+            if (payload == NULL) {
+                appl_error("umalloc failed.");
+            }
+            touch(payload, op.size);
+            break;
+        case REALLOC:
+            touch(payloads[op.index], sizes[op.index]);
+            if ((payload = urealloc(payloads[op.index], op.size)) == NULL) {
+                appl_error("urealloc failed.");
+            }
+            touch(payload, op.size);
+            break;
+        default:
+            touch(payloads[op.index], sizes[op.index]);
+            if (config->class_caches) {
+                ufree_fast(payloads[op.index]);
+            } else {
+                ufree_slow(payloads[op.index]);
+            }
+            continue;
+        }
+        payloads[op.index] = payload;
+        sizes[op.index] = op.size;
+    }
+}
+
+/*
+ * within - the share of touches that reused a line at most lines distinct
+ * lines back, which a fully associative LRU cache of that many lines hits.
+ */
+static double within(uint64_t lines) {
+    uint64_t hits = 0, total = cold_touches;
+    for (int bin = 0; bin < REUSE_BINS; bin++) {
+        total += reuse_hist[bin];
+        if ((1ULL << bin) <= lines) { /* the whole bin is under lines */
+            hits += reuse_hist[bin];
+        }
+    }
+    return total ? 100.0 * hits / total : 0.0;
+}
+
+static void print_reuse_histogram(void) {
+    uint64_t total = cold_touches, running = 0;
+    for (int bin = 0; bin < REUSE_BINS; bin++) {
+        total += reuse_hist[bin];
+    }
+    printf("\nReuse distance in distinct %d-byte lines\n", 1 << l1.line_shift);
+    printf("%22s %12s %8s %8s\n", "distance", "touches", "%", "cum %");
+    for (int bin = 0; bin < REUSE_BINS; bin++) {
+        char range[64];
+        if (!reuse_hist[bin]) {
+            continue;
+        }
+        running += reuse_hist[bin];
+        if (bin == 0) {
+            sprintf(range, "0");
+        } else {
+            sprintf(range, "%llu-%llu", 1ULL << (bin - 1), (1ULL << bin) - 1);
+        }
+        printf("%22s %12lu %7.2f%% %7.2f%%\n", range, reuse_hist[bin],
+            100.0 * reuse_hist[bin] / total, 100.0 * running / total);
+    }
+    printf("%22s %12lu %7.2f%%\n", "first touch", cold_touches, 100.0 * cold_touches / total);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: cachesim [-a] [-n] [-f policy] [-1 cache] [-2 cache] file\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a         Compare every placement policy, with and without the class caches.\n");
+    fprintf(stderr, "\t-f policy  Placement policy: best (the default), good, first or adaptive.\n");
+    fprintf(stderr, "\t-n         Bypass the class caches and their LIFO reuse.\n");
+    fprintf(stderr, "\t-1 cache   L1 as size:assoc:line (default 32K:8:64).\n");
+    fprintf(stderr, "\t-2 cache   L2 as size:assoc:line (default 1M:16:64).\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    bool all = false;
+    config_t single = configs[0];
+    char l1_spec[] = "32K:8:64", l2_spec[] = "1M:16:64";
+
+    parse_cache(&l1, l1_spec);
+    parse_cache(&l2, l2_spec);
+    while ((c = getopt(argc, argv, "anf:1:2:")) != -1) {
+        switch (c) {
+        case 'a':
+            all = true;
+            break;
+        case 'n':
+            single.class_caches = false;
+            break;
+        case 'f':
+            single.name = optarg;
+            single.policy = parse_placement_policy(optarg);
+            if (single.policy == NUM_POLICIES) {
+                usage();
+                appl_error("Unknown placement policy.");
+            }
+            break;
+        case '1':
+        case '2':
+            if (!parse_cache(c == '1' ? &l1 : &l2, optarg)) {
+                usage();
+                appl_error("A cache is size:assoc:line, with sets of a power-of-two line size.");
+            }
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (argc - optind != 1) {
+        usage();
+        appl_error("Expected one trace file.");
+    }
+    if (l2.line_shift != l1.line_shift) {
+        appl_error("The L1 and L2 lines must be the same size.");
+    }
+
+    trace_t *trace = read_trace(argv[optind], 0);
+    void **payloads = calloc(trace->num_ids, sizeof(void *));
+    size_t *sizes = calloc(trace->num_ids, sizeof(size_t));
+    if (payloads == NULL || sizes == NULL) {
+        appl_error("Failed to allocate the block arrays");
+    }
+    /* a trace's sizes bound its touches, whatever the addresses turn out to be */
+    size_t touches = 0;
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t op = trace->ops[i];
+        touches += op.type == ALLOC ? 0 : max_lines(sizes[op.index]);
+        if (op.type != FREE) {
+            touches += max_lines(op.size);
+            sizes[op.index] = op.size;
+        }
+    }
+    if (touches > UINT32_MAX) {
+        appl_error("The trace touches too many lines to time its reuse.");
+    }
+    if (uinit() == -1) {
+        appl_error("uinit failed.");
+    }
+
+    printf("L1 %zu KiB %d-way, L2 %zu KiB %d-way, %d-byte lines\n",
+        (l1.sets * l1.assoc << l1.line_shift) >> 10, l1.assoc,
+        (l2.sets * l2.assoc << l2.line_shift) >> 10, l2.assoc, 1 << l1.line_shift);
+    printf("%-22s %12s %9s %9s %11s %11s %12s %12s\n", "placement", "touches", "L1 miss", "L2 miss",
+        "L1 per op", "L2 per op", "reuse <L1", "reuse <L2");
+    const config_t *runs = all ? configs : &single;
+    int num_runs = all ? NUM_CONFIGS : 1;
+    for (int r = 0; r < num_runs; r++) {
+        simulate(trace, &runs[r], payloads, sizes, touches);
+        printf("%-22s %12lu %8.2f%% %8.2f%% %11.3f %11.3f %11.2f%% %11.2f%%\n", runs[r].name, l1.accesses,
+            l1.accesses ? 100.0 * l1.misses / l1.accesses : 0.0, l2.accesses ? 100.0 * l2.misses / l2.accesses : 0.0,
+            (double)l1.misses / trace->num_ops, (double)l2.misses / trace->num_ops,
+            within(l1.sets * l1.assoc), within(l2.sets * l2.assoc));
+    }
+    printf("L2 miss is of the L1 misses. reuse <L1 and <L2 are the touches a fully associative LRU cache\n"
+        "of that size would hit; L1 hits short of reuse <L1 are conflict misses.\n");
+    if (!all) {
+        print_reuse_histogram();
+    }
+
+    free(payloads);
+    free(sizes);
+    free(l1.tags);
+    free(l2.tags);
+    free(reuse_slots);
+    free(fenwick);
+    free_trace(trace);
+    return 0;
+}
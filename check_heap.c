@@ -1,59 +1,286 @@
-
+#define _GNU_SOURCE
 #include "umalloc.h"
+#include "csbrk.h"
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
 
 //Place any variables needed here from umalloc.c as an extern.
 extern memory_block_t *free_head;
+extern heap_segment_t *segments;
+extern int num_segments;
+extern bool segments_lost;
+extern memory_block_t *check_cursor;
+
+static char check_error[256];
 
 /*
- * check_heap -  used to check that the heap is still in a consistent state.
- *
- * STUDENT TODO:
- * Required to be completed for checkpoint 1:
- *
- *      - Ensure that the free block list is in the order you expect it to be in.
- *        As an example, if you maintain the free list in memory-address order,
- *        lowest address first, ensure that memory addresses strictly ascend as you
- *        traverse the free list.
- *
- *      - Check if any free memory_blocks overlap with each other. 
- *
- *      - Ensure that each memory_block is aligned. 
- * 
- * Should return 0 if the heap is still consistent, otherwise return a non-zero
- * return code. Asserts are also a useful tool here.
+ * One bit per ALIGNMENT bytes of heap, set at the header of every block on
+ * the free list, so the address-order walk can tell in O(1) whether a free
+ * block it meets is listed. Segments are laid end to end in the bitmap,
+ * which is mapped rather than malloced: the checker runs inside programs
+ * whose malloc heap may be fragmented or may be umalloc itself.
  */
-int check_heap() {
-    // Example heap check:
-    // Check that all blocks in the free list are marked free.
-    // If a block is marked allocated, return -1.
-    memory_block_t *cur = free_head;
-    while (cur) {
-        printf("block address: %p\n", cur);
-        printf("block_size_alloc: %d\n", (int)(cur->block_size_alloc));
-        printf("next: %p\n", cur->next);
-        printf("\n");
-        if (is_allocated(cur)) { // marked free
-            printf("allocated\n");
+static uint64_t *free_bits;
+static size_t free_bits_words;
+static size_t *segment_base; /* first bit of each segment */
+static size_t segment_base_len;
+
+/*
+ * fail - records what went wrong for check_heap_error and returns -1.
+ */
+static int fail(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(check_error, sizeof(check_error), fmt, args);
+    va_end(args);
+    return -1;
+}
+
+/*
+ * get_end - the address right after a block, where the next one starts.
+ */
+static memory_block_t *get_end(memory_block_t *block) {
+    return (memory_block_t *)((char *)block + HEADER_SIZE + get_size(block));
+}
+
+static size_t bit_index(int seg, void *addr) {
+    return segment_base[seg] + ((char *)addr - segments[seg].start) / ALIGNMENT;
+}
+
+static bool test_bit(size_t i) {
+    return free_bits[i / 64] >> (i % 64) & 1;
+}
+
+/*
+ * grow_mapping - makes room for at least needed entries of entry_size
+ * bytes in an anonymous mapping holding *len of them, doubling it from a
+ * page. Returns -1, leaving the mapping as it was, if it cannot grow.
+ */
+static int grow_mapping(void **table, size_t *len, size_t needed, size_t entry_size) {
+    if (needed <= *len) {
+        return 0;
+    }
+    size_t capacity = *len ? *len : PAGESIZE / entry_size;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    void *grown = *len
+        ? mremap(*table, *len * entry_size, capacity * entry_size, MREMAP_MAYMOVE)
+        : mmap(NULL, capacity * entry_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (grown == MAP_FAILED) {
+        return -1;
+    }
+    *table = grown;
+    *len = capacity;
+    return 0;
+}
+
+/*
+ * prepare_bitmap - sizes and clears the bitmap for the current segments.
+ * Returns -1 if the segments are out of address order.
+ */
+static int prepare_bitmap() {
+    size_t granules = 0;
+    if (grow_mapping((void **)&segment_base, &segment_base_len, num_segments, sizeof(size_t)) == -1) {
+        return fail("no memory for the segment table of %d segments", num_segments);
+    }
+    for (int i = 0; i < num_segments; i++) {
+        if (i && segments[i].start < segments[i - 1].end) {
+            return fail("segment %d at %p is below segment %d", i, segments[i].start, i - 1);
+        }
+        segment_base[i] = granules;
+        granules += (segments[i].end - segments[i].start) / ALIGNMENT + 1;
+    }
+    size_t words = granules / 64 + 1;
+    if (grow_mapping((void **)&free_bits, &free_bits_words, words, sizeof(uint64_t)) == -1) {
+        return fail("no memory for the free block bitmap");
+    }
+    memset(free_bits, 0, words * sizeof(uint64_t));
+    return 0;
+}
+
+/*
+ * check_block - the checks every block gets, listed or not: an aligned
+ * payload and a size that keeps it inside its segment.
+ */
+static int check_block(memory_block_t *block, char *segment_end) {
+    if ((uintptr_t)get_payload(block) % ALIGNMENT != 0) {
+        return fail("block %p has an unaligned payload", block);
+    }
+    if (get_size(block) == 0 || (char *)get_end(block) > segment_end) {
+        return fail("block %p of size %zu runs past its segment end %p", block, get_size(block), segment_end);
+    }
+    return 0;
+}
+
+/*
+ * check_free_list - walks the free list: every block must be marked free,
+ * in strictly ascending address order without overlapping the next, and
+ * inside a segment. Marks each one in the bitmap and counts them. Without
+ * known segments (the unit tests build their heaps by hand) only the list
+ * itself is checked.
+ */
+static int check_free_list(size_t *count) {
+    int seg = 0;
+    *count = 0;
+    for (memory_block_t *cur = free_head; cur; cur = get_next(cur)) {
+        (*count)++;
+        if (is_allocated(cur)) {
+            return fail("free list block %p is marked allocated", cur);
+        }
+        if ((uintptr_t)get_payload(cur) % ALIGNMENT != 0) {
+            return fail("free list block %p has an unaligned payload", cur);
+        }
+        memory_block_t *next = get_next(cur);
+        if (next && next <= cur) {
+            return fail("free list is out of order at %p -> %p", cur, next);
+        }
+        if (next && get_end(cur) > next) {
+            return fail("free list block %p overlaps the next one at %p", cur, next);
+        }
+        if (!num_segments) {
+            continue;
+        }
+        while (seg < num_segments && (char *)cur >= segments[seg].end) {
+            seg++;
+        }
+        if (seg == num_segments || (char *)cur < segments[seg].start + SEGMENT_PAD) {
+            return fail("free list block %p is outside the heap", cur);
+        }
+        if (check_block(cur, segments[seg].end - SEGMENT_PAD) == -1) {
             return -1;
         }
-        if(cur->next) {
-            if(cur > cur->next) { // address-sorted
-                printf("sorted wrong\n");
+        size_t bit = bit_index(seg, cur);
+        free_bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+    return 0;
+}
+
+/*
+ * check_segments - walks every block by address. Free blocks must be on
+ * the free list and never next to another free block, allocated ones must
+ * not be on it, the blocks must tile each segment exactly, and there must
+ * be as many free blocks as the list holds, which catches list entries
+ * that do not sit on a block boundary.
+ */
+static int check_segments(size_t listed) {
+    size_t walked = 0;
+    for (int seg = 0; seg < num_segments; seg++) {
+        char *end = segments[seg].end - SEGMENT_PAD;
+        bool prev_free = false;
+        memory_block_t *cur = (memory_block_t *)(segments[seg].start + SEGMENT_PAD);
+        for (; (char *)cur < end; cur = get_end(cur)) {
+            if (check_block(cur, end) == -1) {
                 return -1;
             }
-            // if memory address + size > next memory address return -1
-            if( ((uintptr_t)cur + cur->block_size_alloc + ALIGNMENT) > (uintptr_t)cur->next ) { // checking for overlap
-                printf("overlap\n");
-                return -1;
+            bool listed_here = test_bit(bit_index(seg, cur));
+            if (is_allocated(cur)) {
+                if (listed_here) {
+                    return fail("allocated block %p is on the free list", cur);
+                }
+                prev_free = false;
+                continue;
+            }
+            if (!listed_here) {
+                return fail("free block %p is not on the free list", cur);
             }
+            if (prev_free) {
+                return fail("free block %p was not coalesced with the one before it", cur);
+            }
+            prev_free = true;
+            walked++;
         }
-        if( ((uintptr_t)cur % ALIGNMENT) != 0) { // 16-byte aligned
-            printf("unaligned\n");
-            return -1;
+        if ((char *)cur != end) {
+            return fail("blocks of segment %d end at %p instead of %p", seg, cur, end);
         }
-        cur = cur->next;
+    }
+    if (walked != listed) {
+        return fail("the free list holds %zu blocks but the heap has %zu free ones", listed, walked);
     }
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * check_heap - checks the free list and every block of the heap in one
+ * linear pass each, with the heap lock held so a running maintenance
+ * thread cannot change the heap underneath. Prints nothing; returns 0 if
+ * the heap is consistent and -1 otherwise, with check_heap_error saying why.
+ */
+int check_heap() {
+    size_t listed;
+    lock_heap();
+    if (segments_lost) {
+        unlock_heap();
+        return fail("segments after the first %d were lost, so the heap cannot be walked", num_segments);
+    }
+    int ret = num_segments ? prepare_bitmap() : 0;
+    if (ret == 0) {
+        ret = check_free_list(&listed);
+    }
+    if (ret == 0 && num_segments) {
+        ret = check_segments(listed);
+    }
+    unlock_heap();
+    return ret;
+}
+
+/*
+ * check_heap_sampled - checks the next k blocks of the heap in address
+ * order, picking up where the previous call stopped and wrapping around at
+ * the end, so checking after every op costs O(k) and still covers the whole
+ * heap over time. Blocks get the per-block checks and adjacent free blocks
+ * are caught; whether a block is on the free list is left to check_heap.
+ */
+int check_heap_sampled(size_t k) {
+    static int seg;
+    int ret = 0;
+    lock_heap();
+    if (!num_segments) {
+        unlock_heap();
+        return 0;
+    }
+    memory_block_t *prev = NULL;
+    for (size_t i = 0; i < k && ret == 0; i++) {
+        if (!check_cursor || seg >= num_segments || (char *)check_cursor < segments[seg].start ||
+                (char *)check_cursor >= segments[seg].end) {
+            // ureset or a new segment moved things; find the cursor's segment again
+            for (seg = 0; check_cursor && seg < num_segments; seg++) {
+                if ((char *)check_cursor >= segments[seg].start && (char *)check_cursor < segments[seg].end) {
+                    break;
+                }
+            }
+            if (seg == num_segments || !check_cursor) {
+                seg = 0;
+                check_cursor = (memory_block_t *)(segments[0].start + SEGMENT_PAD);
+            }
+            prev = NULL;
+        }
+        char *end = segments[seg].end - SEGMENT_PAD;
+        memory_block_t *cur = check_cursor;
+        if ((ret = check_block(cur, end)) == 0 && prev && !is_allocated(prev) && !is_allocated(cur)) {
+            ret = fail("free block %p was not coalesced with the one before it", cur);
+        }
+        prev = cur;
+        check_cursor = get_end(cur);
+        if ((char *)check_cursor >= end) {
+            if (ret == 0 && (char *)check_cursor != end) {
+                ret = fail("blocks of segment %d end at %p instead of %p", seg, check_cursor, end);
+            }
+            seg = (seg + 1) % num_segments;
+            check_cursor = (memory_block_t *)(segments[seg].start + SEGMENT_PAD);
+            prev = NULL;
+        }
+    }
+    unlock_heap();
+    return ret;
+}
+
+/*
+ * check_heap_error - what the last failed check found.
+ */
+const char *check_heap_error() {
+    return check_error;
+}
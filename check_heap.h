@@ -1,2 +1,4 @@
 #include "umalloc.h"
-int check_heap();
\ No newline at end of file
+int check_heap();
+int check_heap_sampled(size_t k);
+const char *check_heap_error();
@@ -0,0 +1,245 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * heapmap.c - Reads heap snapshots written by uheap_dump, draws them as a
+ * map of the heap and measures how fragmented they are.
+ **************************************************************************/
+
+#include "heapmap.h"
+#include "ansicolors.h"
+#include <string.h>
+
+#define MAP_ROWS 32 /* rows the map is scaled to when no cell size is given */
+
+/* Free block size ranges reported by print_heapmap_metrics. */
+static const uint64_t free_bins[] = {64, 256, 1024, 4096, 16384, UINT64_MAX};
+#define NUM_FREE_BINS (sizeof(free_bins) / sizeof(free_bins[0]))
+
+/*
+ * read_heapmap - loads a snapshot. Returns NULL if the file cannot be read
+ * or is not a snapshot.
+ */
+heapmap_t *read_heapmap(const char *file) {
+    FILE *f = fopen(file, "r");
+    heapmap_t *map = calloc(1, sizeof(heapmap_t));
+    if (f == NULL || map == NULL) {
+        goto fail;
+    }
+    uheap_dump_header_t *h = &map->header;
+    if (fread(h, sizeof(*h), 1, f) != 1 || memcmp(h->magic, UHEAP_DUMP_MAGIC, sizeof(h->magic)) != 0 ||
+            h->num_segments == 0 || h->num_segments > h->num_blocks) {
+        goto fail;
+    }
+    map->segments = malloc(h->num_segments * sizeof(uheap_dump_segment_t));
+    map->blocks = malloc((h->num_blocks ? h->num_blocks : 1) * sizeof(uheap_dump_block_t));
+    if (map->segments == NULL || map->blocks == NULL ||
+            fread(map->segments, sizeof(uheap_dump_segment_t), h->num_segments, f) != h->num_segments ||
+            fread(map->blocks, sizeof(uheap_dump_block_t), h->num_blocks, f) != h->num_blocks) {
+        goto fail;
+    }
+    fclose(f);
+    return map;
+
+fail:
+    if (f) {
+        fclose(f);
+    }
+    free_heapmap(map);
+    return NULL;
+}
+
+void free_heapmap(heapmap_t *map) {
+    if (map) {
+        free(map->segments);
+        free(map->blocks);
+        free(map);
+    }
+}
+
+static uint64_t block_end(heapmap_t *map, uheap_dump_block_t *block) {
+    return block->offset + map->header.header_size + block->size;
+}
+
+/*
+ * cell_char - how a cell is drawn: '#' all allocated, '.' all free, '+'
+ * and '-' mostly allocated and mostly free, ' ' no block at all.
+ */
+static char cell_char(uint64_t used, uint64_t spare) {
+    if (!used && !spare) {
+        return ' ';
+    }
+    if (!spare) {
+        return '#';
+    }
+    if (!used) {
+        return '.';
+    }
+    return used >= spare ? '+' : '-';
+}
+
+static const char *cell_color(char c) {
+    switch (c) {
+    case '#':
+        return ANSI_COLOR_GREEN;
+    case '.':
+        return ANSI_COLOR_RED;
+    case ' ':
+        return ANSI_RESET;
+    default:
+        return ANSI_COLOR_YELLOW;
+    }
+}
+
+/*
+ * print_heapmap - draws every segment, columns cells to a row, each cell
+ * standing for cell_bytes bytes of heap. A cell_bytes of 0 scales the map
+ * to about MAP_ROWS rows, though every segment starts a row of its own.
+ * Headers count as part of their block. Each cell costs O(1) besides the
+ * blocks it covers, so this is one pass over both.
+ */
+void print_heapmap(FILE *out, heapmap_t *map, int columns, size_t cell_bytes, bool color) {
+    uint64_t heap_bytes = 0;
+    for (uint64_t s = 0; s < map->header.num_segments; s++) {
+        heap_bytes += map->segments[s].size;
+    }
+    if (cell_bytes == 0) {
+        cell_bytes = ALIGN(heap_bytes / ((uint64_t)columns * MAP_ROWS) + 1);
+    }
+    fprintf(out, "Each cell is %zu bytes: # allocated, . free, + mostly allocated, - mostly free\n", cell_bytes);
+    fprintf(out, "%4s %10s\n", "seg", "offset");
+
+    uint64_t b = 0;
+    for (uint64_t s = 0; s < map->header.num_segments; s++) {
+        uheap_dump_segment_t *seg = &map->segments[s];
+        uint64_t seg_end = seg->offset + seg->size;
+        const char *last_color = NULL;
+        int column = 0;
+        for (uint64_t lo = seg->offset; lo < seg_end; lo += cell_bytes) {
+            uint64_t hi = lo + cell_bytes < seg_end ? lo + cell_bytes : seg_end;
+            uint64_t used = 0, spare = 0;
+            while (b < map->header.num_blocks && map->blocks[b].segment == s && map->blocks[b].offset < hi) {
+                uheap_dump_block_t *block = &map->blocks[b];
+                uint64_t end = block_end(map, block);
+                uint64_t overlap = (end < hi ? end : hi) - (block->offset > lo ? block->offset : lo);
+                *(block->allocated ? &used : &spare) += overlap;
+                if (end > hi) {
+                    break;
+                }
+                b++;
+            }
+            if (column == 0) {
+                if (lo == seg->offset) {
+                    fprintf(out, "%4lu %10lx ", s, lo);
+                } else {
+                    fprintf(out, "%4s %10lx ", "", lo);
+                }
+                last_color = NULL;
+            }
+            char c = cell_char(used, spare);
+            if (color && cell_color(c) != last_color) {
+                last_color = cell_color(c);
+                fputs(last_color, out);
+            }
+            fputc(c, out);
+            if (++column == columns || hi == seg_end) {
+                fprintf(out, "%s\n", color ? ANSI_RESET : "");
+                column = 0;
+                last_color = NULL;
+            }
+        }
+    }
+}
+
+static int by_size(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * print_heapmap_metrics - summarizes a snapshot: how the heap splits into
+ * payloads, free space and overhead, external fragmentation, how much free
+ * space sits in blocks too small for a typical allocation, the free block
+ * sizes, free blocks left uncoalesced and the allocated blocks per size class.
+ */
+void print_heapmap_metrics(FILE *out, heapmap_t *map) {
+    uint64_t heap_bytes = 0, used_bytes = 0, free_bytes = 0, largest_free = 0;
+    uint64_t used_blocks = 0, free_blocks = 0, uncoalesced = 0;
+    uint64_t bin_blocks[NUM_FREE_BINS] = {0}, bin_bytes[NUM_FREE_BINS] = {0};
+    uint64_t class_blocks[1024 / ALIGNMENT + 1] = {0}, unclassed = 0;
+    uint64_t *sizes = malloc((map->header.num_blocks ? map->header.num_blocks : 1) * sizeof(uint64_t));
+    if (sizes == NULL) {
+        fprintf(out, "No memory for the heap map metrics\n");
+        return;
+    }
+
+    for (uint64_t s = 0; s < map->header.num_segments; s++) {
+        heap_bytes += map->segments[s].size;
+    }
+    for (uint64_t i = 0; i < map->header.num_blocks; i++) {
+        uheap_dump_block_t *block = &map->blocks[i];
+        if (block->allocated) {
+            sizes[used_blocks++] = block->size;
+            used_bytes += block->size;
+            if (block->class_size) {
+                class_blocks[block->class_size / ALIGNMENT]++;
+            } else {
+                unclassed++;
+            }
+            continue;
+        }
+        free_blocks++;
+        free_bytes += block->size;
+        if (block->size > largest_free) {
+            largest_free = block->size;
+        }
+        int bin = 0;
+        while (block->size > free_bins[bin]) {
+            bin++;
+        }
+        bin_blocks[bin]++;
+        bin_bytes[bin] += block->size;
+        if (i && !map->blocks[i - 1].allocated && map->blocks[i - 1].segment == block->segment &&
+                block_end(map, &map->blocks[i - 1]) == block->offset) {
+            uncoalesced++;
+        }
+    }
+    qsort(sizes, used_blocks, sizeof(uint64_t), by_size);
+    uint64_t median = used_blocks ? sizes[used_blocks / 2] : 0;
+    uint64_t stranded = 0;
+    for (uint64_t i = 0; i < map->header.num_blocks; i++) {
+        if (!map->blocks[i].allocated && map->blocks[i].size < median) {
+            stranded += map->blocks[i].size;
+        }
+    }
+    free(sizes);
+
+    fprintf(out, "Heap map: %lu bytes in %lu segments, %lu blocks\n",
+        heap_bytes, map->header.num_segments, map->header.num_blocks);
+    fprintf(out, "  allocated %lu bytes in %lu blocks (%.1f%% of the heap), median block %lu bytes\n",
+        used_bytes, used_blocks, heap_bytes ? 100.0 * used_bytes / heap_bytes : 0.0, median);
+    fprintf(out, "  free %lu bytes in %lu blocks (%.1f%%), largest %lu bytes\n",
+        free_bytes, free_blocks, heap_bytes ? 100.0 * free_bytes / heap_bytes : 0.0, largest_free);
+    fprintf(out, "  headers and padding %lu bytes\n", heap_bytes - used_bytes - free_bytes);
+    fprintf(out, "  external fragmentation (1 - largest free / free) %.3f\n",
+        free_bytes ? 1.0 - (double)largest_free / free_bytes : 0.0);
+    fprintf(out, "  %.1f%% of free bytes in blocks smaller than the median allocated block\n",
+        free_bytes ? 100.0 * stranded / free_bytes : 0.0);
+    if (uncoalesced) {
+        fprintf(out, "  %lu free blocks not coalesced with the free block before them\n", uncoalesced);
+    }
+    fprintf(out, "  free blocks by size:");
+    for (int bin = 0; bin < NUM_FREE_BINS; bin++) {
+        if (free_bins[bin] == UINT64_MAX) {
+            fprintf(out, " >%lu: %lu (%lu bytes)\n", free_bins[bin - 1], bin_blocks[bin], bin_bytes[bin]);
+        } else {
+            fprintf(out, " <=%lu: %lu (%lu bytes),", free_bins[bin], bin_blocks[bin], bin_bytes[bin]);
+        }
+    }
+    fprintf(out, "  allocated blocks per size class:");
+    for (int cls = 0; cls <= 1024 / ALIGNMENT; cls++) {
+        if (class_blocks[cls]) {
+            fprintf(out, " %d:%lu", cls * ALIGNMENT, class_blocks[cls]);
+        }
+    }
+    fprintf(out, " larger:%lu\n", unclassed);
+}
@@ -0,0 +1,24 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * heapmap.h - Reads heap snapshots written by uheap_dump, draws them as a
+ * map of the heap and measures how fragmented they are.
+ **************************************************************************/
+
+#ifndef HEAPMAP_H
+#define HEAPMAP_H
+
+#include "umalloc.h"
+
+typedef struct {
+    uheap_dump_header_t header;
+    uheap_dump_segment_t *segments;
+    uheap_dump_block_t *blocks;
+} heapmap_t;
+
+heapmap_t *read_heapmap(const char *file);
+void free_heapmap(heapmap_t *map);
+void print_heapmap(FILE *out, heapmap_t *map, int columns, size_t cell_bytes, bool color);
+void print_heapmap_metrics(FILE *out, heapmap_t *map);
+
+#endif
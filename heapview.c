@@ -0,0 +1,73 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * heapview.c - Shows a heap snapshot written by uheap_dump (or by the
+ * runner's dump command) as a map of the heap, colored when printing to a
+ * terminal, followed by its fragmentation metrics.
+ **************************************************************************/
+
+#include "heapmap.h"
+#include "support.h"
+
+#define DEFAULT_COLUMNS 64
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: heapview [-m] [-n] [-c columns] [-b bytes] snapshot\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-c columns Cells per row of the map (default %d).\n", DEFAULT_COLUMNS);
+    fprintf(stderr, "\t-b bytes   Heap bytes per cell (default: fit the map in about 32 rows).\n");
+    fprintf(stderr, "\t-n         No colors, even on a terminal.\n");
+    fprintf(stderr, "\t-m         Print only the metrics, not the map.\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    int columns = DEFAULT_COLUMNS;
+    size_t cell_bytes = 0;
+    bool color = isatty(STDOUT_FILENO);
+    bool metrics_only = false;
+    char err_msg[MAXLINE];
+
+    while ((c = getopt(argc, argv, "mnc:b:")) != -1) {
+        switch (c) {
+        case 'm':
+            metrics_only = true;
+            break;
+        case 'n':
+            color = false;
+            break;
+        case 'c':
+            columns = atoi(optarg);
+            break;
+        case 'b':
+            cell_bytes = atol(optarg);
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (columns <= 0) {
+        usage();
+        appl_error("The map needs at least one column.");
+    }
+    if (argc - optind != 1) {
+        usage();
+        appl_error("Expected one snapshot file.");
+    }
+
+    heapmap_t *map = read_heapmap(argv[optind]);
+    if (map == NULL) {
+        sprintf(err_msg, "Could not read the heap snapshot %s", argv[optind]);
+        appl_error(err_msg);
+    }
+    if (!metrics_only) {
+        print_heapmap(stdout, map, columns, cell_bytes, color);
+    }
+    print_heapmap_metrics(stdout, map);
+    free_heapmap(map);
+    return 0;
+}
@@ -0,0 +1,54 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * histogram.c - Log-linear (HDR style) histograms of nanosecond latencies.
+ **************************************************************************/
+
+#include "histogram.h"
+
+/*
+ * bucket_high - the largest value that lands in a bucket.
+ */
+static uint64_t bucket_high(unsigned index) {
+    if (index < HIST_SUB_COUNT) {
+        return index;
+    }
+    unsigned shift = index / HIST_SUB_COUNT - 1;
+    uint64_t low = (uint64_t)(HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+ * hist_percentile - the value percentile percent of the recorded values
+ * do not exceed, reported as the top of its bucket but never above the
+ * largest value recorded. 0 for an empty histogram.
+ */
+uint64_t hist_percentile(histogram_t *h, double percentile) {
+    uint64_t rank = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    uint64_t seen = 0;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t high = bucket_high(i);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * hist_merge - adds every count of from into into.
+ */
+void hist_merge(histogram_t *into, histogram_t *from) {
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
@@ -0,0 +1,48 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * histogram.h - Log-linear (HDR style) histograms of nanosecond latencies.
+ **************************************************************************/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Values below 2^HIST_SUB_BITS get a bucket each; every power of two above
+ * that is split into 2^HIST_SUB_BITS equal buckets, so a recorded value is
+ * off by at most 1/32 of itself whatever its magnitude.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+/*
+ * hist_record - counts one value.
+ */
+static inline void hist_record(histogram_t *h, uint64_t value) {
+    unsigned index = value;
+    if (value >= HIST_SUB_COUNT) {
+        unsigned shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+        index = (shift + 1) * HIST_SUB_COUNT + ((value >> shift) & (HIST_SUB_COUNT - 1));
+    }
+    h->counts[index]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+uint64_t hist_percentile(histogram_t *h, double percentile);
+void hist_merge(histogram_t *into, histogram_t *from);
+
+#endif
@@ -0,0 +1,313 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * mtperformance.c - Replays traces on several threads at once and reports
+ * how umalloc scales from 1 to N threads, next to the system malloc.
+ *
+ * Given several traces, thread i replays trace i modulo their number.
+ * Given one trace, its ids are partitioned over the threads: the thread
+ * owning an id makes every allocation and realloc of it, and with -x the
+ * next thread frees it, waiting for the owner to get there first.
+ **************************************************************************/
+
+#define _GNU_SOURCE
+#include "umalloc.h"
+#include "support.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+
+#define MAX_THREADS 256
+
+typedef struct {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+} allocator_t;
+
+static void *umalloc_op(size_t size) {
+    return umalloc_fast(size);
+}
+
+static void ufree_op(void *ptr) {
+    ufree_fast(ptr);
+}
+
+static const allocator_t allocators[] = {
+    {"umalloc", umalloc_op, ufree_op, urealloc},
+    {"malloc", malloc, free, realloc},
+};
+
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+/* What one thread replays. */
+typedef struct {
+    int cpu;
+    traceop_t *ops;
+    size_t num_ops;
+    _Atomic(void *) *payloads; /* indexed by id */
+    atomic_int *done;          /* ops finished per id, when frees wait */
+    const allocator_t *allocator;
+    struct timespec start, end;
+} worker_t;
+
+/* What a run sends back from its child process. */
+typedef struct {
+    int failed;
+    double wall_ms;
+    uint64_t ops[MAX_THREADS];
+    double ms[MAX_THREADS];
+} result_t;
+
+static trace_t **traces;
+static int num_traces;
+static int cross_frees;
+static pthread_barrier_t start_barrier;
+
+static double elapsed_ms(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * worker - pins itself, waits at the barrier and replays its ops. A free
+ * that must wait carries, in its size field, how many earlier ops of its
+ * id have to be done before it can go.
+ */
+static void *worker(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    const allocator_t *a = w->allocator;
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    pthread_barrier_wait(&start_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &w->start);
+    for (size_t i = 0; i < w->num_ops; i++) {
+        traceop_t op = w->ops[i];
+        _Atomic(void *) *slot = &w->payloads[op.index];
+        if (op.type == ALLOC) {
+            atomic_store_explicit(slot, a->alloc(op.size), memory_order_release);
+        } else if (op.type == REALLOC) {
+            void *old = atomic_load_explicit(slot, memory_order_relaxed);
+            atomic_store_explicit(slot, a->realloc(old, op.size), memory_order_release);
+        } else {
+            if (w->done) {
+                while (atomic_load_explicit(&w->done[op.index], memory_order_acquire) < op.size) {
+                    sched_yield();
+                }
+            }
+            a->free(atomic_load_explicit(slot, memory_order_acquire));
+        }
+        if (w->done) {
+            atomic_fetch_add_explicit(&w->done[op.index], 1, memory_order_release);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &w->end);
+    return NULL;
+}
+
+/*
+ * partition - splits one trace over num_threads workers by id. Frees go to
+ * the next thread with -x, and are tagged with the ops they must wait for.
+ */
+static void partition(trace_t *trace, worker_t *workers, int num_threads) {
+    int *seen = calloc(trace->num_ids, sizeof(int));
+    if (seen == NULL) {
+        appl_error("Failed to allocate the partition counts");
+    }
+    for (int t = 0; t < num_threads; t++) {
+        workers[t].ops = malloc(trace->num_ops * sizeof(traceop_t));
+        if (workers[t].ops == NULL) {
+            appl_error("Failed to allocate a partition");
+        }
+    }
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t op = trace->ops[i];
+        int t = op.index % num_threads;
+        if (op.type == FREE) {
+            op.size = seen[op.index];
+            if (cross_frees) {
+                t = (t + 1) % num_threads;
+            }
+        }
+        seen[op.index]++;
+        workers[t].ops[workers[t].num_ops++] = op;
+    }
+    free(seen);
+}
+
+/*
+ * run - replays with num_threads threads and the given allocator, filling
+ * in the result. Runs in a child process so every run starts on a fresh heap.
+ */
+static void run(int num_threads, const allocator_t *allocator, result_t *result) {
+    worker_t workers[MAX_THREADS] = {{0}};
+    pthread_t threads[MAX_THREADS];
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (allocator->alloc == umalloc_op && uinit() == -1) {
+        appl_error("uinit failed.");
+    }
+    if (num_traces == 1) {
+        trace_t *trace = traces[0];
+        _Atomic(void *) *payloads = calloc(trace->num_ids, sizeof(void *));
+        atomic_int *done = cross_frees ? calloc(trace->num_ids, sizeof(atomic_int)) : NULL;
+        if (payloads == NULL || (cross_frees && done == NULL)) {
+            appl_error("Failed to allocate the payload array");
+        }
+        partition(trace, workers, num_threads);
+        for (int t = 0; t < num_threads; t++) {
+            workers[t].payloads = payloads;
+            workers[t].done = done;
+        }
+    } else {
+        for (int t = 0; t < num_threads; t++) {
+            trace_t *trace = traces[t % num_traces];
+            workers[t].ops = trace->ops;
+            workers[t].num_ops = trace->num_ops;
+            workers[t].payloads = calloc(trace->num_ids, sizeof(void *));
+            if (workers[t].payloads == NULL) {
+                appl_error("Failed to allocate the payload array");
+            }
+        }
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+    for (int t = 0; t < num_threads; t++) {
+        workers[t].cpu = t % num_cpus;
+        workers[t].allocator = allocator;
+        if (pthread_create(&threads[t], NULL, worker, &workers[t]) != 0) {
+            appl_error("pthread_create failed.");
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    /* the run lasts from the first thread starting to the last finishing */
+    struct timespec *first = &workers[0].start, *last = &workers[0].end;
+    for (int t = 0; t < num_threads; t++) {
+        if (elapsed_ms(first, &workers[t].start) < 0) {
+            first = &workers[t].start;
+        }
+        if (elapsed_ms(last, &workers[t].end) > 0) {
+            last = &workers[t].end;
+        }
+        result->ops[t] = workers[t].num_ops;
+        result->ms[t] = elapsed_ms(&workers[t].start, &workers[t].end);
+    }
+    result->wall_ms = elapsed_ms(first, last);
+}
+
+/*
+ * run_in_child - forks, runs, and reads the result back through a pipe.
+ */
+static void run_in_child(int num_threads, const allocator_t *allocator, result_t *result) {
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds) == -1 || (pid = fork()) == -1) {
+        appl_error("Could not start a run.");
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        memset(result, 0, sizeof(*result));
+        run(num_threads, allocator, result);
+        if (write(fds[1], result, sizeof(*result)) != sizeof(*result)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    memset(result, 0, sizeof(*result));
+    if (read(fds[0], result, sizeof(*result)) != sizeof(*result)) {
+        result->failed = 1;
+    }
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: mtperformance [-x] [-t threads] trace...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-t threads Scale from 1 up to this many threads (default: online CPUs).\n");
+    fprintf(stderr, "\t-x         With one trace, free every block on another thread.\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((c = getopt(argc, argv, "xt:")) != -1) {
+        switch (c) {
+        case 'x':
+            cross_frees = 1;
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (max_threads <= 0 || max_threads > MAX_THREADS) {
+        usage();
+        appl_error("The thread count must be between 1 and 256.");
+    }
+    num_traces = argc - optind;
+    if (num_traces == 0) {
+        usage();
+        appl_error("No File parameter provided.");
+    }
+    traces = calloc(num_traces, sizeof(trace_t *));
+    if (traces == NULL) {
+        appl_error("Failed to allocate the trace array");
+    }
+    for (int i = 0; i < num_traces; i++) {
+        traces[i] = read_trace(argv[optind + i], 0);
+    }
+
+    printf("%s, %ld cpus\n", num_traces == 1 ? (cross_frees ?
+        "one trace partitioned by id, cross-thread frees" : "one trace partitioned by id") :
+        "one trace per thread", sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%7s %-8s %12s %10s  %s\n", "threads", "alloc", "ops/ms", "scaling", "per-thread ops/ms");
+    double base[NUM_ALLOCATORS] = {0};
+    for (int t = 1; t <= max_threads; t++) {
+        for (int a = 0; a < NUM_ALLOCATORS; a++) {
+            result_t result;
+            run_in_child(t, &allocators[a], &result);
+            if (result.failed) {
+                printf("%7d %-8s %12s\n", t, allocators[a].name, "failed");
+                continue;
+            }
+            uint64_t total = 0;
+            for (int i = 0; i < t; i++) {
+                total += result.ops[i];
+            }
+            double rate = total / result.wall_ms;
+            if (t == 1) {
+                base[a] = rate;
+            }
+            printf("%7d %-8s %12.0f %9.1f%% ", t, allocators[a].name, rate,
+                base[a] ? 100.0 * rate / (t * base[a]) : 0);
+            for (int i = 0; i < t; i++) {
+                printf(" %.0f", result.ms[i] ? result.ops[i] / result.ms[i] : 0);
+            }
+            printf("\n");
+        }
+    }
+
+    for (int i = 0; i < num_traces; i++) {
+        free_trace(traces[i]);
+    }
+    free(traces);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * perfctr.c - Hardware performance counters of the calling thread, read
+ * through perf_event_open.
+ **************************************************************************/
+
+#define _GNU_SOURCE
+#include "perfctr.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+const char *perf_counter_names[NUM_PERF_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "L1d-misses",
+    "LLC-misses",
+    "dTLB-misses",
+    "branch-misses"
+};
+
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[NUM_PERF_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+        PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+        PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+/*
+ * perfctr_open - opens and starts every counter it can for the calling
+ * thread, in user space only so it works under perf_event_paranoid 2.
+ * Returns how many were opened.
+ */
+int perfctr_open(perfctr_t *ctr) {
+    struct perf_event_attr attr;
+    ctr->num_open = 0;
+    ctr->error = 0;
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        ctr->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (ctr->fd[i] == -1) {
+            if (!ctr->error) {
+                ctr->error = errno;
+            }
+            continue;
+        }
+        ctr->num_open++;
+    }
+    return ctr->num_open;
+}
+
+/*
+ * perfctr_read - takes the current value of every open counter.
+ */
+void perfctr_read(perfctr_t *ctr, perf_sample_t *sample) {
+    uint64_t buf[3];
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        sample->valid[i] = false;
+        if (ctr->fd[i] == -1 || read(ctr->fd[i], buf, sizeof(buf)) != sizeof(buf)) {
+            continue;
+        }
+        sample->value[i] = buf[0];
+        sample->enabled[i] = buf[1];
+        sample->running[i] = buf[2];
+        sample->valid[i] = true;
+    }
+}
+
+/*
+ * perfctr_delta - the counts between two samples, scaled by how long each
+ * counter actually ran in between.
+ */
+void perfctr_delta(perf_sample_t *from, perf_sample_t *to, perf_sample_t *delta) {
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        uint64_t enabled = to->enabled[i] - from->enabled[i];
+        uint64_t running = to->running[i] - from->running[i];
+        delta->valid[i] = from->valid[i] && to->valid[i] && running > 0;
+        delta->enabled[i] = enabled;
+        delta->running[i] = running;
+        delta->value[i] = delta->valid[i] ?
+            (uint64_t)((double)(to->value[i] - from->value[i]) * enabled / running) : 0;
+    }
+}
+
+void perfctr_close(perfctr_t *ctr) {
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        if (ctr->fd[i] != -1) {
+            close(ctr->fd[i]);
+            ctr->fd[i] = -1;
+        }
+    }
+    ctr->num_open = 0;
+}
+
+/*
+ * perfctr_explain - says why counters are missing, if they are.
+ */
+void perfctr_explain(perfctr_t *ctr, FILE *out) {
+    if (ctr->num_open == NUM_PERF_COUNTERS) {
+        return;
+    }
+    fprintf(out, "%d of %d hardware counters unavailable (%s)", NUM_PERF_COUNTERS - ctr->num_open,
+        NUM_PERF_COUNTERS, strerror(ctr->error));
+    if (ctr->error == EACCES || ctr->error == EPERM) {
+        fprintf(out, "; lower /proc/sys/kernel/perf_event_paranoid");
+    } else if (ctr->error == ENOENT || ctr->error == EOPNOTSUPP) {
+        fprintf(out, "; the CPU or hypervisor does not expose them");
+    }
+    fprintf(out, "\n");
+}
@@ -0,0 +1,55 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * perfctr.h - Hardware performance counters of the calling thread, read
+ * through perf_event_open.
+ **************************************************************************/
+
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_BRANCH_MISSES,
+    NUM_PERF_COUNTERS
+} perf_counter_t;
+
+/*
+ * The counters that could be opened. Each is opened on its own, so one the
+ * CPU lacks does not take the others down with it, and the kernel
+ * multiplexes them if there are more than hardware counters.
+ */
+typedef struct {
+    int fd[NUM_PERF_COUNTERS]; /* -1 if unavailable */
+    int num_open;
+    int error;                 /* errno of the first counter that failed */
+} perfctr_t;
+
+/*
+ * Counter values at one point, scaled up for the time a counter was not
+ * scheduled. valid is false for counters that are unavailable or never ran.
+ */
+typedef struct {
+    uint64_t value[NUM_PERF_COUNTERS];
+    uint64_t enabled[NUM_PERF_COUNTERS];
+    uint64_t running[NUM_PERF_COUNTERS];
+    bool valid[NUM_PERF_COUNTERS];
+} perf_sample_t;
+
+extern const char *perf_counter_names[NUM_PERF_COUNTERS];
+
+int perfctr_open(perfctr_t *ctr);
+void perfctr_read(perfctr_t *ctr, perf_sample_t *sample);
+void perfctr_delta(perf_sample_t *from, perf_sample_t *to, perf_sample_t *delta);
+void perfctr_close(perfctr_t *ctr);
+void perfctr_explain(perfctr_t *ctr, FILE *out);
+
+#endif
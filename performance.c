@@ -9,37 +9,447 @@
 
 #include "umalloc.h"
 #include "support.h"
+#include "histogram.h"
+#include "perfctr.h"
 
-static void run_trace(trace_t *trace) {
+/*
+ * Latencies are kept per op and per size class. Class i holds requests of
+ * at most 16 << i bytes, the last class everything larger.
+ */
+enum {OP_UMALLOC, OP_UREALLOC, OP_UFREE, NUM_LATENCY_OPS};
+#define SIZE_BINS 16
+
+typedef enum {FORMAT_TEXT, FORMAT_JSON, FORMAT_CSV} format_t;
+
+static const char *op_names[NUM_LATENCY_OPS] = {"umalloc", "urealloc", "ufree"};
+static histogram_t latency[NUM_LATENCY_OPS][SIZE_BINS];
+static uint64_t timer_overhead_ns;
+static FILE *report; /* everything but -F json or csv output, which alone goes to stdout */
+
+/*
+ * elapsed_ns - nanoseconds between two timestamps.
+ */
+static uint64_t elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * calibrate_timer - the cheapest back-to-back pair of clock_gettime calls,
+ * which is subtracted from every op so the histograms hold the op alone.
+ */
+static uint64_t calibrate_timer(void) {
+    struct timespec a, b;
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 100000; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        uint64_t ns = elapsed_ns(&a, &b);
+        if (ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+static int size_bin(size_t size) {
+    int bin = 0;
+    while (bin < SIZE_BINS - 1 && size > (16UL << bin)) {
+        bin++;
+    }
+    return bin;
+}
+
+/*
+ * record_latency - adds one op's latency, less the timer's own cost.
+ */
+static void record_latency(int op, size_t size, uint64_t ns) {
+    ns = ns > timer_overhead_ns ? ns - timer_overhead_ns : 0;
+    hist_record(&latency[op][size_bin(size)], ns);
+}
+
+/*
+ * size_label - names a size class, e.g. "<=4KiB".
+ */
+static void size_label(int bin, char *label) {
+    size_t limit = 16UL << (bin < SIZE_BINS - 1 ? bin : bin - 1);
+    const char *prefix = bin < SIZE_BINS - 1 ? "<=" : ">";
+    if (limit >= 1024) {
+        sprintf(label, "%s%zuKiB", prefix, limit / 1024);
+    } else {
+        sprintf(label, "%s%zuB", prefix, limit);
+    }
+}
+
+/*
+ * print_row - one op and size class in the chosen format.
+ */
+static void print_row(format_t format, int op, const char *label, histogram_t *h, bool first) {
+    double mean = h->total ? (double)h->sum / h->total : 0;
+    uint64_t p50 = hist_percentile(h, 50), p90 = hist_percentile(h, 90);
+    uint64_t p99 = hist_percentile(h, 99), p999 = hist_percentile(h, 99.9);
+    if (format == FORMAT_JSON) {
+        printf("%s\n    {\"op\": \"%s\", \"size_class\": \"%s\", \"count\": %lu, \"mean_ns\": %.1f, "
+            "\"p50_ns\": %lu, \"p90_ns\": %lu, \"p99_ns\": %lu, \"p99_9_ns\": %lu, \"max_ns\": %lu}",
+            first ? "" : ",", op_names[op], label, h->total, mean, p50, p90, p99, p999, h->max);
+    } else if (format == FORMAT_CSV) {
+        printf("%s,%s,%lu,%.1f,%lu,%lu,%lu,%lu,%lu\n",
+            op_names[op], label, h->total, mean, p50, p90, p99, p999, h->max);
+    } else {
+        printf("  %-10s %10lu %8.1f %8lu %8lu %8lu %8lu %10lu\n",
+            label, h->total, mean, p50, p90, p99, p999, h->max);
+    }
+}
+
+/*
+ * print_latency - p50, p90, p99, p99.9 and max of every op, over all sizes
+ * and per size class, in nanoseconds.
+ */
+static void print_latency(format_t format) {
+    char label[32];
+    bool first = true;
+    if (format == FORMAT_JSON) {
+        printf("{\"timer_overhead_ns\": %lu, \"latency\": [", timer_overhead_ns);
+    } else if (format == FORMAT_CSV) {
+        printf("op,size_class,count,mean_ns,p50_ns,p90_ns,p99_ns,p99_9_ns,max_ns\n");
+    }
+    for (int op = 0; op < NUM_LATENCY_OPS; op++) {
+        histogram_t all = {{0}};
+        for (int bin = 0; bin < SIZE_BINS; bin++) {
+            hist_merge(&all, &latency[op][bin]);
+        }
+        if (!all.total) {
+            continue;
+        }
+        if (format == FORMAT_TEXT) {
+            printf("%s latency in ns (timer overhead of %lu ns subtracted):\n", op_names[op], timer_overhead_ns);
+            printf("  %-10s %10s %8s %8s %8s %8s %8s %10s\n",
+                "size", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+        }
+        print_row(format, op, "all", &all, first);
+        first = false;
+        for (int bin = 0; bin < SIZE_BINS; bin++) {
+            if (latency[op][bin].total) {
+                size_label(bin, label);
+                print_row(format, op, label, &latency[op][bin], false);
+            }
+        }
+    }
+    if (format == FORMAT_JSON) {
+        printf("\n]}\n");
+    }
+}
+
+/*
+ * Hardware counters are read before uinit, after it, and at the end of each
+ * of num_phases equal slices of the replay, so the report shows how the
+ * cost per op moves as the heap fills up.
+ */
+#define MAX_PHASES 64
+
+static perfctr_t counters;
+static int num_phases; /* 0 when the counters are off */
+static size_t guard_bytes; /* 0 when guarded allocations are off */
+static perf_sample_t phase_marks[MAX_PHASES + 2];
+static size_t phase_ops[MAX_PHASES + 2];
+static int num_marks;
+
+/*
+ * phase_mark - reads the counters at op curr_op and returns the op at which
+ * the next phase ends, or SIZE_MAX after the last one.
+ */
+static size_t phase_mark(size_t curr_op, size_t num_ops) {
+    phase_ops[num_marks] = curr_op;
+    perfctr_read(&counters, &phase_marks[num_marks++]);
+    if (num_marks < 2 || num_marks > num_phases) {
+        return num_marks < 2 ? 0 : SIZE_MAX;
+    }
+    return num_ops * (num_marks - 1) / num_phases;
+}
+
+/*
+ * print_counter_row - the counts between two marks, per op if ops is not 0.
+ */
+static void print_counter_row(const char *label, perf_sample_t *from, perf_sample_t *to, size_t ops) {
+    perf_sample_t delta;
+    perfctr_delta(from, to, &delta);
+    fprintf(report, "%-20s", label);
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        if (!delta.valid[i]) {
+            fprintf(report, " %14s", "n/a");
+        } else if (ops) {
+            fprintf(report, " %14.2f", (double)delta.value[i] / ops);
+        } else {
+            fprintf(report, " %14lu", delta.value[i]);
+        }
+    }
+    if (delta.valid[PERF_CYCLES] && delta.valid[PERF_INSTRUCTIONS] && delta.value[PERF_CYCLES]) {
+        fprintf(report, " %6.2f", (double)delta.value[PERF_INSTRUCTIONS] / delta.value[PERF_CYCLES]);
+    }
+    fprintf(report, "\n");
+}
+
+/*
+ * print_counters - uinit in total counts, then every phase of the replay
+ * and the whole replay per op.
+ */
+static void print_counters(void) {
+    char label[64];
+    fprintf(report, "Hardware counters (user space, replay thread only):\n");
+    perfctr_explain(&counters, report);
+    if (!counters.num_open) {
+        return;
+    }
+    fprintf(report, "%-20s", "phase");
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        fprintf(report, " %14s", perf_counter_names[i]);
+    }
+    fprintf(report, " %6s\n", "IPC");
+    print_counter_row("uinit (total)", &phase_marks[0], &phase_marks[1], 0);
+    for (int m = 1; num_phases > 1 && m + 1 < num_marks; m++) {
+        snprintf(label, sizeof(label), "ops %zu-%zu", phase_ops[m], phase_ops[m + 1]);
+        print_counter_row(label, &phase_marks[m], &phase_marks[m + 1], phase_ops[m + 1] - phase_ops[m]);
+    }
+    snprintf(label, sizeof(label), "replay (per op)");
+    print_counter_row(label, &phase_marks[1], &phase_marks[num_marks - 1], phase_ops[num_marks - 1]);
+}
+
+/*
+ * replay_op - runs one op against the block it refers to, timing it if
+ * latencies are being measured. Frees are classed by the size they free.
+ */
+static inline void replay_op(allocated_block_t *block, traceop_t op, int measure_latency) {
+    struct timespec op_start, op_end;
+    if (measure_latency) {
+        clock_gettime(CLOCK_MONOTONIC, &op_start);
+    }
+    if (op.type == ALLOC) {
+        block->payload = umalloc_fast(op.size);
+    } else if (op.type == REALLOC) {
+        block->payload = urealloc(block->payload, op.size);
+    } else {
+        ufree_fast(block->payload);
+    }
+    if (measure_latency) {
+        clock_gettime(CLOCK_MONOTONIC, &op_end);
+        if (op.type == FREE) {
+            record_latency(OP_UFREE, block->block_size, elapsed_ns(&op_start, &op_end));
+        } else {
+            record_latency(op.type == ALLOC ? OP_UMALLOC : OP_UREALLOC, op.size, elapsed_ns(&op_start, &op_end));
+            block->block_size = op.size;
+        }
+    }
+}
+
+/*
+ * run_trace - replays a loaded trace, or a streamed one if stream is not
+ * NULL, and prints the elapsed time. Streamed ops find their payloads in a
+ * map of live ids instead of the trace's block array.
+ */
+static void run_trace(trace_t *trace, trace_stream_t *stream, int maintenance_us, int measure_latency) {
 
     struct timespec start, end;
+    id_map_t *live_blocks = stream ? new_id_map() : NULL;
+    traceop_t op;
+    size_t num_ops = stream ? stream->num_ops : trace->num_ops;
+    size_t next_mark = SIZE_MAX;
+    size_t curr_op;
+    if (num_phases) {
+        phase_mark(0, num_ops);
+    }
     clock_gettime(CLOCK_MONOTONIC, &start);
     uinit();
-    for(size_t curr_op = 0; curr_op < trace->num_ops; curr_op++) {
-        if (curr_op % 5 == 0) {
-            sbrk(4096);
+    if (guard_bytes && uguard_start(guard_bytes, UGUARD_DEFAULT_SLOTS) == -1) {
+        appl_error("Could not set up the guard pages.");
+    }
+    if (maintenance_us && start_maintenance(maintenance_us) == -1) {
+        appl_error("Could not start the maintenance thread.");
+    }
+    if (num_phases) {
+        next_mark = phase_mark(0, num_ops);
+    }
+    if (stream) {
+        for (curr_op = 0; next_trace_op(stream, &op); curr_op++) {
+            while (curr_op == next_mark) {
+                next_mark = phase_mark(curr_op, num_ops);
+            }
+            if (curr_op % 5 == 0) {
+                sbrk(4096);
+            }
+            allocated_block_t *block = op.type == ALLOC ?
+                id_map_insert(live_blocks, op.index) : id_map_find(live_blocks, op.index);
+            if (block == NULL) {
+                appl_error("Trace refers to an id that is not allocated.");
+            }
+            replay_op(block, op, measure_latency);
+            if (op.type == FREE) {
+                id_map_remove(live_blocks, op.index);
+            }
         }
-        traceop_t op = trace->ops[curr_op];
-        if (op.type == ALLOC) {
-            trace->blocks[op.index].payload = umalloc(op.size);
-        } else {
-            ufree(trace->blocks[op.index].payload);
+    } else {
+        for(curr_op = 0; curr_op < trace->num_ops; curr_op++) {
+            while (curr_op == next_mark) {
+                next_mark = phase_mark(curr_op, num_ops);
+            }
+            if (curr_op % 5 == 0) {
+                sbrk(4096);
+            }
+            op = trace->ops[curr_op];
+            replay_op(&trace->blocks[op.index], op, measure_latency);
         }
     }
+    if (num_phases) {
+        phase_mark(curr_op, num_ops);
+    }
+    stop_maintenance();
     clock_gettime(CLOCK_MONOTONIC, &end);
     uint64_t delta_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
-    printf("Success: %ld", delta_us);
+    fprintf(report, "Success: %ld", delta_us);
+    if (live_blocks) {
+        free_id_map(live_blocks);
+    }
 }
 
 
 
+/* 
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: performance [-eplsS] [-P phases] [-F format] [-f policy] [-m us] [-G bytes] file\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-l         Print latency percentiles per op and size class.\n");
+    fprintf(stderr, "\t-F format  Print them as text, json or csv (implies -l); json and csv alone go to stdout.\n");
+    fprintf(stderr, "\t-e         Count cycles, instructions and cache, TLB and branch misses per op.\n");
+    fprintf(stderr, "\t-P phases  Also count each of this many slices of the trace (implies -e).\n");
+    fprintf(stderr, "\t-m us      Run the maintenance thread, waking up every us microseconds.\n");
+    fprintf(stderr, "\t-f policy  Placement policy: best (the default), good, first or adaptive.\n");
+    fprintf(stderr, "\t-G bytes   Give an allocation every bytes bytes on average guard pages.\n");
+    fprintf(stderr, "\t-p         Print the placement policy decisions after the run.\n");
+    fprintf(stderr, "\t-S         Print the heap statistics after the run.\n");
+    fprintf(stderr, "\t-s         Stream the trace in chunks instead of loading it.\n");
+}
+
 int main(int argc, char **argv) { 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: performance file\n");
+    int c;
+    int report_placement = 0;
+    int report_stats = 0;
+    int measure_latency = 0;
+    format_t format = FORMAT_TEXT;
+    int maintenance_us = 0;
+    int stream = 0;
+    policy_t policy = BEST_FIT;
+
+    while ((c = getopt(argc, argv, "eplsSP:F:f:m:G:")) != -1) {
+        switch (c) {
+        case 'l':
+            measure_latency = 1;
+            break;
+        case 'F':
+            measure_latency = 1;
+            if (strcmp(optarg, "json") == 0) {
+                format = FORMAT_JSON;
+            } else if (strcmp(optarg, "csv") == 0) {
+                format = FORMAT_CSV;
+            } else if (strcmp(optarg, "text") != 0) {
+                usage();
+                appl_error("Unknown latency format.");
+            }
+            break;
+        case 'e':
+            num_phases = num_phases ? num_phases : 1;
+            break;
+        case 'P':
+            num_phases = atoi(optarg);
+            if (num_phases <= 0 || num_phases > MAX_PHASES) {
+                usage();
+                appl_error("The phase count must be between 1 and 64.");
+            }
+            break;
+        case 'm':
+            maintenance_us = atoi(optarg);
+            if (maintenance_us <= 0) {
+                usage();
+                appl_error("The maintenance interval must be positive.");
+            }
+            break;
+        case 'G':
+            guard_bytes = atol(optarg);
+            if (guard_bytes == 0) {
+                usage();
+                appl_error("The guard sampling interval must be positive.");
+            }
+            break;
+        case 'p':
+            report_placement = 1;
+            break;
+        case 's':
+            stream = 1;
+            break;
+        case 'S':
+            report_stats = 1;
+            break;
+        case 'f':
+            policy = parse_placement_policy(optarg);
+            if (policy == NUM_POLICIES) {
+                usage();
+                appl_error("Unknown placement policy.");
+            }
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    if (argv[optind] == NULL) {
+        usage();
         appl_error("No File parameter provided.");
     }
-    trace_t *trace = read_trace(argv[1], 0);
-    run_trace(trace);
-    free_trace(trace);
+    report = format == FORMAT_TEXT ? stdout : stderr;
+    trace_t *trace = NULL;
+    trace_stream_t *trace_stream = NULL;
+    if (stream) {
+        trace_stream = open_trace_stream(argv[optind]);
+    } else {
+        trace = read_trace(argv[optind], 0);
+    }
+    set_placement_policy(policy);
+    if (measure_latency) {
+        timer_overhead_ns = calibrate_timer();
+    }
+    if (num_phases) {
+        perfctr_open(&counters);
+    }
+    run_trace(trace, trace_stream, maintenance_us, measure_latency);
+    if (report_placement) {
+        fprintf(report, "\n");
+        print_placement_report(report);
+    }
+    if (report_stats) {
+        fprintf(report, "\n");
+        print_ustats(report);
+    }
+    if (measure_latency) {
+        fprintf(report, "\n");
+        print_latency(format);
+    }
+    if (maintenance_us) {
+        fprintf(report, "\n");
+        print_maintenance_report(report);
+    }
+    if (guard_bytes) {
+        fprintf(report, "\n");
+        print_guard_report(report);
+    }
+    if (num_phases) {
+        fprintf(report, "\n");
+        print_counters();
+        perfctr_close(&counters);
+    }
+    if (stream) {
+        close_trace_stream(trace_stream);
+    } else {
+        free_trace(trace);
+    }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,251 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * rec2rep.c - Turns a raw log written by the recorder (liburecord.so) into
+ * a trace. Calls are put back in their global order, addresses are
+ * renumbered to ids, and every block still live at the end is freed so
+ * the trace is balanced, like the -bal traces. Blocks above a size limit
+ * can be left out, since csbrk caps how much the lab heap grows at once.
+ **************************************************************************/
+
+#include "support.h"
+#include "urecord.h"
+#include <limits.h>
+#include <sys/stat.h>
+
+/*
+ * Live addresses and their ids. Open addressing with linear probing, kept
+ * at most half full; removals shift later entries back.
+ */
+typedef struct {
+    uint64_t addr;  /* 0 for a free slot */
+    int id;
+} addr_slot_t;
+
+static addr_slot_t *addr_slots;
+static size_t addr_capacity;
+static size_t addr_count;
+
+static size_t addr_home(uint64_t addr) {
+    uint64_t h = addr * 0x9E3779B97F4A7C15ULL;
+    return (h ^ (h >> 32)) & (addr_capacity - 1);
+}
+
+static addr_slot_t *addr_slot(uint64_t addr) {
+    size_t i = addr_home(addr);
+    while (addr_slots[i].addr && addr_slots[i].addr != addr) {
+        i = (i + 1) & (addr_capacity - 1);
+    }
+    return &addr_slots[i];
+}
+
+static void addr_resize(size_t capacity) {
+    addr_slot_t *old = addr_slots;
+    size_t old_capacity = addr_capacity;
+    if ((addr_slots = calloc(capacity, sizeof(addr_slot_t))) == NULL) {
+        appl_error("Failed to grow the address map");
+    }
+    addr_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].addr) {
+            *addr_slot(old[i].addr) = old[i];
+        }
+    }
+    free(old);
+}
+
+/*
+ * addr_lookup - the id live at addr, or -1.
+ */
+static int addr_lookup(uint64_t addr) {
+    addr_slot_t *slot = addr_slot(addr);
+    return slot->addr ? slot->id : -1;
+}
+
+static void addr_insert(uint64_t addr, int id) {
+    if (2 * (addr_count + 1) > addr_capacity) {
+        addr_resize(2 * addr_capacity);
+    }
+    addr_slot_t *slot = addr_slot(addr);
+    if (!slot->addr) {
+        addr_count++;
+    }
+    slot->addr = addr;
+    slot->id = id;
+}
+
+static void addr_remove(uint64_t addr) {
+    size_t mask = addr_capacity - 1;
+    size_t hole = addr_slot(addr) - addr_slots;
+    size_t i = hole;
+    if (!addr_slots[hole].addr) {
+        return;
+    }
+    while (addr_slots[i = (i + 1) & mask].addr) {
+        size_t home = addr_home(addr_slots[i].addr);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            addr_slots[hole] = addr_slots[i];
+            hole = i;
+        }
+    }
+    addr_slots[hole].addr = 0;
+    addr_count--;
+}
+
+static traceop_t *ops;
+static size_t num_ops;
+static size_t ops_capacity;
+
+static void add_op(int type, int index, int size) {
+    if (num_ops == ops_capacity) {
+        ops_capacity = ops_capacity ? 2 * ops_capacity : 4096;
+        if ((ops = realloc(ops, ops_capacity * sizeof(traceop_t))) == NULL) {
+            appl_error("Failed to grow the op array");
+        }
+    }
+    ops[num_ops++] = (traceop_t){.type = type, .index = index, .size = size};
+}
+
+static int by_seq(const void *a, const void *b) {
+    uint64_t x = ((const urecord_t *)a)->seq, y = ((const urecord_t *)b)->seq;
+    return (x > y) - (x < y);
+}
+
+static int by_id(const void *a, const void *b) {
+    return ((const addr_slot_t *)a)->id - ((const addr_slot_t *)b)->id;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: rec2rep [-b] [-m bytes] rawfile outfile\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b         Write a binary trace instead of a .rep text one.\n");
+    fprintf(stderr, "\t-m bytes   Leave out blocks larger than bytes (57344 fits csbrk's cap).\n");
+}
+
+int main(int argc, char **argv) {
+    int c, other;
+    bool binary = false;
+    FILE *rawfile;
+    struct stat st;
+    char err_msg[MAXLINE];
+    size_t num_records;
+    urecord_t *records;
+    int next_id = 0;
+    long max_size = INT_MAX;
+    size_t dropped = 0, implicit_frees = 0;
+
+    while ((c = getopt(argc, argv, "bm:")) != -1) {
+        switch (c) {
+        case 'b':
+            binary = true;
+            break;
+        case 'm':
+            max_size = atol(optarg);
+            if (max_size <= 0 || max_size > INT_MAX) {
+                usage();
+                appl_error("The size limit must be between 1 and INT_MAX.");
+            }
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        appl_error("Expected a raw log and an output file.");
+    }
+
+    if ((rawfile = fopen(argv[optind], "r")) == NULL || fstat(fileno(rawfile), &st) == -1) {
+        sprintf(err_msg, "Could not open %s", argv[optind]);
+        appl_error(err_msg);
+    }
+    num_records = st.st_size / sizeof(urecord_t);
+    if ((records = calloc(num_records + 1, sizeof(urecord_t))) == NULL) {
+        appl_error("Failed to allocate the record array");
+    }
+    if (fread(records, sizeof(urecord_t), num_records, rawfile) != num_records) {
+        appl_error("Could not read the raw log");
+    }
+    fclose(rawfile);
+    qsort(records, num_records, sizeof(urecord_t), by_seq);
+
+    addr_resize(1024);
+    for (size_t i = 0; i < num_records; i++) {
+        urecord_t *r = &records[i];
+        int id;
+        bool too_large = r->size > max_size;
+        switch (r->type) {
+        case URECORD_REALLOC:
+            if (r->old && (id = addr_lookup(r->old)) != -1) {
+                addr_remove(r->old);
+                if (!r->ptr || too_large) { /* realloc(p, 0) freed p */
+                    add_op(FREE, id, 0);
+                    break;
+                }
+                if ((other = addr_lookup(r->ptr)) != -1) {
+                    add_op(FREE, other, 0);
+                    implicit_frees++;
+                }
+                add_op(REALLOC, id, r->size);
+                addr_insert(r->ptr, id);
+                break;
+            }
+            if (!r->ptr || too_large) {
+                dropped++;
+                break;
+            }
+            /* realloc(NULL, n), or of a block allocated before recording */
+            /* fall through */
+        case URECORD_ALLOC:
+            /* a block still live at this address lost its free to a race */
+            if ((id = addr_lookup(r->ptr)) != -1) {
+                add_op(FREE, id, 0);
+                implicit_frees++;
+                addr_remove(r->ptr);
+            }
+            if (too_large) {                /* its free will be dropped too */
+                dropped++;
+                break;
+            }
+            add_op(ALLOC, next_id, r->size);
+            addr_insert(r->ptr, next_id++);
+            break;
+        case URECORD_FREE:
+            if ((id = addr_lookup(r->ptr)) == -1) {
+                dropped++;                  /* allocated before recording */
+                break;
+            }
+            add_op(FREE, id, 0);
+            addr_remove(r->ptr);
+            break;
+        default:
+            appl_error("Bogus record type in the raw log");
+        }
+    }
+
+    /* balance the trace: free what is still live, in id order */
+    size_t live = 0;
+    for (size_t i = 0; i < addr_capacity; i++) {
+        if (addr_slots[i].addr) {
+            addr_slots[live++] = addr_slots[i];
+        }
+    }
+    qsort(addr_slots, live, sizeof(addr_slot_t), by_id);
+    for (size_t i = 0; i < live; i++) {
+        add_op(FREE, addr_slots[i].id, 0);
+    }
+
+    trace_t trace = {.num_ids = next_id, .num_ops = num_ops, .ops = ops};
+    write_trace(&trace, argv[optind + 1], binary);
+    printf("%zu records: %d ids, %zu ops (%zu frees added to balance, %zu for reused addresses), %zu records dropped\n",
+        num_records, next_id, num_ops, live, implicit_frees, dropped);
+
+    free(records);
+    free(addr_slots);
+    free(ops);
+    return 0;
+}
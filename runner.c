@@ -11,9 +11,22 @@
 #include "csbrk.h"
 #include "support.h"
 #include "check_heap.h"
+#include "heapmap.h"
+#include <fcntl.h>
 #include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 int verbose = 0;
+int report_placement = 0;
+int report_stats = 0;
+size_t guard_bytes = 0;
+size_t sample_blocks = 0; /* blocks check_heap_sampled looks at per op (-k) */
+static id_map_t *live_blocks; /* live blocks of a streamed trace (-s) */
+static interval_index_t *live_ranges; /* payload ranges of the live blocks */
+#define DEFAULT_SWEEP_INTERVAL 4096
+static size_t sweep_interval = DEFAULT_SWEEP_INTERVAL; /* ops between full correctness sweeps (-w) */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 extern size_t sbrk_bytes;
 extern const char author[];
@@ -23,33 +36,70 @@ extern const char author[];
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-rhvuc] file\n");
+    fprintf(stderr, "Usage: mdriver [-rhvucpsS] [-k blocks] [-w ops] [-T file] [-N ops] [-f policy] [-m us] [-H bytes] [-G bytes] file\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-r         Run the trace to completion (bypass interface).\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-v         Print additional debug info.\n");
     fprintf(stderr, "\t-u         Display heap utilization.\n");
     fprintf(stderr, "\t-c         Runs the user provided heap check after every op.\n");
+    fprintf(stderr, "\t-w ops     Check every live block every ops ops (default %d, 1 after every op, 0 only\n",
+        DEFAULT_SWEEP_INTERVAL);
+    fprintf(stderr, "\t           at the end). In between, only the blocks next to each op are checked, so\n");
+    fprintf(stderr, "\t           a stray write elsewhere is caught at the next sweep.\n");
+    fprintf(stderr, "\t-T file    Write a heap timeline, CSV or binary if file ends in .bin.\n");
+    fprintf(stderr, "\t-N ops     Sample the timeline every ops ops (default 1000).\n");
+    fprintf(stderr, "\t-k blocks  Check this many blocks of the heap after every op, in turn.\n");
+    fprintf(stderr, "\t-p         Print the placement policy decisions at the end of the trace.\n");
+    fprintf(stderr, "\t-f policy  Placement policy: best (the default), good, first or adaptive.\n");
+    fprintf(stderr, "\t-m us      Run the maintenance thread, waking up every us microseconds.\n");
+    fprintf(stderr, "\t-S         Print the heap statistics at the end of the trace.\n");
+    fprintf(stderr, "\t-H bytes   Profile the heap, sampling every bytes bytes on average.\n");
+    fprintf(stderr, "\t-G bytes   Give an allocation every bytes bytes on average guard pages.\n");
+    fprintf(stderr, "\t-s         Stream the trace instead of loading it (requires -r).\n");
 }
 
 /* 
  * copy_id - Writes the block id out to the payload. To be used for correctness
- * checks.
+ * checks. Payloads are 16-byte aligned, so whole vectors are stored.
  */
 static void copy_id(size_t *block, size_t block_size, size_t id) {
     size_t words = block_size/ sizeof(size_t);
-    for(size_t i = 0; i < words; i++) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i pattern = _mm_set1_epi64x(id);
+    for(; i + 2 <= words; i += 2) {
+        _mm_store_si128((__m128i *)(block + i), pattern);
+    }
+#endif
+    for(; i < words; i++) {
         block[i] = id;
     }
 }
 
 /* 
  * check_id - Checks the block contains the block id, repeated the number of
- * words can fit.
+ * words can fit. 64 bytes are compared at a time, with a single test of the
+ * differences.
  */
 static int check_id(size_t *block, size_t block_size, size_t id) {
     size_t words = block_size/ sizeof(size_t);
-    for(size_t i = 0; i < words; i++) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i pattern = _mm_set1_epi64x(id);
+    __m128i *vec = (__m128i *)block;
+    for(; i + 8 <= words; i += 8, vec += 4) {
+        __m128i diff = _mm_or_si128(
+            _mm_or_si128(_mm_xor_si128(_mm_load_si128(vec), pattern),
+                         _mm_xor_si128(_mm_load_si128(vec + 1), pattern)),
+            _mm_or_si128(_mm_xor_si128(_mm_load_si128(vec + 2), pattern),
+                         _mm_xor_si128(_mm_load_si128(vec + 3), pattern)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF) {
+            return -1;
+        }
+    }
+#endif
+    for(; i < words; i++) {
         if (block[i] != id) {
             return -1;
         }
@@ -64,8 +114,16 @@ static int check_id(size_t *block, size_t block_size, size_t id) {
  * was affected by the umalloc package. 
  */
 static int check_correctness(trace_t *trace, size_t curr_op) {
-    for (size_t block_id = 0; block_id < trace->num_ids; block_id++) {
-        allocated_block_t *block = &trace->blocks[block_id];
+    size_t num_blocks = live_blocks ? live_blocks->capacity : trace->num_ids;
+    for (size_t block_id = 0; block_id < num_blocks; block_id++) {
+        allocated_block_t *block;
+        if (live_blocks == NULL) {
+            block = &trace->blocks[block_id];
+        } else if (live_blocks->slots[block_id].id != ID_MAP_EMPTY) {
+            block = &live_blocks->slots[block_id].block;
+        } else {
+            continue;
+        }
         if (block->is_allocated) {
             if (check_id(block->payload, block->block_size, block->content_val) == -1) {
                 sprintf(msg, "umalloc corrupted block id %lu.", block_id);
@@ -75,10 +133,51 @@ static int check_correctness(trace_t *trace, size_t curr_op) {
         }
     }
 
-    if (verbose) {
-        printf("line %ld passed the correctness check.\n", LINENUM(curr_op));
+    return 0;
+}
+
+#define NEIGHBOR_SLACK 64 /* bytes either side of a block whose neighbors an op may reach */
+#define MAX_NEIGHBORS 64
+
+/*
+ * block_by_id - The record of a live block.
+ */
+static allocated_block_t *block_by_id(trace_t *trace, int id) {
+    return live_blocks ? id_map_find(live_blocks, id) : &trace->blocks[id];
+}
+
+/*
+ * check_overlap - Fails if a block just handed out overlaps a live one.
+ */
+static int check_overlap(void *payload, size_t size, size_t curr_op) {
+    int id;
+    if (interval_overlaps(live_ranges, (uintptr_t)payload, (uintptr_t)payload + size, &id, 1)) {
+        sprintf(msg, "umalloc returned a block overlapping block id %d.", id);
+        malloc_error(curr_op, msg);
+        return -1;
     }
+    return 0;
+}
 
+/*
+ * check_neighbors - Checks the contents of the live blocks within
+ * NEIGHBOR_SLACK bytes of a block that was just allocated, moved or freed.
+ * Splitting and coalescing write headers right next to the block, so these
+ * are the blocks an op is likely to corrupt; the rest are left to the full
+ * sweep of check_correctness.
+ */
+static int check_neighbors(trace_t *trace, void *payload, size_t size, size_t curr_op) {
+    int ids[MAX_NEIGHBORS];
+    int found = interval_overlaps(live_ranges, (uintptr_t)payload - NEIGHBOR_SLACK,
+        (uintptr_t)payload + size + NEIGHBOR_SLACK, ids, MAX_NEIGHBORS);
+    for (int i = 0; i < found; i++) {
+        allocated_block_t *block = block_by_id(trace, ids[i]);
+        if (check_id(block->payload, block->block_size, block->content_val) == -1) {
+            sprintf(msg, "umalloc corrupted block id %d.", ids[i]);
+            malloc_error(curr_op, msg);
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -93,6 +192,141 @@ size_t max_bytes_in_use;
  */
 #define UTILIZATION_SCORE 100.0 * max_bytes_in_use / sbrk_bytes
 
+/*
+ * Timeline (-T file): the shape of the heap every timeline_interval ops,
+ * written as CSV, or as raw timeline_sample_t records after TIMELINE_MAGIC
+ * when the file name ends in .bin. The samples are also kept to find the
+ * windows in which the heap grew the most.
+ */
+#define TIMELINE_MAGIC "UMTLINE1"
+#define WORST_WINDOWS 5
+
+typedef struct {
+    uint64_t op;           /* ops run so far */
+    uint64_t heap_bytes;
+    uint64_t live_bytes;   /* bytes requested by the live blocks */
+    uint64_t free_bytes;
+    uint64_t free_blocks;
+    uint64_t largest_free;
+    double fragmentation;  /* 1 - largest free block / free bytes */
+} timeline_sample_t;
+
+static FILE *timeline_file;
+static bool timeline_binary;
+static size_t timeline_interval = 1000;
+static timeline_sample_t *timeline;
+static size_t timeline_len;
+static size_t timeline_capacity;
+
+/*
+ * open_timeline - creates the timeline file and writes its header.
+ */
+static void open_timeline(char *file) {
+    size_t len = strlen(file);
+    if ((timeline_file = fopen(file, "w")) == NULL) {
+        sprintf(msg, "Could not open %s", file);
+        appl_error(msg);
+    }
+    timeline_binary = len > 4 && strcmp(file + len - 4, ".bin") == 0;
+    if (timeline_binary) {
+        fwrite(TIMELINE_MAGIC, 1, strlen(TIMELINE_MAGIC), timeline_file);
+    } else {
+        fprintf(timeline_file, "op,heap_bytes,live_bytes,free_bytes,free_blocks,largest_free,fragmentation\n");
+    }
+}
+
+/*
+ * record_timeline - samples the heap after ops ops.
+ */
+static void record_timeline(size_t ops) {
+    struct ustats stats;
+    ustats(&stats);
+    if (timeline_len == timeline_capacity) {
+        timeline_capacity = timeline_capacity ? 2 * timeline_capacity : 1024;
+        if ((timeline = realloc(timeline, timeline_capacity * sizeof(timeline_sample_t))) == NULL) {
+            appl_error("Failed to grow the timeline");
+        }
+    }
+    timeline_sample_t *sample = &timeline[timeline_len++];
+    *sample = (timeline_sample_t){
+        .op = ops,
+        .heap_bytes = stats.heap_bytes,
+        .live_bytes = curr_bytes_in_use,
+        .free_bytes = stats.free_bytes,
+        .free_blocks = stats.free_blocks,
+        .largest_free = stats.largest_free,
+        .fragmentation = stats.free_bytes ? 1.0 - (double)stats.largest_free / stats.free_bytes : 0.0,
+    };
+    if (timeline_binary) {
+        fwrite(sample, sizeof(*sample), 1, timeline_file);
+    } else {
+        fprintf(timeline_file, "%lu,%lu,%lu,%lu,%lu,%lu,%.4f\n", sample->op, sample->heap_bytes,
+            sample->live_bytes, sample->free_bytes, sample->free_blocks, sample->largest_free,
+            sample->fragmentation);
+    }
+}
+
+static int by_growth(const void *a, const void *b) {
+    const timeline_sample_t *x = *(timeline_sample_t * const *)a, *y = *(timeline_sample_t * const *)b;
+    int64_t gx = x->heap_bytes - x[-1].heap_bytes, gy = y->heap_bytes - y[-1].heap_bytes;
+    return (gx < gy) - (gx > gy);
+}
+
+/*
+ * close_timeline - writes out the file and prints the windows in which the
+ * heap grew the most, with how much of it the live bytes account for, and
+ * the sample with the worst fragmentation.
+ */
+static void close_timeline() {
+    fclose(timeline_file);
+    timeline_file = NULL;
+    if (timeline_len < 2) {
+        return;
+    }
+    timeline_sample_t **windows = malloc((timeline_len - 1) * sizeof(timeline_sample_t *));
+    if (windows == NULL) {
+        appl_error("Failed to allocate the timeline windows");
+    }
+    timeline_sample_t *worst = &timeline[0];
+    for (size_t i = 1; i < timeline_len; i++) {
+        windows[i - 1] = &timeline[i];
+        if (timeline[i].fragmentation > worst->fragmentation) {
+            worst = &timeline[i];
+        }
+    }
+    qsort(windows, timeline_len - 1, sizeof(timeline_sample_t *), by_growth);
+    printf("Largest heap growth per %zu-op window:\n", timeline_interval);
+    for (size_t i = 0; i < WORST_WINDOWS && i < timeline_len - 1; i++) {
+        timeline_sample_t *end = windows[i], *start = end - 1;
+        if (end->heap_bytes <= start->heap_bytes) {
+            break;
+        }
+        printf("  lines %lu-%lu: heap +%lu to %lu bytes, live %+ld bytes, fragmentation %.2f -> %.2f\n",
+            LINENUM(start->op), LINENUM(end->op - 1), end->heap_bytes - start->heap_bytes, end->heap_bytes,
+            (long)(end->live_bytes - start->live_bytes), start->fragmentation, end->fragmentation);
+    }
+    printf("Worst fragmentation %.2f after %lu ops: %lu free bytes in %lu blocks, largest %lu\n",
+        worst->fragmentation, worst->op, worst->free_bytes, worst->free_blocks, worst->largest_free);
+    free(windows);
+    free(timeline);
+    timeline = NULL;
+    timeline_len = timeline_capacity = 0;
+}
+
+/*
+ * trace_block - The block record an op refers to, from the trace's block array
+ * or, when streaming, from the map of live ids.
+ */
+static allocated_block_t *trace_block(trace_t *trace, traceop_t op) {
+    if (live_blocks == NULL) {
+        return &trace->blocks[op.index];
+    }
+    if (op.type == ALLOC) {
+        return id_map_insert(live_blocks, op.index);
+    }
+    return id_map_find(live_blocks, op.index); /* frees and reallocs */
+}
+
 /* 
  * run_trace_line - Runs a single line in the trace. Checking if all the 
  * correctness checks are still satisfied after the check. Checks if the returned
@@ -100,69 +334,149 @@ size_t max_bytes_in_use;
  * within the sbrk range. Runs the user created check heap function and prints
  * the current utilization score if requested. 
  */
-static int run_trace_line(trace_t *trace, size_t curr_op, int utilization, int run_check_heap) {
+static int run_trace_line(trace_t *trace, traceop_t op, size_t curr_op, int utilization, int run_check_heap) {
 
     if (curr_op % 5 == 0) {
         void *ret = sbrk(4096);
         mprotect(ret, 4096, PROT_NONE);
     }
-    traceop_t op = trace->ops[curr_op];
+    allocated_block_t *block = trace_block(trace, op);
+    if (block == NULL || (op.type == REALLOC && !block->is_allocated)) {
+        malloc_error(curr_op, "trace refers to an id that is not allocated.");
+        return -1;
+    }
     if (op.type == ALLOC) {
-        trace->blocks[op.index].is_allocated = true;
-        trace->blocks[op.index].content_val = curr_op;
-        trace->blocks[op.index].block_size = op.size;
+        block->is_allocated = true;
+        block->content_val = curr_op;
+        block->block_size = op.size;
 
         if (verbose) {
             printf("line %ld: umalloc: id %d, Allocating %d bytes\n", LINENUM(curr_op), op.index, op.size);
         }
 
-        trace->blocks[op.index].payload = umalloc(op.size);
+        block->payload = umalloc(op.size);
         curr_bytes_in_use += op.size;
-        if ( trace->blocks[op.index].payload == NULL) {
+        if (block->payload == NULL) {
             malloc_error(curr_op, "umalloc failed.");
             return -1;
         }
 
-        if (((size_t)trace->blocks[op.index].payload) % ALIGNMENT != 0) {
+        if (((size_t)block->payload) % ALIGNMENT != 0) {
             malloc_error(curr_op, "umalloc returned an unaligned payload.");
             return -1;
         }
 
-        if(check_malloc_output(trace->blocks[op.index].payload, trace->blocks[op.index].block_size) == -1) {
+        if(!uguard_owns(block->payload) && check_malloc_output(block->payload, block->block_size) == -1) {
             printf("line %ld: umalloc allocated a block out of bounds.\n", LINENUM(curr_op));
             return -1;
         }
 
-        copy_id((size_t*) trace->blocks[op.index].payload, trace->blocks[op.index].block_size, curr_op);
+        if (check_overlap(block->payload, block->block_size, curr_op) == -1) {
+            return -1;
+        }
+        copy_id((size_t*) block->payload, block->block_size, curr_op);
+        interval_insert(live_ranges, (uintptr_t)block->payload,
+            (uintptr_t)block->payload + block->block_size, op.index);
+        if (check_neighbors(trace, block->payload, block->block_size, curr_op) == -1) {
+            return -1;
+        }
+    } else if (op.type == REALLOC) {
+        size_t kept = (size_t)op.size < block->block_size ? (size_t)op.size : block->block_size;
+
+        if (verbose) {
+            printf("line %ld: urealloc: id %d, Resizing to %d bytes\n", LINENUM(curr_op), op.index, op.size);
+        }
+
+        void *old_payload = block->payload;
+        size_t old_size = block->block_size;
+        interval_remove(live_ranges, (uintptr_t)old_payload);
+        void *payload = urealloc(block->payload, op.size);
+        if (payload == NULL) {
+            malloc_error(curr_op, "urealloc failed.");
+            return -1;
+        }
+
+        if (((size_t)payload) % ALIGNMENT != 0) {
+            malloc_error(curr_op, "urealloc returned an unaligned payload.");
+            return -1;
+        }
+
+        if(!uguard_owns(payload) && check_malloc_output(payload, op.size) == -1) {
+            printf("line %ld: urealloc moved a block out of bounds.\n", LINENUM(curr_op));
+            return -1;
+        }
+
+        if (check_id(payload, kept, block->content_val) == -1) {
+            malloc_error(curr_op, "urealloc did not preserve the block contents.");
+            return -1;
+        }
+
+        if (check_overlap(payload, op.size, curr_op) == -1) {
+            return -1;
+        }
+        curr_bytes_in_use += op.size - block->block_size;
+        block->payload = payload;
+        block->block_size = op.size;
+        block->content_val = curr_op;
+        copy_id((size_t*) payload, op.size, curr_op);
+        interval_insert(live_ranges, (uintptr_t)payload, (uintptr_t)payload + op.size, op.index);
+        if (check_neighbors(trace, old_payload, old_size, curr_op) == -1 ||
+            check_neighbors(trace, payload, op.size, curr_op) == -1) {
+            return -1;
+        }
     } else {
-        trace->blocks[op.index].is_allocated = false;
+        block->is_allocated = false;
 
         if (verbose) {
             printf("line %ld: ufree: id %d\n", LINENUM(curr_op), op.index);
         }
 
-        ufree(trace->blocks[op.index].payload);
-        curr_bytes_in_use -= trace->blocks[op.index].block_size;
+        void *payload = block->payload;
+        size_t size = block->block_size;
+        interval_remove(live_ranges, (uintptr_t)payload);
+        ufree(payload);
+        curr_bytes_in_use -= size;
+        if (live_blocks) {
+            id_map_remove(live_blocks, op.index);
+        }
+        if (check_neighbors(trace, payload, size, curr_op) == -1) {
+            return -1;
+        }
     }
 
     if (curr_bytes_in_use > max_bytes_in_use) {
         max_bytes_in_use = curr_bytes_in_use;
     }
 
-    if (run_check_heap) {
-        if (check_heap() != 0) {
-            malloc_error(curr_op, "check heap failed.");
-            return -1;
-        } else {
-            printf("Passed check heap.\n");
-        }
+    if (run_check_heap && check_heap() != 0) {
+        sprintf(msg, "check heap failed: %s.", check_heap_error());
+        malloc_error(curr_op, msg);
+        return -1;
+    }
+    if (sample_blocks && check_heap_sampled(sample_blocks) != 0) {
+        sprintf(msg, "sampled check heap failed: %s.", check_heap_error());
+        malloc_error(curr_op, msg);
+        return -1;
     }
 
-    if (check_correctness(trace, curr_op) == -1) {
+    /* every block is checked at the end of the trace, and every -w ops */
+    if ((curr_op + 1 == trace->num_ops || (sweep_interval && (curr_op + 1) % sweep_interval == 0)) &&
+        check_correctness(trace, curr_op) == -1) {
         printf("line %ld failed the correctness check.\n", LINENUM(curr_op));
         return -1;
     }
 
+    if (verbose) {
+        printf("line %ld passed the correctness check.\n", LINENUM(curr_op));
+    }
+
+    if (timeline_file && ((curr_op + 1) % timeline_interval == 0 || curr_op + 1 == trace->num_ops)) {
+        record_timeline(curr_op + 1);
+        if (curr_op + 1 == trace->num_ops) {
+            close_timeline();
+        }
+    }
+
     if (verbose && utilization) {
         printf("Current Utilization percentage: %.2f\n", UTILIZATION_SCORE);
     }
@@ -182,7 +496,7 @@ static int auto_run_trace(trace_t *trace, int utilization, int run_check_heap, s
     }
 
     for(;curr_op < trace->num_ops; curr_op++) {
-        if (run_trace_line(trace, curr_op, utilization, run_check_heap) == -1) {
+        if (run_trace_line(trace, trace->ops[curr_op], curr_op, utilization, run_check_heap) == -1) {
             printf("umalloc package failed.\n");
             exit(1);
         }
@@ -193,9 +507,97 @@ static int auto_run_trace(trace_t *trace, int utilization, int run_check_heap, s
     if (utilization) {
         printf("Final Utilization percentage: %.2f\n", UTILIZATION_SCORE);
     }
+
+    if (report_placement) {
+        print_placement_report(stdout);
+    }
+    if (report_stats) {
+        print_ustats(stdout);
+    }
+    if (guard_bytes) {
+        print_guard_report(stdout);
+    }
     return curr_op;
 }
 
+/*
+ * stream_run_trace - Runs a streamed trace to completion. Ops are read as
+ * they are replayed and the live blocks are kept in an id map, so the trace
+ * never has to fit in memory.
+ */
+static void stream_run_trace(char *file, int utilization, int run_check_heap) {
+    trace_stream_t *stream = open_trace_stream(file);
+    trace_t trace = {.num_ids = stream->num_ids, .num_ops = stream->num_ops};
+    traceop_t op;
+    size_t curr_op = 0;
+
+    live_blocks = new_id_map();
+    while (next_trace_op(stream, &op)) {
+        if (run_trace_line(&trace, op, curr_op, utilization, run_check_heap) == -1) {
+            printf("umalloc package failed.\n");
+            exit(1);
+        }
+        curr_op++;
+    }
+    close_trace_stream(stream);
+    free_id_map(live_blocks);
+    live_blocks = NULL;
+
+    printf("umalloc package passed correctness check.\n");
+
+    if (utilization) {
+        printf("Final Utilization percentage: %.2f\n", UTILIZATION_SCORE);
+    }
+    if (report_placement) {
+        print_placement_report(stdout);
+    }
+    if (report_stats) {
+        print_ustats(stdout);
+    }
+    if (guard_bytes) {
+        print_guard_report(stdout);
+    }
+}
+
+/*
+ * dump_heap - writes a snapshot of the heap to file, as heapview reads it,
+ * and shows its map and fragmentation metrics.
+ */
+static void dump_heap(char *file) {
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("Could not open %s.\n", file);
+        return;
+    }
+    int ret = uheap_dump(fd);
+    close(fd);
+    heapmap_t *map = ret == 0 ? read_heapmap(file) : NULL;
+    if (map == NULL) {
+        printf("Could not write a heap snapshot to %s.\n", file);
+        return;
+    }
+    print_heapmap(stdout, map, 64, 0, isatty(STDOUT_FILENO));
+    print_heapmap_metrics(stdout, map);
+    free_heapmap(map);
+}
+
+/*
+ * dump_profile - writes the heap profile to file for pprof.
+ */
+static void dump_profile(char *file) {
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("Could not open %s.\n", file);
+        return;
+    }
+    if (uprofile_dump(fd) == -1) {
+        printf("No heap profile to write; start the runner with -H.\n");
+    } else {
+        printf("Heap profile written to %s.\n", file);
+    }
+    close(fd);
+}
+
 /* 
  * help - Prints the help information for the Trace Runner.
  */
@@ -205,6 +607,10 @@ void help() {
     printf("run n            -  execute trace for n ops\n");
     printf("check            -  run the heap_check                \n");
     printf("util             -  display current heap utilization   \n");
+    printf("place            -  display placement policy decisions \n");
+    printf("stats            -  display heap statistics            \n");
+    printf("dump file        -  write a heap snapshot and show its map\n");
+    printf("profile file     -  write the sampled heap profile (needs -H)\n");
     printf("help             -  display this help menu            \n");
     printf("quit             -  exit the program                  \n\n");
 }
@@ -215,6 +621,7 @@ void help() {
  */
 void interactive_run_trace(trace_t *trace, int utilization, int run_check_heap) {                         
   char buffer[20];
+  char path[MAXLINE];
   int ops_to_run;
   int ret;
   size_t curr_op = 0;
@@ -239,7 +646,9 @@ void interactive_run_trace(trace_t *trace, int utilization, int run_check_heap)
         printf("Running check_heap.\n");
         ret = check_heap();
         if (ret != 0)
-            printf("check_heap returned non zero exit code.\n");
+            printf("check_heap returned non zero exit code: %s.\n", check_heap_error());
+        else
+            printf("Passed check heap.\n");
         break;
 
     case 'h':
@@ -257,6 +666,31 @@ void interactive_run_trace(trace_t *trace, int utilization, int run_check_heap)
         printf("Current Utilization percentage: %.2f\n", UTILIZATION_SCORE);
         break;
 
+    case 'P':
+    case 'p':
+        if (buffer[1] != 'r' && buffer[1] != 'R') {
+            print_placement_report(stdout);
+            break;
+        }
+        size = scanf("%1023s", path); /* profile */
+        if (size == 1) {
+            dump_profile(path);
+        }
+        break;
+
+    case 'S':
+    case 's':
+        print_ustats(stdout);
+        break;
+
+    case 'D':
+    case 'd':
+        size = scanf("%1023s", path);
+        if (size == 1) {
+            dump_heap(path);
+        }
+        break;
+
     case 'R':
     case 'r':
         size = scanf("%d", &ops_to_run);
@@ -270,7 +704,7 @@ void interactive_run_trace(trace_t *trace, int utilization, int run_check_heap)
         }
 
         for(int op = 0; op < ops_to_run; op++) {
-            if (run_trace_line(trace, curr_op, utilization, run_check_heap) == -1) {
+            if (run_trace_line(trace, trace->ops[curr_op], curr_op, utilization, run_check_heap) == -1) {
                 printf("umalloc package failed.\n");
                 exit(1);
             }
@@ -300,11 +734,16 @@ int main(int argc, char **argv)
 
   char c;
   int autorun = 0, run_check_heap = 0, display_utilization = 0;
+  policy_t policy = BEST_FIT;
+  int maintenance_us = 0;
+  int stream = 0;
+  char *timeline_name = NULL;
+  size_t profile_bytes = 0;
 
   /* 
     * Read and interpret the command line arguments 
     */
-  while ((c = getopt(argc, argv, "rvhcu")) != EOF) {
+  while ((c = getopt(argc, argv, "rvhcupsSk:w:T:N:f:m:H:G:")) != EOF) {
     switch (c) {
     case 'r': /* Generate summary info for the autograder */
         autorun = 1;
@@ -318,9 +757,66 @@ int main(int argc, char **argv)
     case 'c':
         run_check_heap = 1;
         break;
+    case 'T':
+        timeline_name = optarg;
+        break;
+    case 'N':
+        timeline_interval = atol(optarg);
+        if (timeline_interval == 0) {
+            usage();
+            appl_error("The timeline interval must be positive.");
+        }
+        break;
+    case 'w':
+        sweep_interval = atol(optarg);
+        break;
+    case 'k':
+        sample_blocks = atol(optarg);
+        if (sample_blocks == 0) {
+            usage();
+            appl_error("The number of blocks to check must be positive.");
+        }
+        break;
     case 'u':
         display_utilization = 1;
         break;
+    case 'p':
+        report_placement = 1;
+        break;
+    case 's':
+        stream = 1;
+        break;
+    case 'S':
+        report_stats = 1;
+        break;
+    case 'f':
+        policy = parse_placement_policy(optarg);
+        if (policy == NUM_POLICIES) {
+            usage();
+            appl_error("Unknown placement policy.");
+        }
+        break;
+    case 'H':
+        profile_bytes = atol(optarg);
+        if (profile_bytes == 0) {
+            usage();
+            appl_error("The profile sampling interval must be positive.");
+        }
+        break;
+    case 'G':
+        guard_bytes = atol(optarg);
+        if (guard_bytes == 0) {
+            usage();
+            appl_error("The guard sampling interval must be positive.");
+        }
+        break;
+    case 'm':
+        maintenance_us = atoi(optarg);
+        if (maintenance_us <= 0) {
+            usage();
+            appl_error("The maintenance interval must be positive.");
+        }
+        break;
     default:
         usage();
         exit(1);
@@ -334,6 +830,11 @@ int main(int argc, char **argv)
         appl_error("Missing file parameters.");
     }
 
+    if (stream && !autorun) {
+        usage();
+        appl_error("Streaming replay (-s) requires -r.");
+    }
+
     if (verbose) {
         if (autorun) {
             printf("Auto Run Enabled.\n");
@@ -351,13 +852,32 @@ int main(int argc, char **argv)
     printf("Welcome to the MM lab runner\n\n");
     printf("Author: %s\n", author);
 
-    trace_t *trace = read_trace(file, verbose);
+    trace_t *trace = stream ? NULL : read_trace(file, verbose);
     if (uinit() == -1) {
         malloc_error(-3, "uinit failed.");
         exit(1);
     }
+    set_placement_policy(policy);
+    if (profile_bytes) {
+        uprofile_start(profile_bytes);
+    }
+    if (guard_bytes && uguard_start(guard_bytes, UGUARD_DEFAULT_SLOTS) == -1) {
+        appl_error("Could not set up the guard pages.");
+    }
+    if (maintenance_us && start_maintenance(maintenance_us) == -1) {
+        appl_error("Could not start the maintenance thread.");
+    }
     curr_bytes_in_use = 0;
     max_bytes_in_use = 0;
+    live_ranges = new_interval_index();
+    if (timeline_name) {
+        open_timeline(timeline_name);
+        record_timeline(0);
+    }
+    if (stream) {
+        stream_run_trace(file, display_utilization, run_check_heap);
+        return 0;
+    }
     if (autorun) {
         auto_run_trace(trace, display_utilization, run_check_heap, 0);
     } else {
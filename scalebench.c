@@ -0,0 +1,329 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * scalebench.c - Measures how umalloc and ufree scale with the number of
+ * live blocks and of free blocks between them, well past the sizes of the
+ * traces. At each point of a sweep the heap is filled with a number of
+ * live blocks, a share of them is freed to leave holes, and the per-op
+ * latency of a steady churn is timed. The growth of each op with the live
+ * count is fitted as an exponent (0 for constant time, 1 for linear), and
+ * exponents can be saved as a baseline that later runs must not exceed.
+ **************************************************************************/
+
+#include "umalloc.h"
+#include "support.h"
+#include <math.h>
+
+#define DEFAULT_MAX_LIVE 100000
+#define DEFAULT_TOLERANCE 0.2 /* how far an exponent may rise above its baseline */
+#define POINTS_PER_DECADE 2
+#define CHURN_BATCH 256       /* free and malloc pairs per sample */
+#define MIN_BATCHES 5
+#define MAX_BATCHES 256
+#define POINT_BUDGET_NS 2e8   /* churn timed per point once MIN_BATCHES are in */
+#define MAX_HOLE_LEVELS 8
+#define MAX_POINTS 64
+
+enum { OP_MALLOC, OP_FREE, NUM_OPS };
+static const char *op_names[NUM_OPS] = {"malloc", "free"};
+
+typedef struct {
+    size_t live;
+    size_t free_blocks;     /* on the free list when the churn starts */
+    double ns[NUM_OPS];     /* median over batches of the mean per op */
+} point_t;
+
+typedef struct {
+    int holes;
+    int op;
+    double exponent;
+} fit_t;
+
+static uint64_t rng_state = 1;
+static size_t min_size = UFAST_MAX_SIZE + 1; /* above the class caches, so blocks reach the free list */
+static size_t max_size = 2 * UFAST_MAX_SIZE;
+
+static fit_t baseline[MAX_HOLE_LEVELS * NUM_OPS];
+static int num_baseline;
+
+static uint64_t next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static size_t next_size(void) {
+    return min_size + next_random() % (max_size - min_size + 1);
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static int by_value(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void *checked_malloc(size_t size) {
+    void *payload = umalloc_fast(size);
+    if (payload == NULL) {
+        appl_error("umalloc failed.");
+    }
+    return payload;
+}
+
+/*
+ * measure_point - fills a fresh heap with live blocks and frees holes
+ * percent of them, only odd ones so that no two holes coalesce. Then a
+ * random live block is freed and a new one allocated, over and over, so
+ * the live and the free block counts hold steady, and the two ops are
+ * timed apart in batches until POINT_BUDGET_NS has passed.
+ */
+static void measure_point(point_t *point, size_t live, int holes, void **blocks) {
+    struct ustats stats;
+    double samples[NUM_OPS][MAX_BATCHES];
+    int batches = 0;
+    double spent = 0;
+
+    if (ureset() == -1) {
+        appl_error("ureset failed.");
+    }
+    for (size_t i = 0; i < live; i++) {
+        blocks[i] = checked_malloc(next_size());
+    }
+    for (size_t i = 1; i < live; i += 2) {
+        if ((int)(next_random() % 50) < holes) {
+            ufree_fast(blocks[i]);
+            blocks[i] = NULL;
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < live; i++) {
+        if (blocks[i]) {
+            blocks[kept++] = blocks[i];
+        }
+    }
+    ustats(&stats);
+    point->live = kept;
+    point->free_blocks = stats.free_blocks;
+
+    while (batches < MAX_BATCHES && (batches < MIN_BATCHES || spent < POINT_BUDGET_NS)) {
+        double ns[NUM_OPS] = {0};
+        struct timespec before, middle, after;
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            size_t victim = next_random() % kept;
+            size_t size = next_size();
+            ufree_fast(blocks[victim]);
+            clock_gettime(CLOCK_MONOTONIC, &middle);
+            blocks[victim] = checked_malloc(size);
+            clock_gettime(CLOCK_MONOTONIC, &after);
+            ns[OP_FREE] += elapsed_ns(&before, &middle);
+            ns[OP_MALLOC] += elapsed_ns(&middle, &after);
+            before = after;
+        }
+        for (int op = 0; op < NUM_OPS; op++) {
+            samples[op][batches] = ns[op] / CHURN_BATCH;
+            spent += ns[op];
+        }
+        batches++;
+    }
+    for (int op = 0; op < NUM_OPS; op++) {
+        qsort(samples[op], batches, sizeof(double), by_value);
+        point->ns[op] = samples[op][batches / 2];
+    }
+}
+
+/*
+ * fit_exponent - slope of log latency against log live count, by least
+ * squares.
+ */
+static double fit_exponent(point_t *points, int n, int op) {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = 0; i < n; i++) {
+        double x = log((double)points[i].live), y = log(points[i].ns[op]);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    double d = n * sxx - sx * sx;
+    return d > 0 ? (n * sxy - sx * sy) / d : 0;
+}
+
+/*
+ * load_baseline - reads exponents saved by -o: one line per op and hole
+ * level.
+ */
+static void load_baseline(char *file) {
+    char line[MAXLINE], name[MAXLINE];
+    char err_msg[MAXLINE];
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        sprintf(err_msg, "Could not open baseline %s", file);
+        appl_error(err_msg);
+    }
+    while (fgets(line, sizeof(line), f) && num_baseline < MAX_HOLE_LEVELS * NUM_OPS) {
+        fit_t *b = &baseline[num_baseline];
+        if (line[0] != '#' && sscanf(line, "%1023s %d %lf", name, &b->holes, &b->exponent) == 3) {
+            for (b->op = 0; b->op < NUM_OPS && strcmp(op_names[b->op], name) != 0; b->op++)
+                ;
+            num_baseline += b->op < NUM_OPS;
+        }
+    }
+    fclose(f);
+}
+
+static fit_t *find_baseline(int op, int holes) {
+    for (int i = 0; i < num_baseline; i++) {
+        if (baseline[i].op == op && baseline[i].holes == holes) {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * parse_holes - a comma separated list of hole levels, each 0 to 50.
+ * Returns how many there are, or -1 if one is out of range.
+ */
+static int parse_holes(char *list, int *levels) {
+    int n = 0;
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int level = atoi(tok);
+        if (n == MAX_HOLE_LEVELS || level < 0 || level > 50) {
+            return -1;
+        }
+        levels[n++] = level;
+    }
+    return n;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: scalebench [-m live] [-H holes] [-z min:max] [-f policy] [-b file] [-o file] [-t slack]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-m live    Largest live block count of the sweep, from 1000 (default %d).\n", DEFAULT_MAX_LIVE);
+    fprintf(stderr, "\t-H holes   Percents of the blocks to free as holes, up to 50 (default 0,25,50).\n");
+    fprintf(stderr, "\t-z min:max Block sizes (default %d:%d, above the class caches).\n",
+        UFAST_MAX_SIZE + 1, 2 * UFAST_MAX_SIZE);
+    fprintf(stderr, "\t-f policy  Placement policy: best (the default), good, first or adaptive.\n");
+    fprintf(stderr, "\t-b file    Compare the exponents against a saved baseline; exit 1 on a regression.\n");
+    fprintf(stderr, "\t-o file    Save the exponents as a baseline.\n");
+    fprintf(stderr, "\t-t slack   How far an exponent may exceed its baseline (default %.1f).\n", DEFAULT_TOLERANCE);
+}
+
+int main(int argc, char **argv) {
+    int c;
+    size_t max_live = DEFAULT_MAX_LIVE;
+    char default_holes[] = "0,25,50";
+    int hole_levels[MAX_HOLE_LEVELS];
+    int num_levels = parse_holes(default_holes, hole_levels);
+    double tolerance = DEFAULT_TOLERANCE;
+    policy_t policy = BEST_FIT;
+    char *save_file = NULL;
+    point_t points[MAX_POINTS];
+    fit_t fits[MAX_HOLE_LEVELS * NUM_OPS];
+    int num_fits = 0;
+
+    while ((c = getopt(argc, argv, "m:H:z:f:b:o:t:")) != -1) {
+        switch (c) {
+        case 'm':
+            max_live = atol(optarg);
+            if (max_live < 1000) {
+                usage();
+                appl_error("The sweep needs at least 1000 live blocks.");
+            }
+            break;
+        case 'H':
+            if ((num_levels = parse_holes(optarg, hole_levels)) <= 0) {
+                usage();
+                appl_error("Hole levels are percents from 0 to 50.");
+            }
+            break;
+        case 'z':
+            if (sscanf(optarg, "%zu:%zu", &min_size, &max_size) != 2 || min_size < 1 || min_size > max_size) {
+                usage();
+                appl_error("Bad size range.");
+            }
+            break;
+        case 'f':
+            policy = parse_placement_policy(optarg);
+            if (policy == NUM_POLICIES) {
+                usage();
+                appl_error("Unknown placement policy.");
+            }
+            break;
+        case 'b':
+            load_baseline(optarg);
+            break;
+        case 'o':
+            save_file = optarg;
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    void **blocks = malloc(max_live * sizeof(void *));
+    if (blocks == NULL) {
+        appl_error("Failed to allocate the block array");
+    }
+    if (uinit() == -1) {
+        appl_error("uinit failed.");
+    }
+    set_placement_policy(policy);
+
+    int regressions = 0;
+    for (int h = 0; h < num_levels; h++) {
+        int num_points = 0;
+        printf("%d%% holes\n", hole_levels[h]);
+        printf("%10s %12s %12s %12s\n", "live", "free blocks", "malloc ns", "free ns");
+        for (double live = 1000; live <= max_live * 1.0001 && num_points < MAX_POINTS;
+                live *= pow(10, 1.0 / POINTS_PER_DECADE)) {
+            point_t *p = &points[num_points++];
+            measure_point(p, (size_t)live, hole_levels[h], blocks);
+            printf("%10zu %12zu %12.1f %12.1f\n", p->live, p->free_blocks, p->ns[OP_MALLOC], p->ns[OP_FREE]);
+            fflush(stdout);
+        }
+        for (int op = 0; op < NUM_OPS; op++) {
+            fit_t *fit = &fits[num_fits++];
+            *fit = (fit_t){.holes = hole_levels[h], .op = op, .exponent = fit_exponent(points, num_points, op)};
+            fit_t *base = find_baseline(op, fit->holes);
+            printf("  %-6s grows as live^%.2f", op_names[op], fit->exponent);
+            if (base && fit->exponent > base->exponent + tolerance) {
+                printf("  REGRESSED from %.2f", base->exponent);
+                regressions++;
+            } else if (base) {
+                printf("  (baseline %.2f)", base->exponent);
+            }
+            printf("\n");
+        }
+        printf("\n");
+    }
+    if (num_baseline) {
+        printf("%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+    }
+
+    if (save_file) {
+        FILE *f = fopen(save_file, "w");
+        if (f == NULL) {
+            appl_error("Could not write the baseline.");
+        }
+        fprintf(f, "# op holes_percent exponent\n");
+        for (int i = 0; i < num_fits; i++) {
+            fprintf(f, "%s %d %.3f\n", op_names[fits[i].op], fits[i].holes, fits[i].exponent);
+        }
+        fclose(f);
+    }
+    free(blocks);
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ * 
+ * shardbench.c - Compares the footprint and throughput of per-thread and
+ * per-CPU class caches with more threads than CPUs.
+ **************************************************************************/
+
+#include "umalloc.h"
+#include "support.h"
+#include <pthread.h>
+
+extern size_t sbrk_bytes;
+
+static int num_ops = 200000;
+static int live_slots = 256;
+static pthread_barrier_t start_barrier;
+
+/* 
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: shardbench [-c] [-t threads] [-n ops] [-l live]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-c         Use per-CPU class caches instead of per-thread ones.\n");
+    fprintf(stderr, "\t-t threads Number of threads, 4x the online CPUs by default.\n");
+    fprintf(stderr, "\t-n ops     Operations per thread (default 200000).\n");
+    fprintf(stderr, "\t-l live    Live block slots per thread (default 256).\n");
+}
+
+/*
+ * worker - randomly allocates and frees small blocks in its slots, then
+ * frees everything and exits, leaving whatever its caches hold behind.
+ */
+static void *worker(void *arg) {
+    uint64_t state = (uintptr_t)arg * 0x9e3779b97f4a7c15ULL + 1;
+    void **slots = calloc(live_slots, sizeof(void *));
+    if (slots == NULL) {
+        appl_error("Failed to allocate slot array");
+    }
+    pthread_barrier_wait(&start_barrier);
+    for (int i = 0; i < num_ops; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int slot = state % live_slots;
+        if (slots[slot]) {
+            ufree(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = umalloc(16 + (state >> 32) % 497);
+        }
+    }
+    for (int slot = 0; slot < live_slots; slot++) {
+        if (slots[slot]) {
+            ufree(slots[slot]);
+        }
+    }
+    free(slots);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int c;
+    int per_cpu = 0;
+    int num_threads = 4 * sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((c = getopt(argc, argv, "ct:n:l:")) != -1) {
+        switch (c) {
+        case 'c':
+            per_cpu = 1;
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'n':
+            num_ops = atoi(optarg);
+            break;
+        case 'l':
+            live_slots = atoi(optarg);
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (num_threads <= 0 || num_ops <= 0 || live_slots <= 0) {
+        usage();
+        appl_error("Thread, op and slot counts must be positive.");
+    }
+
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    if (threads == NULL) {
+        appl_error("Failed to allocate thread array");
+    }
+    if (uinit() == -1) {
+        appl_error("uinit failed.");
+    }
+    set_shard_mode(per_cpu ? SHARD_PER_CPU : SHARD_PER_THREAD);
+    pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+
+    struct timespec start, end;
+    for (long i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, (void *)(i + 1)) != 0) {
+            appl_error("pthread_create failed.");
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("%s caches, %d threads on %ld cpus: %.0f ops/ms, footprint %zu KiB\n",
+        per_cpu ? "per-cpu" : "per-thread", num_threads, sysconf(_SC_NPROCESSORS_ONLN),
+        (double)num_ops * num_threads / ms, sbrk_bytes / 1024);
+    print_shard_report(stdout);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Times a few everyday workloads under glibc malloc and under umalloc
+# through the LD_PRELOAD shim (make libumalloc.so). Each workload runs
+# "runs" times per allocator and the fastest wall-clock time is reported.
+if [ "$#" -gt 1 ]; then
+  echo "Usage: $0 [runs]" >&2
+  exit 1
+fi
+
+runs="${1:-3}"
+shim="$(pwd)/libumalloc.so"
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+if ! [ -f "$shim" ]; then
+  echo "$shim not found, run make libumalloc.so first" >&2
+  exit 1
+fi
+
+# input for sort: a million lines in random order
+seq 1 1000000 | awk 'BEGIN { srand(429) } { print rand(), $0 }' > "$work/numbers.txt"
+
+# best_ms preload cmd... - fastest of $runs runs, in milliseconds
+best_ms() {
+  preload="$1"
+  shift
+  best=""
+  i=0
+  while [ "$i" -lt "$runs" ]; do
+    start=$(date +%s%N)
+    if ! LD_PRELOAD="$preload" "$@" > /dev/null 2>&1; then
+      echo "failed"
+      return
+    fi
+    end=$(date +%s%N)
+    ms=$(( (end - start) / 1000000 ))
+    if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+      best=$ms
+    fi
+    i=$((i + 1))
+  done
+  echo "$best"
+}
+
+# bench name cmd... - one line of the report
+bench() {
+  name="$1"
+  shift
+  glibc=$(best_ms "" "$@")
+  umalloc=$(best_ms "$shim" "$@")
+  printf "%-24s %10s %10s\n" "$name" "$glibc" "$umalloc"
+}
+
+printf "%-24s %10s %10s\n" "workload (best of $runs)" "glibc ms" "umalloc ms"
+bench "gcc -O2 umalloc.c" gcc -O2 -c umalloc.c -o "$work/umalloc.o"
+bench "sort 1M lines" sort "$work/numbers.txt"
+bench "sort -n 1M lines" sort -n -k2 "$work/numbers.txt"
+if command -v python3 > /dev/null; then
+  bench "python3 dict churn" python3 -c \
+    "d = {}
+for i in range(300000): d[str(i)] = [i] * (i % 7)
+for i in range(0, 300000, 2): del d[str(i)]"
+fi
@@ -0,0 +1,413 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * sizeclass_gen.c - Fits the fast path's size classes to a set of traces.
+ * The request sizes of the traces are weighted by how long their blocks
+ * live, and a dynamic program picks the class table that wastes the
+ * fewest byte-ops of rounding under a budget of classes. The table is
+ * written as a header that umalloc compiles in (make classes), and for
+ * every trace the utilization is predicted under the current and the new
+ * table and measured with the table umalloc was built with.
+ **************************************************************************/
+
+#include "umalloc.h"
+#include "support.h"
+#include <sys/wait.h>
+
+#define DEFAULT_CLASSES 24
+#define MAX_CLASSES 64
+#define MAX_COVER 1024      /* largest class the fast path tables allow */
+#define NUM_UNITS (MAX_COVER / ALIGNMENT + 1)
+#define TOP_SIZES 12        /* sizes listed in the histogram summary */
+
+extern size_t sbrk_bytes;
+
+typedef struct {
+    size_t sizes[MAX_CLASSES];
+    int num_classes;
+} table_t;
+
+/* Per request size up to MAX_COVER: requests, ops they lived and weight. */
+static uint64_t size_requests[MAX_COVER + 1];
+static uint64_t size_lifetime[MAX_COVER + 1];
+static double size_weight[MAX_COVER + 1];
+static uint64_t larger_requests;
+
+/*
+ * class_of - the class of a table serving a request, or -1 above it.
+ */
+static int class_of(table_t *table, size_t size) {
+    for (int c = 0; c < table->num_classes; c++) {
+        if (ALIGN(size) <= table->sizes[c]) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+/*
+ * footprint - heap bytes a request takes under a table, header included,
+ * if no space were lost between blocks.
+ */
+static size_t footprint(table_t *table, size_t size) {
+    int c = class_of(table, size);
+    return (c == -1 ? BLOCK_SIZE(size) : BLOCK_SIZE(table->sizes[c])) + HEADER_SIZE;
+}
+
+/*
+ * end_lifetime - adds a request that lived from op born to op now to the
+ * histogram.
+ */
+static void end_lifetime(int size, int born, int now, bool by_count) {
+    if (size > MAX_COVER) {
+        larger_requests++;
+        return;
+    }
+    size_requests[size]++;
+    size_lifetime[size] += now - born;
+    size_weight[size] += by_count ? 1 : now - born;
+}
+
+/*
+ * measure_lifetimes - adds a trace's requests to the histogram. A request
+ * lives from its alloc or realloc to the free or realloc that ends it, or
+ * to the end of the trace.
+ */
+static void measure_lifetimes(trace_t *trace, bool by_count) {
+    int *born = malloc(trace->num_ids * sizeof(int));
+    int *sizes = malloc(trace->num_ids * sizeof(int));
+    if (born == NULL || sizes == NULL) {
+        appl_error("Failed to allocate the lifetime arrays");
+    }
+    for (int id = 0; id < trace->num_ids; id++) {
+        born[id] = -1;
+    }
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t op = trace->ops[i];
+        if (op.type != ALLOC && born[op.index] != -1) {
+            end_lifetime(sizes[op.index], born[op.index], i, by_count);
+            born[op.index] = -1;
+        }
+        if (op.type != FREE) {
+            born[op.index] = i;
+            sizes[op.index] = op.size;
+        }
+    }
+    for (int id = 0; id < trace->num_ids; id++) {
+        if (born[id] != -1) {
+            end_lifetime(sizes[id], born[id], trace->num_ops, by_count);
+        }
+    }
+    free(born);
+    free(sizes);
+}
+
+/*
+ * solve_table - the table of at most budget classes, the largest of them
+ * cover, that wastes the least weighted rounding. Only sizes that are
+ * requested are worth a class; a spare class budget then splits the
+ * widest gaps, for sizes the traces missed.
+ */
+static void solve_table(table_t *table, int budget, size_t cover) {
+    size_t cand[NUM_UNITS];
+    double weight[NUM_UNITS], bytes[NUM_UNITS];
+    int n = 0;
+    for (size_t c = ALIGNMENT; c <= cover; c += ALIGNMENT) {
+        double w = 0, b = 0;
+        for (size_t s = c - ALIGNMENT + 1; s <= c; s++) {
+            w += size_weight[s];
+            b += size_weight[s] * s;
+        }
+        if (w > 0 || c == cover) {
+            cand[n] = c;
+            weight[n] = w;
+            bytes[n] = b;
+            n++;
+        }
+    }
+
+    /* cost[k][j]: least waste of the sizes up to cand[j] with k classes, cand[j] the last */
+    static double cost[MAX_CLASSES + 1][NUM_UNITS];
+    static int from[MAX_CLASSES + 1][NUM_UNITS];
+    int classes = budget < n ? budget : n;
+    for (int j = 0; j < n; j++) {
+        double w = 0, b = 0;
+        for (int i = 0; i <= j; i++) {
+            w += weight[i];
+            b += bytes[i];
+        }
+        cost[1][j] = BLOCK_SIZE(cand[j]) * w - b;
+        from[1][j] = -1;
+    }
+    for (int k = 2; k <= classes; k++) {
+        for (int j = k - 1; j < n; j++) {
+            double w = 0, b = 0;
+            cost[k][j] = -1;
+            for (int i = j - 1; i >= k - 2; i--) {
+                w += weight[i + 1];
+                b += bytes[i + 1];
+                double total = cost[k - 1][i] + BLOCK_SIZE(cand[j]) * w - b;
+                if (cost[k][j] < 0 || total < cost[k][j]) {
+                    cost[k][j] = total;
+                    from[k][j] = i;
+                }
+            }
+        }
+    }
+    table->num_classes = classes;
+    for (int k = classes, j = n - 1; k >= 1; j = from[k][j], k--) {
+        table->sizes[k - 1] = cand[j];
+    }
+
+    while (table->num_classes < budget) {
+        int widest = 0;
+        size_t below = 0, gap = 0;
+        for (int c = 0; c < table->num_classes; c++) {
+            if (table->sizes[c] - below > gap) {
+                gap = table->sizes[c] - below;
+                widest = c;
+            }
+            below = table->sizes[c];
+        }
+        if (gap <= ALIGNMENT) {
+            break;
+        }
+        size_t split = ALIGN((table->sizes[widest] - gap + table->sizes[widest]) / 2);
+        memmove(&table->sizes[widest + 1], &table->sizes[widest], (table->num_classes - widest) * sizeof(size_t));
+        table->sizes[widest] = split;
+        table->num_classes++;
+    }
+}
+
+/*
+ * predict_utilization - peak live bytes over peak footprint under a
+ * table, as if no space were lost between blocks.
+ */
+static double predict_utilization(trace_t *trace, table_t *table) {
+    int *sizes = calloc(trace->num_ids, sizeof(int));
+    uint64_t live = 0, foot = 0, peak_live = 0, peak_foot = 0;
+    if (sizes == NULL) {
+        appl_error("Failed to allocate the size array");
+    }
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t op = trace->ops[i];
+        if (op.type != ALLOC) {
+            live -= sizes[op.index];
+            foot -= footprint(table, sizes[op.index]);
+        }
+        if (op.type != FREE) {
+            sizes[op.index] = op.size;
+            live += op.size;
+            foot += footprint(table, op.size);
+        }
+        peak_live = live > peak_live ? live : peak_live;
+        peak_foot = foot > peak_foot ? foot : peak_foot;
+    }
+    free(sizes);
+    return peak_foot ? 100.0 * peak_live / peak_foot : 0.0;
+}
+
+/*
+ * measure_utilization - replays the trace through umalloc in a child, so
+ * each trace starts on an empty heap, and prints peak live bytes over
+ * the bytes taken from csbrk. runner scores the same ratio, but it also
+ * takes sbrk pages between ops, so its heap is not contiguous.
+ */
+static void measure_utilization(trace_t *trace) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        appl_error("fork failed.");
+    }
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    void **payloads = calloc(trace->num_ids, sizeof(void *));
+    int *sizes = calloc(trace->num_ids, sizeof(int));
+    uint64_t live = 0, peak = 0;
+    if (payloads == NULL || sizes == NULL || uinit() == -1) {
+        printf("%10s\n", "failed");
+        exit(1);
+    }
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t op = trace->ops[i];
+        if (op.type != ALLOC) {
+            live -= sizes[op.index];
+        }
+        if (op.type == ALLOC) {
+            payloads[op.index] = umalloc(op.size);
+        } else if (op.type == REALLOC) {
+            payloads[op.index] = urealloc(payloads[op.index], op.size);
+        } else {
+            ufree(payloads[op.index]);
+            continue;
+        }
+        if (payloads[op.index] == NULL) {
+            printf("%10s\n", "failed");
+            exit(1);
+        }
+        sizes[op.index] = op.size;
+        live += op.size;
+        peak = live > peak ? live : peak;
+    }
+    printf("%9.2f%%\n", sbrk_bytes ? 100.0 * peak / sbrk_bytes : 0.0);
+    exit(0);
+}
+
+static void print_table(FILE *out, table_t *table, const char *indent) {
+    for (int c = 0; c < table->num_classes; c++) {
+        fprintf(out, "%s%zu", c % 12 ? " " : indent, table->sizes[c]);
+        if (c % 12 == 11 || c == table->num_classes - 1) {
+            fprintf(out, "\n");
+        }
+    }
+}
+
+/*
+ * write_header - the table as a USIZE_CLASSES list for umalloc.h.
+ */
+static void write_header(char *file, table_t *table, int argc, char **argv, int first_trace) {
+    FILE *f = fopen(file, "w");
+    if (f == NULL) {
+        appl_error("Could not write the header.");
+    }
+    fprintf(f, "/*\n * %s - size classes fitted by sizeclass_gen to\n", file);
+    for (int i = first_trace; i < argc; i++) {
+        fprintf(f, " *     %s\n", argv[i]);
+    }
+    fprintf(f, " * Build umalloc with them by running make classes.\n */\n\n");
+    fprintf(f, "#define USIZE_CLASSES(X, arg) \\\n");
+    for (int c = 0; c < table->num_classes; c++) {
+        fprintf(f, "%sX(%zu, arg)%s", c % 6 ? " " : "    ", table->sizes[c],
+            c == table->num_classes - 1 ? "\n" : c % 6 == 5 ? " \\\n" : "");
+    }
+    fprintf(f, "#define UFAST_MAX_SIZE %zu\n", table->sizes[table->num_classes - 1]);
+    fclose(f);
+}
+
+static int by_weight(const void *a, const void *b) {
+    double x = size_weight[*(const int *)a], y = size_weight[*(const int *)b];
+    return (x < y) - (x > y);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: sizeclass_gen [-c] [-k classes] [-m bytes] [-o header] trace...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-k classes Most classes the table may have, up to %d (default %d).\n",
+        MAX_CLASSES, DEFAULT_CLASSES);
+    fprintf(stderr, "\t-m bytes   Largest request the classes cover, up to %d (default: the largest\n", MAX_COVER);
+    fprintf(stderr, "\t           request of the traces that fits).\n");
+    fprintf(stderr, "\t-c         Weigh each request once, not by how long its block lives.\n");
+    fprintf(stderr, "\t-o header  Write the table as a header for make classes (usize_classes.h).\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    int budget = DEFAULT_CLASSES;
+    size_t cover = 0;
+    bool by_count = false;
+    char *header = NULL;
+    table_t current = {.num_classes = NUM_SIZE_CLASSES}, fitted;
+
+    while ((c = getopt(argc, argv, "ck:m:o:")) != -1) {
+        switch (c) {
+        case 'c':
+            by_count = true;
+            break;
+        case 'k':
+            budget = atoi(optarg);
+            if (budget < 1 || budget > MAX_CLASSES) {
+                usage();
+                appl_error("The class budget must be between 1 and 64.");
+            }
+            break;
+        case 'm':
+            cover = atol(optarg);
+            if (cover < ALIGNMENT || cover > MAX_COVER) {
+                usage();
+                appl_error("The covered size must be between ALIGNMENT and 1024.");
+            }
+            break;
+        case 'o':
+            header = optarg;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind == argc) {
+        usage();
+        appl_error("Expected at least one trace.");
+    }
+
+    int num_traces = argc - optind;
+    trace_t **traces = malloc(num_traces * sizeof(trace_t *));
+    if (traces == NULL) {
+        appl_error("Failed to allocate the trace array");
+    }
+    for (int t = 0; t < num_traces; t++) {
+        traces[t] = read_trace(argv[optind + t], 0);
+        measure_lifetimes(traces[t], by_count);
+    }
+    if (cover == 0) {
+        for (size_t s = MAX_COVER; s > 0 && !cover; s--) {
+            cover = size_requests[s] ? ALIGN(s) : 0;
+        }
+        if (cover == 0) {
+            appl_error("No request in the traces is small enough for a class.");
+        }
+    }
+    cover = ALIGN(cover);
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        current.sizes[i] = ufast_class_size[i];
+    }
+    solve_table(&fitted, budget, cover);
+
+    int top[MAX_COVER + 1], num_sizes = 0;
+    uint64_t requests = larger_requests;
+    for (int s = 0; s <= MAX_COVER; s++) {
+        requests += size_requests[s];
+        if (size_requests[s]) {
+            top[num_sizes++] = s;
+        }
+    }
+    qsort(top, num_sizes, sizeof(int), by_weight);
+    printf("%lu requests in %d traces, %lu above %d bytes; the heaviest sizes by %s:\n", requests, num_traces,
+        larger_requests, MAX_COVER, by_count ? "requests" : "requests times lifetime");
+    printf("%8s %10s %9s %14s\n", "size", "requests", "%", "mean lifetime");
+    for (int i = 0; i < num_sizes && i < TOP_SIZES; i++) {
+        int s = top[i];
+        printf("%8d %10lu %8.2f%% %10.0f ops\n", s, size_requests[s], 100.0 * size_requests[s] / requests,
+            (double)size_lifetime[s] / size_requests[s]);
+    }
+    printf("\nBuilt-in table, %d classes:\n", current.num_classes);
+    print_table(stdout, &current, "    ");
+    printf("Fitted table, %d classes up to %zu bytes:\n", fitted.num_classes, cover);
+    print_table(stdout, &fitted, "    ");
+    bool compiled = fitted.num_classes == current.num_classes &&
+        memcmp(fitted.sizes, current.sizes, fitted.num_classes * sizeof(size_t)) == 0;
+    printf("umalloc is built with %s table\n\n", compiled ? "the fitted" : "a different");
+
+    printf("Utilization, predicted without space lost between blocks, measured with the built-in table\n");
+    printf("%-28s %10s %10s %10s\n", "trace", "built-in", "fitted", "measured");
+    for (int t = 0; t < num_traces; t++) {
+        printf("%-28s %9.2f%% %9.2f%% ", argv[optind + t], predict_utilization(traces[t], &current),
+            predict_utilization(traces[t], &fitted));
+        measure_utilization(traces[t]);
+    }
+
+    if (header) {
+        write_header(header, &fitted, argc, argv, optind);
+        printf("\nWrote %s; make classes builds umalloc with it\n", header);
+    }
+    for (int t = 0; t < num_traces; t++) {
+        free_trace(traces[t]);
+    }
+    free(traces);
+    return 0;
+}
@@ -9,6 +9,9 @@
 
 #include "support.h"
 #include "err_handler.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
@@ -34,7 +37,45 @@ void malloc_error(int opnum, char *msg)
 }
 
 /*
- * read_trace - read a trace file and store it in memory
+ * map_trace - map a binary trace file. The ops are used straight from the
+ * mapping; only the block array is allocated.
+ */
+static void map_trace(trace_t *trace, char *filename)
+{
+    int fd;
+    struct stat st;
+    trace_header_t *header;
+
+    if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        sprintf(msg, "Could not open %s in map_trace", filename);
+        appl_error(msg);
+    }
+    if (st.st_size < sizeof(trace_header_t))
+        appl_error("Binary trace is missing its header.");
+
+    trace->mapping_size = st.st_size;
+    trace->mapping = mmap(NULL, trace->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (trace->mapping == MAP_FAILED)
+        appl_error("mmap failed in map_trace");
+    madvise(trace->mapping, trace->mapping_size, MADV_SEQUENTIAL);
+
+    header = (trace_header_t *)trace->mapping;
+    trace->num_ids = header->num_ids;
+    trace->num_ops = header->num_ops;
+    if (trace->num_ids < 0 || trace->num_ops < 0 ||
+        trace->mapping_size < sizeof(trace_header_t) + (size_t)trace->num_ops * sizeof(traceop_t))
+        appl_error("Binary trace is truncated.");
+    trace->ops = (traceop_t *)(header + 1);
+
+    trace->blocks = (allocated_block_t *)calloc(trace->num_ids, sizeof(allocated_block_t));
+    if (trace->blocks == NULL)
+        appl_error("Failed to allocate block array");
+}
+
+/*
+ * read_trace - read a trace file and store it in memory. Binary traces,
+ * recognized by their magic, are mapped instead of parsed.
  */
 trace_t *read_trace(char *filename, int verbose)
 {
@@ -47,7 +88,7 @@ trace_t *read_trace(char *filename, int verbose)
         printf("Reading tracefile: %s\n", filename);
 
     /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+    if ((trace = (trace_t *) calloc(1, sizeof(trace_t))) == NULL)
         appl_error("malloc 1 failed in read_trace");
 
     /* Read the trace file header */
@@ -56,6 +97,14 @@ trace_t *read_trace(char *filename, int verbose)
         appl_error(msg);
     }
 
+    if (fread(type, 1, TRACE_MAGIC_LEN, tracefile) == TRACE_MAGIC_LEN &&
+        memcmp(type, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0) {
+        fclose(tracefile);
+        map_trace(trace, filename);
+        return trace;
+    }
+    rewind(tracefile);
+
     err = fscanf(tracefile, "%d", &(trace->num_ids)); 
     if (err == EOF) {
         appl_error("fscanf failed to find num ids.");
@@ -102,6 +151,15 @@ trace_t *read_trace(char *filename, int verbose)
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
         break;
+        case 'r':
+            err = fscanf(tracefile, "%u %u", &index, &size);
+            if (err == EOF) {
+                appl_error("fscanf failed to find index and size.");
+            }
+            trace->ops[op_index].type = REALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            break;
         default:
             sprintf(msg, "Bogus type character (%c) in tracefile %s\n", type[0], filename);
             appl_error(msg);
@@ -116,13 +174,519 @@ trace_t *read_trace(char *filename, int verbose)
     return trace;
 }
 
+/*
+ * write_trace - write a trace out in the binary format, or as a .rep
+ * text file if binary is false.
+ */
+void write_trace(trace_t *trace, char *filename, bool binary)
+{
+    FILE *tracefile;
+    trace_header_t header;
+
+    if ((tracefile = fopen(filename, "w")) == NULL) {
+        sprintf(msg, "Could not open %s in write_trace", filename);
+        appl_error(msg);
+    }
+
+    if (binary) {
+        memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+        header.num_ids = trace->num_ids;
+        header.num_ops = trace->num_ops;
+        if (fwrite(&header, sizeof(header), 1, tracefile) != 1 ||
+            fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, tracefile) != trace->num_ops)
+            appl_error("fwrite failed in write_trace");
+    } else {
+        fprintf(tracefile, "%d\n%d\n", trace->num_ids, trace->num_ops);
+        for (int i = 0; i < trace->num_ops; i++) {
+            if (trace->ops[i].type == ALLOC)
+                fprintf(tracefile, "a %d %d\n", trace->ops[i].index, trace->ops[i].size);
+            else if (trace->ops[i].type == REALLOC)
+                fprintf(tracefile, "r %d %d\n", trace->ops[i].index, trace->ops[i].size);
+            else
+                fprintf(tracefile, "f %d\n", trace->ops[i].index);
+        }
+    }
+
+    if (fclose(tracefile) == EOF)
+        appl_error("fclose failed in write_trace");
+}
+
 /*
  * free_trace - Free the trace record and the two arrays it points
  *              to, all of which were allocated in read_trace().
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the two arrays... */
+    if (trace->mapping)       /* the ops of a binary trace live in its mapping */
+        munmap(trace->mapping, trace->mapping_size);
+    else
+        free(trace->ops);     /* free the two arrays... */
     free(trace->blocks);      
     free(trace);              /* and the trace record itself... */
-}
\ No newline at end of file
+}
+
+/*
+ * fill_chunk - read up to STREAM_CHUNK_OPS ops from a stream's file.
+ * Returns the number read, 0 at the end of the trace.
+ */
+static size_t fill_chunk(trace_stream_t *stream, traceop_t *ops)
+{
+    char type[MAXLINE];
+    unsigned index, size;
+    size_t n = 0;
+
+    if (stream->binary)
+        return fread(ops, sizeof(traceop_t), STREAM_CHUNK_OPS, stream->file);
+
+    while (n < STREAM_CHUNK_OPS && fscanf(stream->file, "%s", type) != EOF) {
+        switch(type[0]) {
+        case 'a':
+            if (fscanf(stream->file, "%u %u", &index, &size) != 2)
+                appl_error("fscanf failed to find index and size.");
+            ops[n].type = ALLOC;
+            ops[n].index = index;
+            ops[n].size = size;
+            break;
+        case 'f':
+            if (fscanf(stream->file, "%u", &index) != 1)
+                appl_error("fscanf failed to find index.");
+            ops[n].type = FREE;
+            ops[n].index = index;
+            break;
+        case 'r':
+            if (fscanf(stream->file, "%u %u", &index, &size) != 2)
+                appl_error("fscanf failed to find index and size.");
+            ops[n].type = REALLOC;
+            ops[n].index = index;
+            ops[n].size = size;
+            break;
+        default:
+            appl_error("Bogus type character in streamed tracefile");
+        }
+        n++;
+    }
+    return n;
+}
+
+/*
+ * stream_reader - reader thread. Fills the two buffers in turn, waiting
+ * for the consumer to release each one, until the trace runs out.
+ */
+static void *stream_reader(void *arg)
+{
+    trace_stream_t *stream = (trace_stream_t *)arg;
+    int buf = 0;
+    size_t len;
+
+    do {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->filled[buf] && !stream->stop)
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        if (stream->stop) {
+            pthread_mutex_unlock(&stream->lock);
+            break;
+        }
+        pthread_mutex_unlock(&stream->lock);
+
+        len = fill_chunk(stream, stream->chunk[buf]);
+
+        pthread_mutex_lock(&stream->lock);
+        stream->chunk_len[buf] = len;
+        stream->filled[buf] = true;
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+        buf ^= 1;
+    } while (len > 0);
+    return NULL;
+}
+
+/*
+ * open_trace_stream - open a text or binary trace for streaming replay and
+ * start its reader thread. Only the header is read up front.
+ */
+trace_stream_t *open_trace_stream(char *filename)
+{
+    trace_stream_t *stream;
+    trace_header_t header;
+
+    if ((stream = (trace_stream_t *) calloc(1, sizeof(trace_stream_t))) == NULL)
+        appl_error("malloc failed in open_trace_stream");
+
+    if ((stream->file = fopen(filename, "r")) == NULL) {
+        sprintf(msg, "Could not open %s in open_trace_stream", filename);
+        appl_error(msg);
+    }
+
+    if (fread(&header, sizeof(header), 1, stream->file) == 1 &&
+        memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0) {
+        stream->binary = true;
+        stream->num_ids = header.num_ids;
+        stream->num_ops = header.num_ops;
+    } else {
+        rewind(stream->file);
+        if (fscanf(stream->file, "%d %d", &stream->num_ids, &stream->num_ops) != 2)
+            appl_error("fscanf failed to find num ids and num ops.");
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if ((stream->chunk[i] = (traceop_t *)malloc(STREAM_CHUNK_OPS * sizeof(traceop_t))) == NULL)
+            appl_error("Failed to allocate stream buffer");
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    if (pthread_create(&stream->reader, NULL, stream_reader, stream) != 0)
+        appl_error("Could not start the trace reader thread.");
+    return stream;
+}
+
+/*
+ * next_trace_op - copy the next op of a stream into op. Returns false once
+ * the trace is exhausted.
+ */
+bool next_trace_op(trace_stream_t *stream, traceop_t *op)
+{
+    if (stream->pos == stream->avail) {
+        if (stream->held && stream->avail == 0)
+            return false;                /* end of trace, already reached */
+        pthread_mutex_lock(&stream->lock);
+        if (stream->held) {
+            /* hand the consumed buffer back and move to the other one */
+            stream->filled[stream->current] = false;
+            stream->current ^= 1;
+            pthread_cond_broadcast(&stream->cond);
+        }
+        while (!stream->filled[stream->current])
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        stream->avail = stream->chunk_len[stream->current];
+        stream->pos = 0;
+        stream->held = true;
+        pthread_mutex_unlock(&stream->lock);
+        if (stream->avail == 0)
+            return false;
+    }
+    *op = stream->chunk[stream->current][stream->pos++];
+    return true;
+}
+
+/*
+ * close_trace_stream - stop the reader thread and free the stream.
+ */
+void close_trace_stream(trace_stream_t *stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->stop = true;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->reader, NULL);
+
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->cond);
+    fclose(stream->file);
+    free(stream->chunk[0]);
+    free(stream->chunk[1]);
+    free(stream);
+}
+
+#define ID_MAP_MIN_CAPACITY 1024
+
+/*
+ * map_table - zeroed memory for a growing table, straight from mmap.
+ * runner's bookkeeping grows while a trace replays, and growing through
+ * malloc would move the program break between umalloc's csbrk calls.
+ */
+static void *map_table(size_t bytes)
+{
+    void *table = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return table == MAP_FAILED ? NULL : table;
+}
+
+/*
+ * grow_table - a table of new_bytes holding the old_bytes of table,
+ * which is unmapped.
+ */
+static void *grow_table(void *table, size_t old_bytes, size_t new_bytes)
+{
+    void *grown = map_table(new_bytes);
+
+    if (grown != NULL && table != NULL) {
+        memcpy(grown, table, old_bytes);
+        munmap(table, old_bytes);
+    }
+    return grown;
+}
+
+/*
+ * id_home - the slot an id hashes to.
+ */
+static size_t id_home(id_map_t *map, int id)
+{
+    uint64_t h = (uint32_t)id * 0x9E3779B97F4A7C15ULL;
+    return (h ^ (h >> 32)) & (map->capacity - 1);
+}
+
+/*
+ * id_slot - the slot holding id, or the empty slot that ends its probe.
+ */
+static id_slot_t *id_slot(id_map_t *map, int id)
+{
+    size_t i = id_home(map, id);
+    while (map->slots[i].id != ID_MAP_EMPTY && map->slots[i].id != id)
+        i = (i + 1) & (map->capacity - 1);
+    return &map->slots[i];
+}
+
+/*
+ * id_map_resize - rehash every entry into a table of the given capacity.
+ */
+static void id_map_resize(id_map_t *map, size_t capacity)
+{
+    id_slot_t *old = map->slots;
+    size_t old_capacity = map->capacity;
+
+    if ((map->slots = (id_slot_t *)map_table(capacity * sizeof(id_slot_t))) == NULL)
+        appl_error("Failed to grow the id map");
+    for (size_t i = 0; i < capacity; i++)
+        map->slots[i].id = ID_MAP_EMPTY;
+    map->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].id != ID_MAP_EMPTY)
+            *id_slot(map, old[i].id) = old[i];
+    }
+    if (old != NULL)
+        munmap(old, old_capacity * sizeof(id_slot_t));
+}
+
+/*
+ * new_id_map - create an empty id map.
+ */
+id_map_t *new_id_map(void)
+{
+    id_map_t *map;
+
+    if ((map = (id_map_t *)calloc(1, sizeof(id_map_t))) == NULL)
+        appl_error("Failed to allocate the id map");
+    id_map_resize(map, ID_MAP_MIN_CAPACITY);
+    return map;
+}
+
+/*
+ * id_map_insert - the entry for id, created zeroed if it is not present.
+ */
+allocated_block_t *id_map_insert(id_map_t *map, int id)
+{
+    id_slot_t *slot;
+
+    if (2 * (map->count + 1) > map->capacity)
+        id_map_resize(map, 2 * map->capacity);
+    slot = id_slot(map, id);
+    if (slot->id == ID_MAP_EMPTY) {
+        slot->id = id;
+        memset(&slot->block, 0, sizeof(slot->block));
+        map->count++;
+    }
+    return &slot->block;
+}
+
+/*
+ * id_map_find - the entry for id, or NULL if it is not present.
+ */
+allocated_block_t *id_map_find(id_map_t *map, int id)
+{
+    id_slot_t *slot = id_slot(map, id);
+    return slot->id == ID_MAP_EMPTY ? NULL : &slot->block;
+}
+
+/*
+ * id_map_remove - drop id from the map. Later entries of the probe run
+ * are shifted back so lookups never need tombstones.
+ */
+void id_map_remove(id_map_t *map, int id)
+{
+    size_t mask = map->capacity - 1;
+    size_t hole = id_slot(map, id) - map->slots;
+    size_t i = hole;
+
+    if (map->slots[hole].id == ID_MAP_EMPTY)
+        return;
+    while (map->slots[i = (i + 1) & mask].id != ID_MAP_EMPTY) {
+        size_t home = id_home(map, map->slots[i].id);
+        /* move the entry back unless its home lies in (hole, i] */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            map->slots[hole] = map->slots[i];
+            hole = i;
+        }
+    }
+    map->slots[hole].id = ID_MAP_EMPTY;
+    map->count--;
+}
+
+/*
+ * free_id_map - free an id map and its table.
+ */
+void free_id_map(id_map_t *map)
+{
+    munmap(map->slots, map->capacity * sizeof(id_slot_t));
+    free(map);
+}
+
+#define INTERVAL_MIN_CAPACITY 1024
+
+/*
+ * interval_node - a fresh node for [start, end), from the free list or a
+ * grown pool. Node indexes stay valid when the pool moves; the pool is
+ * mapped like the id map's slots.
+ */
+static int interval_node(interval_index_t *index, uintptr_t start, uintptr_t end, int id)
+{
+    int n = index->free_node;
+
+    if (n != -1) {
+        index->free_node = index->nodes[n].right;
+    } else {
+        if (index->used == index->capacity) {
+            int capacity = index->capacity ? 2 * index->capacity : INTERVAL_MIN_CAPACITY;
+            index->nodes = (interval_t *)grow_table(index->nodes, index->capacity * sizeof(interval_t),
+                capacity * sizeof(interval_t));
+            index->capacity = capacity;
+            if (index->nodes == NULL)
+                appl_error("Failed to grow the interval index");
+        }
+        n = index->used++;
+    }
+    index->seed ^= index->seed << 13;
+    index->seed ^= index->seed >> 17;
+    index->seed ^= index->seed << 5;
+    index->nodes[n] = (interval_t){start, end, id, index->seed, -1, -1};
+    return n;
+}
+
+/*
+ * interval_split - splits the treap at n into the nodes starting before
+ * key and the rest.
+ */
+static void interval_split(interval_t *nodes, int n, uintptr_t key, int *left, int *right)
+{
+    if (n == -1) {
+        *left = *right = -1;
+    } else if (nodes[n].start < key) {
+        interval_split(nodes, nodes[n].right, key, &nodes[n].right, right);
+        *left = n;
+    } else {
+        interval_split(nodes, nodes[n].left, key, left, &nodes[n].left);
+        *right = n;
+    }
+}
+
+/*
+ * interval_merge - joins two treaps whose keys are all in order.
+ */
+static int interval_merge(interval_t *nodes, int left, int right)
+{
+    if (left == -1)
+        return right;
+    if (right == -1)
+        return left;
+    if (nodes[left].priority > nodes[right].priority) {
+        nodes[left].right = interval_merge(nodes, nodes[left].right, right);
+        return left;
+    }
+    nodes[right].left = interval_merge(nodes, left, nodes[right].left);
+    return right;
+}
+
+/*
+ * new_interval_index - create an empty interval index.
+ */
+interval_index_t *new_interval_index(void)
+{
+    interval_index_t *index;
+
+    if ((index = (interval_index_t *)calloc(1, sizeof(interval_index_t))) == NULL)
+        appl_error("Failed to allocate the interval index");
+    index->root = -1;
+    index->free_node = -1;
+    index->seed = 0x2545F491;
+    return index;
+}
+
+/*
+ * interval_insert - add [start, end) for id. Intervals are keyed by start,
+ * which must not already be present.
+ */
+void interval_insert(interval_index_t *index, uintptr_t start, uintptr_t end, int id)
+{
+    int left, right;
+    int n = interval_node(index, start, end, id);
+
+    interval_split(index->nodes, index->root, start, &left, &right);
+    index->root = interval_merge(index->nodes, interval_merge(index->nodes, left, n), right);
+}
+
+/*
+ * interval_remove - drop the interval starting at start, if there is one.
+ */
+void interval_remove(interval_index_t *index, uintptr_t start)
+{
+    int left, mid, right;
+
+    interval_split(index->nodes, index->root, start, &left, &mid);
+    interval_split(index->nodes, mid, start + 1, &mid, &right);
+    if (mid != -1) {
+        index->nodes[mid].right = index->free_node;
+        index->free_node = mid;
+    }
+    index->root = interval_merge(index->nodes, left, right);
+}
+
+/*
+ * interval_collect - in order, the ids of nodes under n that start in
+ * [from, hi) and end after lo.
+ */
+static int interval_collect(interval_t *nodes, int n, uintptr_t from, uintptr_t lo, uintptr_t hi,
+    int *ids, int max_ids, int found)
+{
+    while (n != -1 && found < max_ids) {
+        if (nodes[n].start < from) {
+            n = nodes[n].right;
+        } else if (nodes[n].start >= hi) {
+            n = nodes[n].left;
+        } else {
+            found = interval_collect(nodes, nodes[n].left, from, lo, hi, ids, max_ids, found);
+            if (found < max_ids && nodes[n].end > lo)
+                ids[found++] = nodes[n].id;
+            n = nodes[n].right;
+        }
+    }
+    return found;
+}
+
+/*
+ * interval_overlaps - the ids of up to max_ids intervals overlapping
+ * [lo, hi), in address order; returns how many were found. The intervals
+ * are assumed disjoint, so only the last one starting at or before lo can
+ * reach into the range from below.
+ */
+int interval_overlaps(interval_index_t *index, uintptr_t lo, uintptr_t hi, int *ids, int max_ids)
+{
+    uintptr_t from = lo;
+
+    for (int n = index->root; n != -1; ) {
+        if (index->nodes[n].start <= lo) {
+            from = index->nodes[n].start;
+            n = index->nodes[n].right;
+        } else {
+            n = index->nodes[n].left;
+        }
+    }
+    return interval_collect(index->nodes, index->root, from, lo, hi, ids, max_ids, 0);
+}
+
+/*
+ * free_interval_index - free an interval index and its nodes.
+ */
+void free_interval_index(interval_index_t *index)
+{
+    if (index->nodes != NULL)
+        munmap(index->nodes, index->capacity * sizeof(interval_t));
+    free(index);
+}
@@ -17,6 +17,7 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
 
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       2 /* number of header lines in a trace file */
@@ -33,9 +34,9 @@ typedef struct {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC} type; /* type of request */
     int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc request */
+    int size;                         /* byte size of alloc or realloc request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -44,9 +45,103 @@ typedef struct {
     int num_ops;         /* number of distinct requests */
     traceop_t *ops;      /* array of requests */
     allocated_block_t *blocks; /* array of blocks returned by umalloc */
+    void *mapping;       /* mmap'd binary trace the ops point into, or NULL */
+    size_t mapping_size;
 } trace_t;
 
+/* 
+ * Binary trace format: a header followed by num_ops traceop_t records,
+ * exactly as they sit in memory, so a mapped file can be replayed in place.
+ */
+#define TRACE_MAGIC "UMTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+typedef struct {
+    char magic[TRACE_MAGIC_LEN];
+    int32_t num_ids;
+    int32_t num_ops;
+} trace_header_t;
+
+/*
+ * Streaming replay: ops are read in chunks of STREAM_CHUNK_OPS by a reader
+ * thread that fills one buffer while the replay consumes the other, so a
+ * trace never has to fit in memory.
+ */
+#define STREAM_CHUNK_OPS (1 << 16)
+
+typedef struct {
+    FILE *file;
+    bool binary;         /* binary records or .rep text lines */
+    int num_ids;
+    int num_ops;
+    traceop_t *chunk[2]; /* the two buffers, filled alternately */
+    size_t chunk_len[2]; /* ops in each filled buffer, 0 at end of trace */
+    bool filled[2];      /* buffer handed to the consumer, not yet released */
+    int current;         /* buffer the consumer is reading */
+    size_t pos;          /* next op in the current buffer */
+    size_t avail;        /* ops in the current buffer */
+    bool held;           /* consumer has taken its first buffer */
+    bool stop;           /* tells the reader to quit early */
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} trace_stream_t;
+
+/*
+ * Live blocks of a streamed trace, keyed by id. Open addressing with
+ * linear probing; capacity is a power of two kept at most half full.
+ */
+#define ID_MAP_EMPTY -1
+
+typedef struct {
+    int id;              /* ID_MAP_EMPTY for a free slot */
+    allocated_block_t block;
+} id_slot_t;
+
+typedef struct {
+    size_t capacity;
+    size_t count;
+    id_slot_t *slots;
+} id_map_t;
+
+/*
+ * Address ranges of live payloads, keyed by start address, so the blocks
+ * near an address can be found without scanning. A treap whose nodes are
+ * kept in a pool and linked by index.
+ */
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+    int id;
+    uint32_t priority;
+    int left;            /* -1 for none; right links the pool's free list */
+    int right;
+} interval_t;
+
+typedef struct {
+    interval_t *nodes;
+    int capacity;
+    int used;
+    int root;
+    int free_node;
+    uint32_t seed;
+} interval_index_t;
+
 void appl_error(char *msg);
 void malloc_error(int opnum, char *msg);
 trace_t *read_trace(char *filename, int verbose);
-void free_trace(trace_t *trace);
\ No newline at end of file
+void write_trace(trace_t *trace, char *filename, bool binary);
+void free_trace(trace_t *trace);
+trace_stream_t *open_trace_stream(char *filename);
+bool next_trace_op(trace_stream_t *stream, traceop_t *op);
+void close_trace_stream(trace_stream_t *stream);
+id_map_t *new_id_map(void);
+allocated_block_t *id_map_insert(id_map_t *map, int id);
+allocated_block_t *id_map_find(id_map_t *map, int id);
+void id_map_remove(id_map_t *map, int id);
+void free_id_map(id_map_t *map);
+interval_index_t *new_interval_index(void);
+void interval_insert(interval_index_t *index, uintptr_t start, uintptr_t end, int id);
+void interval_remove(interval_index_t *index, uintptr_t start);
+int interval_overlaps(interval_index_t *index, uintptr_t lo, uintptr_t hi, int *ids, int max_ids);
+void free_interval_index(interval_index_t *index);
\ No newline at end of file
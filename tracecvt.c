@@ -0,0 +1,43 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ * 
+ * tracecvt.c - Converts traces between the .rep text format and the
+ * binary format that read_trace maps instead of parsing.
+ **************************************************************************/
+
+#include "support.h"
+
+/* 
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: tracecvt [-t] infile outfile\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-t         Write a .rep text trace instead of a binary one.\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    bool binary = true;
+
+    while ((c = getopt(argc, argv, "t")) != -1) {
+        switch (c) {
+        case 't':
+            binary = false;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
+        appl_error("Missing file parameters.");
+    }
+
+    trace_t *trace = read_trace(argv[optind], 0);
+    write_trace(trace, argv[optind + 1], binary);
+    free_trace(trace);
+    return 0;
+}
@@ -0,0 +1,464 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * tracegen.c - Generates balanced traces of any length from a seed, for
+ * the scaling runs the fixed traces (and the Perl scripts in traces/ that
+ * made them) are too small for. Request sizes come from a distribution,
+ * which may be measured from a histogram or another trace; blocks die by
+ * a lifetime model; a share of the ops can be reallocs; and the live set
+ * is held near a target size. The same options and seed always give the
+ * same trace.
+ **************************************************************************/
+
+#include "support.h"
+#include <limits.h>
+#include <math.h>
+
+#define DEFAULT_OPS 1000000
+#define DEFAULT_LIVE (64L << 20)
+#define DEFAULT_SURVIVORS 5   /* percent of a phase's blocks that outlive it */
+#define FREE_BELOW_TARGET 0.25 /* chance of a free at a full live set, below the target */
+
+typedef enum {
+    DIST_UNIFORM,       /* uniform:min:max */
+    DIST_POWER,         /* power:min:max:alpha, P(size) ~ size^-alpha */
+    DIST_BIMODAL,       /* bimodal:small:large:percent large */
+    DIST_HISTOGRAM,     /* hist:file of "size count" lines, or trace:file */
+} dist_kind_t;
+
+typedef enum {
+    LIFE_LIFO,          /* the newest live block dies first */
+    LIFE_FIFO,          /* the oldest */
+    LIFE_RANDOM,        /* any, uniformly */
+    LIFE_PHASE,         /* phases fill the live set, then die together */
+} life_kind_t;
+
+typedef struct {
+    dist_kind_t kind;
+    long min, max;
+    double alpha;
+    int percent;
+    long *sizes;        /* histogram sizes and their cumulative counts */
+    double *cumulative;
+    size_t num_sizes;
+} dist_t;
+
+typedef struct {
+    int id;
+    int size;
+    size_t phase;
+} live_block_t;
+
+static uint64_t rng_state;
+
+static traceop_t *ops;
+static size_t num_ops;
+static size_t ops_capacity;
+
+/* Live blocks in allocation order, a ring so both ends can be taken. */
+static live_block_t *live;
+static size_t live_head;
+static size_t live_count;
+static size_t live_capacity;
+static uint64_t live_bytes;
+
+/*
+ * next_random - splitmix64, so a seed gives the same trace everywhere.
+ */
+static uint64_t next_random(void) {
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* uniform in [0, 1) */
+static double next_unit(void) {
+    return (next_random() >> 11) / 9007199254740992.0;
+}
+
+static void add_op(int type, int index, int size) {
+    if (num_ops == ops_capacity) {
+        ops_capacity = ops_capacity ? 2 * ops_capacity : 4096;
+        if ((ops = realloc(ops, ops_capacity * sizeof(traceop_t))) == NULL) {
+            appl_error("Failed to grow the op array");
+        }
+    }
+    ops[num_ops++] = (traceop_t){.type = type, .index = index, .size = size};
+}
+
+static live_block_t *live_at(size_t i) {
+    return &live[(live_head + i) % live_capacity];
+}
+
+static void live_push(live_block_t block) {
+    if (live_count == live_capacity) {
+        size_t capacity = live_capacity ? 2 * live_capacity : 4096;
+        live_block_t *grown = malloc(capacity * sizeof(live_block_t));
+        if (grown == NULL) {
+            appl_error("Failed to grow the live set");
+        }
+        for (size_t i = 0; i < live_count; i++) {
+            grown[i] = *live_at(i);
+        }
+        free(live);
+        live = grown;
+        live_capacity = capacity;
+        live_head = 0;
+    }
+    *live_at(live_count++) = block;
+    live_bytes += block.size;
+}
+
+/*
+ * live_take - removes the i'th oldest live block. Only the ends keep the
+ * order of the rest; a block from the middle is replaced by the newest.
+ */
+static live_block_t live_take(size_t i) {
+    live_block_t block = *live_at(i);
+    if (i == 0) {
+        live_head = (live_head + 1) % live_capacity;
+    } else if (i != live_count - 1) {
+        *live_at(i) = *live_at(live_count - 1);
+    }
+    live_count--;
+    live_bytes -= block.size;
+    return block;
+}
+
+/*
+ * parse_bytes - a byte count with an optional K, M or G suffix.
+ */
+static long parse_bytes(const char *s) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    switch (*end) {
+    case 'G': case 'g':
+        n <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        n <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        n <<= 10;
+        end++;
+    }
+    return *end || n < 0 ? -1 : n;
+}
+
+static void add_histogram_size(dist_t *dist, long size, double count) {
+    if (size < 1 || size > INT_MAX || count <= 0) {
+        return;
+    }
+    if ((dist->num_sizes & (dist->num_sizes - 1)) == 0) {
+        size_t capacity = dist->num_sizes ? 2 * dist->num_sizes : 64;
+        dist->sizes = realloc(dist->sizes, capacity * sizeof(long));
+        dist->cumulative = realloc(dist->cumulative, capacity * sizeof(double));
+        if (dist->sizes == NULL || dist->cumulative == NULL) {
+            appl_error("Failed to grow the size histogram");
+        }
+    }
+    dist->sizes[dist->num_sizes] = size;
+    dist->cumulative[dist->num_sizes] = count + (dist->num_sizes ? dist->cumulative[dist->num_sizes - 1] : 0);
+    dist->num_sizes++;
+}
+
+static int by_size(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * measure_trace - uses the request sizes of a trace, allocs and reallocs
+ * alike, as a histogram.
+ */
+static void measure_trace(dist_t *dist, char *file) {
+    trace_t *trace = read_trace(file, 0);
+    long *sizes = malloc((trace->num_ops + 1) * sizeof(long));
+    size_t n = 0;
+    if (sizes == NULL) {
+        appl_error("Failed to allocate the size array");
+    }
+    for (int i = 0; i < trace->num_ops; i++) {
+        if (trace->ops[i].type != FREE) {
+            sizes[n++] = trace->ops[i].size;
+        }
+    }
+    qsort(sizes, n, sizeof(long), by_size);
+    for (size_t i = 0, j; i < n; i = j) {
+        for (j = i; j < n && sizes[j] == sizes[i]; j++)
+            ;
+        add_histogram_size(dist, sizes[i], j - i);
+    }
+    free(sizes);
+    free_trace(trace);
+}
+
+/*
+ * parse_dist - reads a size distribution spec. Returns false if it is
+ * malformed.
+ */
+static bool parse_dist(dist_t *dist, char *spec) {
+    char file[MAXLINE];
+    memset(dist, 0, sizeof(*dist));
+    if (sscanf(spec, "uniform:%ld:%ld", &dist->min, &dist->max) == 2) {
+        dist->kind = DIST_UNIFORM;
+    } else if (sscanf(spec, "power:%ld:%ld:%lf", &dist->min, &dist->max, &dist->alpha) == 3) {
+        dist->kind = DIST_POWER;
+    } else if (sscanf(spec, "bimodal:%ld:%ld:%d", &dist->min, &dist->max, &dist->percent) == 3) {
+        dist->kind = DIST_BIMODAL;
+        if (dist->percent < 0 || dist->percent > 100) {
+            return false;
+        }
+    } else if (sscanf(spec, "hist:%1023s", file) == 1) {
+        FILE *f = fopen(file, "r");
+        long size;
+        double count;
+        if (f == NULL) {
+            return false;
+        }
+        while (fscanf(f, "%ld %lf", &size, &count) == 2) {
+            add_histogram_size(dist, size, count);
+        }
+        fclose(f);
+        dist->kind = DIST_HISTOGRAM;
+        return dist->num_sizes > 0;
+    } else if (sscanf(spec, "trace:%1023s", file) == 1) {
+        measure_trace(dist, file);
+        dist->kind = DIST_HISTOGRAM;
+        return dist->num_sizes > 0;
+    } else {
+        return false;
+    }
+    return dist->min >= 1 && dist->min <= dist->max && dist->max <= INT_MAX;
+}
+
+static int draw_size(dist_t *dist) {
+    switch (dist->kind) {
+    case DIST_UNIFORM:
+        return dist->min + next_random() % (dist->max - dist->min + 1);
+    case DIST_POWER: {
+        /* inverting the CDF of the power law cut off at min and max */
+        double u = next_unit(), lo = dist->min, hi = dist->max + 1.0, size;
+        if (fabs(dist->alpha - 1) < 1e-9) {
+            size = lo * pow(hi / lo, u);
+        } else {
+            double e = 1 - dist->alpha;
+            size = pow(pow(lo, e) + u * (pow(hi, e) - pow(lo, e)), 1 / e);
+        }
+        return size < dist->max ? (int)size : dist->max;
+    }
+    case DIST_BIMODAL:
+        return (int)(next_random() % 100) < dist->percent ? dist->max : dist->min;
+    case DIST_HISTOGRAM: {
+        double target = next_unit() * dist->cumulative[dist->num_sizes - 1];
+        size_t lo = 0, hi = dist->num_sizes - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (dist->cumulative[mid] <= target) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return dist->sizes[lo];
+    }
+    }
+    return 1;
+}
+
+/*
+ * free_victim - frees the block the lifetime model picks.
+ */
+static void free_victim(life_kind_t life) {
+    size_t i;
+    switch (life) {
+    case LIFE_LIFO:
+        i = live_count - 1;
+        break;
+    case LIFE_FIFO:
+        i = 0;
+        break;
+    default:
+        i = next_random() % live_count;
+    }
+    add_op(FREE, live_take(i).id, 0);
+}
+
+/*
+ * end_phase - frees the blocks of the phase that just ended, but for the
+ * survivors, and the survivors of the phase before, newest first.
+ */
+static void end_phase(size_t phase, int survivors) {
+    size_t kept = 0, count = live_count;
+    for (size_t i = count; i-- > 0;) {
+        live_block_t *block = live_at(i);
+        if (block->phase == phase && (int)(next_random() % 100) < survivors) {
+            continue;
+        }
+        add_op(FREE, block->id, 0);
+        live_bytes -= block->size;
+        block->id = -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (live_at(i)->id != -1) {
+            *live_at(kept++) = *live_at(i);
+        }
+    }
+    live_count = kept;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: tracegen [-b] [-n ops] [-L bytes] [-d dist] [-l model] [-r percent] [-s seed] outfile\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b         Write a binary trace instead of a .rep text one.\n");
+    fprintf(stderr, "\t-n ops     Ops to generate before the live blocks are freed (default %d).\n", DEFAULT_OPS);
+    fprintf(stderr, "\t-L bytes   Live set to stay near, with a K, M or G suffix (default 64M).\n");
+    fprintf(stderr, "\t-d dist    Request sizes (default uniform:1:4096):\n");
+    fprintf(stderr, "\t             uniform:min:max\n");
+    fprintf(stderr, "\t             power:min:max:alpha    P(size) proportional to size^-alpha\n");
+    fprintf(stderr, "\t             bimodal:small:large:p  large with probability p percent\n");
+    fprintf(stderr, "\t             hist:file              lines of \"size count\"\n");
+    fprintf(stderr, "\t             trace:file             the sizes a trace asks for\n");
+    fprintf(stderr, "\t-l model   Which block is freed: lifo, fifo, random (default) or phase[:p],\n");
+    fprintf(stderr, "\t           where each phase fills the live set and then frees all but p%% (default %d)\n",
+        DEFAULT_SURVIVORS);
+    fprintf(stderr, "\t           of its blocks, the survivors dying with the next phase.\n");
+    fprintf(stderr, "\t-r percent Make this share of the allocations reallocs of a random live block.\n");
+    fprintf(stderr, "\t-s seed    Seed of the generator (default 1).\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    bool binary = false;
+    long target_ops = DEFAULT_OPS;
+    long target_live = DEFAULT_LIVE;
+    dist_t dist = {.kind = DIST_UNIFORM, .min = 1, .max = 4096};
+    life_kind_t life = LIFE_RANDOM;
+    int survivors = DEFAULT_SURVIVORS;
+    int realloc_percent = 0;
+    uint64_t seed = 1;
+    char err_msg[MAXLINE];
+
+    while ((c = getopt(argc, argv, "bn:L:d:l:r:s:")) != -1) {
+        switch (c) {
+        case 'b':
+            binary = true;
+            break;
+        case 'n':
+            target_ops = atol(optarg);
+            if (target_ops <= 0 || target_ops > INT_MAX / 2) {
+                usage();
+                appl_error("The op count must be between 1 and INT_MAX / 2.");
+            }
+            break;
+        case 'L':
+            if ((target_live = parse_bytes(optarg)) <= 0) {
+                usage();
+                appl_error("The live set size must be positive.");
+            }
+            break;
+        case 'd':
+            if (!parse_dist(&dist, optarg)) {
+                usage();
+                sprintf(err_msg, "Bad size distribution %.900s", optarg);
+                appl_error(err_msg);
+            }
+            break;
+        case 'l':
+            if (strcmp(optarg, "lifo") == 0) {
+                life = LIFE_LIFO;
+            } else if (strcmp(optarg, "fifo") == 0) {
+                life = LIFE_FIFO;
+            } else if (strcmp(optarg, "random") == 0) {
+                life = LIFE_RANDOM;
+            } else if (strcmp(optarg, "phase") == 0 ||
+                    (sscanf(optarg, "phase:%d", &survivors) == 1 && survivors >= 0 && survivors <= 100)) {
+                life = LIFE_PHASE;
+            } else {
+                usage();
+                appl_error("Unknown lifetime model.");
+            }
+            break;
+        case 'r':
+            realloc_percent = atoi(optarg);
+            if (realloc_percent < 0 || realloc_percent > 100) {
+                usage();
+                appl_error("The realloc share must be between 0 and 100.");
+            }
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (argc - optind != 1) {
+        usage();
+        appl_error("Expected an output file.");
+    }
+
+    /*
+     * Below the target the next op is an alloc, or with a chance that grows
+     * with the live set a free; at the target it is always a free, or for
+     * phases the end of the phase.
+     */
+    rng_state = seed;
+    int next_id = 0;
+    size_t phase = 0, reallocs = 0, phases = 0;
+    uint64_t peak = 0;
+    while (num_ops < (size_t)target_ops) {
+        if (live_count && live_bytes >= (uint64_t)target_live) {
+            if (life == LIFE_PHASE) {
+                end_phase(phase++, survivors);
+                phases++;
+            } else {
+                free_victim(life);
+            }
+            continue;
+        }
+        if (live_count && life != LIFE_PHASE &&
+                next_unit() < FREE_BELOW_TARGET * live_bytes / target_live) {
+            free_victim(life);
+            continue;
+        }
+        int size = draw_size(&dist);
+        if (live_count && (int)(next_random() % 100) < realloc_percent) {
+            live_block_t *block = live_at(next_random() % live_count);
+            live_bytes += size - block->size;
+            block->size = size;
+            add_op(REALLOC, block->id, size);
+            reallocs++;
+        } else {
+            add_op(ALLOC, next_id, size);
+            live_push((live_block_t){.id = next_id++, .size = size, .phase = phase});
+        }
+        if (live_bytes > peak) {
+            peak = live_bytes;
+        }
+    }
+
+    /* balance the trace */
+    while (live_count) {
+        free_victim(life == LIFE_PHASE ? LIFE_LIFO : life);
+    }
+
+    trace_t trace = {.num_ids = next_id, .num_ops = num_ops, .ops = ops};
+    write_trace(&trace, argv[optind], binary);
+    printf("%d ids, %zu ops (%zu reallocs), live set peaked at %lu bytes", next_id, num_ops, reallocs, peak);
+    if (life == LIFE_PHASE) {
+        printf(", %zu phases", phases);
+    }
+    printf("\n");
+
+    free(ops);
+    free(live);
+    free(dist.sizes);
+    free(dist.cumulative);
+    return 0;
+}
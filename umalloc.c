@@ -1,7 +1,16 @@
+#define _GNU_SOURCE
 #include "umalloc.h"
 #include "csbrk.h"
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <stdarg.h>
 #include "ansicolors.h"
 
 const char author[] = ANSI_BOLD ANSI_COLOR_RED "JAIMIE REN JLR6866" ANSI_RESET;
@@ -14,20 +23,356 @@ const char author[] = ANSI_BOLD ANSI_COLOR_RED "JAIMIE REN JLR6866" ANSI_RESET;
 // A sample pointer to the start of the free list.
 memory_block_t *free_head;
 
+// First byte past the most recent csbrk segment, to spot contiguous ones.
+static char *heap_end;
+
+/*
+ * Every csbrk segment, contiguous ones merged, so ureset can hand them all
+ * out again and the heap checker can walk them. csbrk never takes memory
+ * back, so a reset heap keeps them. The table is mapped, not malloced, and
+ * doubles when it fills.
+ */
+heap_segment_t *segments;
+int num_segments;
+static int max_segments;
+bool segments_lost; /* a segment the table had no room for */
+static bool tracking_segments; /* set by uinit */
+
+// Next block check_heap_sampled looks at, moved back when it is merged away.
+memory_block_t *check_cursor;
+
+/*
+ * absorb - notes that block was merged into the free block before it.
+ */
+static inline void absorb(memory_block_t *into, memory_block_t *block) {
+    if (check_cursor == block) {
+        check_cursor = into;
+    }
+}
+
+#ifdef USTATS
+atomic_size_t ustat_class_allocs[NUM_SIZE_CLASSES];
+static atomic_size_t ustat_extends;
+static atomic_size_t ustat_coalesces;
+static atomic_size_t ustat_coalesce_visits;
+#endif
+
+/*
+ * write_all - writes len bytes to fd, across short writes.
+ */
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while(len > 0) {
+        ssize_t written = write(fd, p, len);
+        if(written == -1 && errno == EINTR) {
+            continue;
+        }
+        if(written <= 0) {
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+#ifdef UTRACE
+/*
+ * Tracing (make trace). Traced calls are timed with the cycle counter and
+ * logged to their thread's ring, a single-producer single-consumer queue:
+ * only the thread moves head and only the drain thread moves tail, so
+ * neither ever waits, and a full ring drops events rather than stall the
+ * allocator. Every UTRACE_DRAIN_US the drain thread writes the rings out
+ * to utrace.<pid>.raw (or the prefix in UTRACE_PREFIX) for utraceprof.
+ */
+#include "utrace.h"
+#include <fcntl.h>
+#include <time.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+#define UTRACE_RING_SIZE 16384 /* events per thread, a power of two */
+#define UTRACE_DRAIN_US 1000
+#define UTRACE_MAX_DEPTH 16    /* nesting of traced calls that keeps its own visit count */
+
+typedef struct utrace_ring {
+    struct utrace_ring *next;  /* link on utrace_rings */
+    atomic_size_t head;        /* next slot the thread fills */
+    atomic_size_t tail;        /* next slot the drain thread writes */
+    atomic_size_t lost;
+    uint32_t thread;
+    utrace_event_t events[UTRACE_RING_SIZE];
+} utrace_ring_t;
+
+static _Atomic(utrace_ring_t *) utrace_rings;
+static atomic_uint utrace_threads;
+static atomic_bool utrace_running;
+static atomic_bool utrace_draining;
+static pthread_t utrace_thread;
+static pid_t utrace_pid;
+static int utrace_fd = -1;
+static uint64_t utrace_start_ticks;
+static struct timespec utrace_start_time;
+static size_t utrace_write_lost;
+static __thread utrace_ring_t *utrace_my_ring;
+static __thread unsigned utrace_depth;
+static __thread uint32_t utrace_visits[UTRACE_MAX_DEPTH];
+
+static inline uint64_t utrace_now() {
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/*
+ * utrace_ring - the calling thread's ring, mapped and registered on first
+ * use. It must not come from the heap being traced. NULL if out of memory.
+ */
+static utrace_ring_t *utrace_ring() {
+    if(!utrace_my_ring) {
+        utrace_ring_t *ring = mmap(NULL, sizeof(utrace_ring_t), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ring == MAP_FAILED) {
+            return NULL;
+        }
+        ring->thread = atomic_fetch_add_explicit(&utrace_threads, 1, memory_order_relaxed);
+        utrace_ring_t *head = atomic_load_explicit(&utrace_rings, memory_order_relaxed);
+        do {
+            ring->next = head;
+        } while(!atomic_compare_exchange_weak_explicit(&utrace_rings, &head, ring,
+                    memory_order_release, memory_order_relaxed));
+        utrace_my_ring = ring;
+    }
+    return utrace_my_ring;
+}
+
+/*
+ * utrace_enter - starts timing a traced call.
+ */
+static inline uint64_t utrace_enter() {
+    utrace_visits[++utrace_depth % UTRACE_MAX_DEPTH] = 0;
+    return utrace_now();
+}
+
+/*
+ * utrace_exit - logs a traced call that began at start.
+ */
+static void utrace_exit(int type, uint64_t start, size_t size, const void *addr) {
+    uint64_t ticks = utrace_now() - start;
+    unsigned depth = utrace_depth--;
+    utrace_ring_t *ring;
+    if(!atomic_load_explicit(&utrace_running, memory_order_relaxed) || !(ring = utrace_ring())) {
+        return;
+    }
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == UTRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->lost, 1, memory_order_relaxed);
+        return;
+    }
+    ring->events[head % UTRACE_RING_SIZE] = (utrace_event_t){
+        .start = start,
+        .ticks = ticks > UINT32_MAX ? UINT32_MAX : ticks,
+        .visited = utrace_visits[depth % UTRACE_MAX_DEPTH],
+        .size = size,
+        .addr = (uintptr_t)addr,
+        .thread = ring->thread,
+        .type = type,
+        .depth = depth - 1,
+    };
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * utrace_drain - writes out every event logged so far, oldest first per ring.
+ */
+static void utrace_drain() {
+    for(utrace_ring_t *ring = atomic_load_explicit(&utrace_rings, memory_order_acquire); ring; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while(tail != head) {
+            size_t from = tail % UTRACE_RING_SIZE;
+            size_t count = head - tail < UTRACE_RING_SIZE - from ? head - tail : UTRACE_RING_SIZE - from;
+            if(write_all(utrace_fd, &ring->events[from], count * sizeof(utrace_event_t)) == -1) {
+                utrace_write_lost += count;
+            }
+            tail += count;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+}
+
+static void *utrace_drain_loop(void *arg) {
+    while(atomic_load(&utrace_running)) {
+        usleep(UTRACE_DRAIN_US);
+        utrace_drain();
+    }
+    return NULL;
+}
+
+/*
+ * utrace_stop - stops the drain thread, writes out what is left and fills
+ * in the header with the tick rate measured over the whole run.
+ */
+static void utrace_stop() {
+    if(utrace_fd == -1 || getpid() != utrace_pid) {
+        return;
+    }
+    atomic_store(&utrace_running, false);
+    if(atomic_load(&utrace_draining)) {
+        pthread_join(utrace_thread, NULL);
+    }
+    utrace_drain();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ns = (now.tv_sec - utrace_start_time.tv_sec) * 1e9 + (now.tv_nsec - utrace_start_time.tv_nsec);
+    utrace_header_t header = {.magic = UTRACE_MAGIC, .ticks_per_ns = (utrace_now() - utrace_start_ticks) / ns};
+    if(pwrite(utrace_fd, &header, sizeof(header), 0) != sizeof(header)) {
+        fprintf(stderr, "utrace: could not write the log header\n");
+    }
+    size_t lost = utrace_write_lost;
+    for(utrace_ring_t *ring = atomic_load(&utrace_rings); ring; ring = ring->next) {
+        lost += atomic_load(&ring->lost);
+    }
+    if(lost) {
+        fprintf(stderr, "utrace: %zu events lost\n", lost);
+    }
+    close(utrace_fd);
+    utrace_fd = -1;
+}
+
+/*
+ * utrace_start - opens the log. Called from uinit, which may run inside the
+ * first malloc of a program, so the drain thread is only started later by
+ * utrace_start_drain. A forked child starts a log of its own.
+ */
+static void utrace_start() {
+    char path[4096];
+    const char *prefix = getenv("UTRACE_PREFIX");
+    if(utrace_fd != -1 && getpid() == utrace_pid) {
+        return;
+    }
+    if(utrace_fd != -1) {
+        close(utrace_fd);
+        atomic_store(&utrace_draining, false);
+        for(utrace_ring_t *ring = atomic_load(&utrace_rings); ring; ring = ring->next) {
+            atomic_store(&ring->tail, atomic_load(&ring->head));
+        }
+    } else {
+        atexit(utrace_stop);
+    }
+    utrace_pid = getpid();
+    snprintf(path, sizeof(path), "%s.%d.raw", prefix ? prefix : "utrace", (int)utrace_pid);
+    utrace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    utrace_header_t header = {.magic = UTRACE_MAGIC};
+    if(utrace_fd == -1 || write_all(utrace_fd, &header, sizeof(header)) == -1) {
+        fprintf(stderr, "utrace: could not open %s, not tracing\n", path);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &utrace_start_time);
+    utrace_start_ticks = utrace_now();
+    atomic_store(&utrace_running, true);
+}
+
+/*
+ * utrace_start_drain - starts the drain thread on the first call made
+ * without the heap lock held after tracing started, since creating a
+ * thread may allocate.
+ */
+static inline void utrace_start_drain() {
+    if(atomic_load_explicit(&utrace_running, memory_order_relaxed) &&
+            !atomic_load_explicit(&utrace_draining, memory_order_relaxed) &&
+            !atomic_exchange(&utrace_draining, true) &&
+            pthread_create(&utrace_thread, NULL, utrace_drain_loop, NULL) != 0) {
+        atomic_store(&utrace_draining, false);
+    }
+}
+
+/* UTRACE_CALL times call, which returns a block; UTRACE_RUN one that does not. */
+#define UTRACE_CALL(type, size, call) ({ \
+    uint64_t utrace_started = utrace_enter(); \
+    __typeof__(call) utrace_ret = (call); \
+    utrace_exit(type, utrace_started, size, utrace_ret); \
+    utrace_ret; })
+#define UTRACE_RUN(type, size, addr, call) do { \
+    uint64_t utrace_started = utrace_enter(); \
+    call; \
+    utrace_exit(type, utrace_started, size, addr); \
+} while(0)
+#define UTRACE_VISIT() (utrace_visits[utrace_depth % UTRACE_MAX_DEPTH]++)
+#define UTRACE_START_DRAIN() utrace_start_drain()
+#else
+#define UTRACE_CALL(type, size, call) (call)
+#define UTRACE_RUN(type, size, addr, call) call
+#define UTRACE_VISIT() ((void)0)
+#define UTRACE_START_DRAIN() ((void)0)
+#endif
+
+/*
+ * add_segment - records a segment. Tracking starts at uinit; heaps built by
+ * hand, as the unit tests do, stay untracked when they are extended. Sets
+ * segments_lost if the table cannot grow to hold a new segment.
+ */
+static void add_segment(char *start, char *end) {
+    if (!tracking_segments) {
+        return;
+    }
+    if (num_segments && segments[num_segments - 1].end == start) {
+        segments[num_segments - 1].end = end;
+        return;
+    }
+    if (num_segments == max_segments) {
+        int max = max_segments ? 2 * max_segments : PAGESIZE / sizeof(heap_segment_t);
+        void *grown = max_segments
+            ? mremap(segments, max_segments * sizeof(heap_segment_t), max * sizeof(heap_segment_t), MREMAP_MAYMOVE)
+            : mmap(NULL, max * sizeof(heap_segment_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (grown == MAP_FAILED) {
+            segments_lost = true;
+            return;
+        }
+        segments = grown;
+        max_segments = max;
+    }
+    segments[num_segments++] = (heap_segment_t){start, end};
+}
+
+#define ALLOC_BIT 0x1
+#define TRIMMED_BIT 0x2 /* free block whose interior pages went back to the OS */
+
+#ifndef UMALLOC_COMPACT
+#define SIZE_WORD(block) ((block)->block_size_alloc)
+#define SIZE_TO_WORD(size) (size)
+#define LINK(block) (block)
+#define UNLINK(link) (link)
+#else
+// Offsets are taken from the first csbrk segment; every later one is above it.
+static char *heap_base;
+
+#define SIZE_WORD(block) ((block)->block_size_alloc)
+#define SIZE_TO_WORD(size) ((uint32_t)((size) + HEADER_SIZE))
+#define LINK(block) ((block) ? (uint32_t)((char *)(block) - heap_base) : 0)
+#define UNLINK(link) ((link) ? (memory_block_t *)(heap_base + (link)) : NULL)
+#endif
+
 /*
  * is_allocated - returns true if a block is marked as allocated.
  */
 bool is_allocated(memory_block_t *block) {
     assert(block != NULL);
-    return block->block_size_alloc & 0x1;
+    return SIZE_WORD(block) & ALLOC_BIT;
 }
 
 /*
- * allocate - marks a block as allocated.
+ * allocate - marks a block as allocated. Its pages are about to be touched,
+ * so a block that was trimmed while free is no longer trimmed.
  */
 void allocate(memory_block_t *block) {
     assert(block != NULL);
-    block->block_size_alloc |= 0x1;
+    SIZE_WORD(block) = (SIZE_WORD(block) & ~TRIMMED_BIT) | ALLOC_BIT;
 }
 
 
@@ -36,7 +381,7 @@ void allocate(memory_block_t *block) {
  */
 void deallocate(memory_block_t *block) {
     assert(block != NULL);
-    block->block_size_alloc &= ~0x1;
+    SIZE_WORD(block) &= ~ALLOC_BIT;
 }
 
 /*
@@ -44,7 +389,15 @@ void deallocate(memory_block_t *block) {
  */
 size_t get_size(memory_block_t *block) {
     assert(block != NULL);
-    return block->block_size_alloc & ~(ALIGNMENT-1);
+    return PAYLOAD_SIZE(block);
+}
+
+/*
+ * set_size - sets the (payload) size of the block, keeping its flags except
+ * TRIMMED_BIT, since the new size covers pages that were never trimmed.
+ */
+static void set_size(memory_block_t *block, size_t size) {
+    SIZE_WORD(block) = SIZE_TO_WORD(size) | (SIZE_WORD(block) & (ALIGNMENT-1) & ~TRIMMED_BIT);
 }
 
 /*
@@ -52,7 +405,23 @@ size_t get_size(memory_block_t *block) {
  */
 memory_block_t *get_next(memory_block_t *block) {
     assert(block != NULL);
-    return block->next;
+    return UNLINK(block->next);
+}
+
+/*
+ * set_next - sets the next block.
+ */
+void set_next(memory_block_t *block, memory_block_t *next) {
+    assert(block != NULL);
+    block->next = LINK(next);
+}
+
+/*
+ * get_end - gets the address right after the block, where its physical
+ * neighbor starts.
+ */
+static memory_block_t *get_end(memory_block_t *block) {
+    return (memory_block_t *)((char *)block + HEADER_SIZE + get_size(block));
 }
 
 /*
@@ -62,10 +431,10 @@ memory_block_t *get_next(memory_block_t *block) {
  */
 void put_block(memory_block_t *block, size_t size, bool alloc) {
     assert(block != NULL);
-    assert(size % ALIGNMENT == 0);
+    assert(BLOCK_SIZE(size) == size);
     assert(alloc >> 1 == 0);
-    block->block_size_alloc = size | alloc;
-    block->next = NULL;
+    SIZE_WORD(block) = SIZE_TO_WORD(size) | alloc;
+    block->next = LINK(NULL);
 }
 
 /*
@@ -84,38 +453,427 @@ memory_block_t *get_block(void *payload) {
     return ((memory_block_t *)payload) - 1;
 }
 
+/*
+ * Fast path tables, generated by the compiler from USIZE_CLASSES: entry i of
+ * ufast_alloc_class counts the classes smaller than i * ALIGNMENT bytes, and
+ * entry i of ufast_free_class counts the classes whose blocks fit in a
+ * payload of BLOCK_SIZE(i * ALIGNMENT) bytes, less one, or is UFAST_NO_CLASS
+ * when none does.
+ */
+#define CLASS_BELOW(c, size) + ((c) < (size))
+#define CLASS_FITS(c, size) + (BLOCK_SIZE(c) <= (size))
+#define CLASS_SIZE(c, arg) c,
+#define ALLOC_CLASS(i) (0 USIZE_CLASSES(CLASS_BELOW, (i) * ALIGNMENT)),
+#define CLASSES_FITTING(i) (0 USIZE_CLASSES(CLASS_FITS, BLOCK_SIZE((i) * ALIGNMENT)))
+#define FREE_CLASS(i) (CLASSES_FITTING(i) ? CLASSES_FITTING(i) - 1 : UFAST_NO_CLASS),
+#define REP4(M, i) M(i) M(i + 1) M(i + 2) M(i + 3)
+#define REP16(M, i) REP4(M, i) REP4(M, i + 4) REP4(M, i + 8) REP4(M, i + 12)
+#define REP64(M, i) REP16(M, i) REP16(M, i + 16) REP16(M, i + 32) REP16(M, i + 48)
+
+const unsigned char ufast_alloc_class[UFAST_TABLE_SIZE] = {
+    REP64(ALLOC_CLASS, 0) ALLOC_CLASS(64)
+};
+const unsigned char ufast_free_class[UFAST_TABLE_SIZE] = {
+    REP64(FREE_CLASS, 0) FREE_CLASS(64)
+};
+const size_t ufast_class_size[NUM_SIZE_CLASSES] = {
+    USIZE_CLASSES(CLASS_SIZE, 0)
+};
+
+// Per-thread caches of freed blocks, linked through their payloads.
+__thread void *ufast_cache[NUM_SIZE_CLASSES];
+__thread unsigned ufast_count[NUM_SIZE_CLASSES];
+unsigned ufast_limit = UFAST_CACHE_LIMIT;
+
+/*
+ * Per-CPU class caches, used instead of the per-thread ones in
+ * SHARD_PER_CPU mode. A thread that finds its CPU's shard locked has most
+ * likely been migrated or preempted while another thread of that CPU
+ * held it, so rather than spin it falls back to the free list. A thread
+ * that finds it was migrated between sched_getcpu and taking the lock
+ * lets the shard go and tries its new CPU's, once; the lock keeps the
+ * operation correct either way, the retry keeps it local.
+ */
+typedef struct {
+    atomic_flag lock;
+    unsigned count[NUM_SIZE_CLASSES];
+    void *cache[NUM_SIZE_CLASSES];
+    size_t hits;
+    size_t misses;
+} __attribute__((aligned(64))) cpu_shard_t;
+
+static shard_mode_t shard_mode = SHARD_PER_THREAD;
+static cpu_shard_t cpu_shards[MAX_CPU_SHARDS];
+static atomic_size_t shard_contended;
+static atomic_size_t shard_migrations;
+
+/*
+ * lock_shard - locks the shard of the calling thread's CPU, making sure the
+ * thread is still on that CPU once it holds the lock. Returns NULL if the
+ * CPU is unknown, its shard is busy or the thread migrated twice running.
+ */
+static cpu_shard_t *lock_shard() {
+    for (int tries = 0; tries < 2; tries++) {
+        int cpu = sched_getcpu();
+        if (cpu < 0) {
+            return NULL;
+        }
+        cpu_shard_t *shard = &cpu_shards[cpu % MAX_CPU_SHARDS];
+        if (atomic_flag_test_and_set_explicit(&shard->lock, memory_order_acquire)) {
+            atomic_fetch_add_explicit(&shard_contended, 1, memory_order_relaxed);
+            return NULL;
+        }
+        if (sched_getcpu() == cpu) {
+            return shard;
+        }
+        atomic_flag_clear_explicit(&shard->lock, memory_order_release);
+        atomic_fetch_add_explicit(&shard_migrations, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/*
+ * unlock_shard - unlocks a shard.
+ */
+static void unlock_shard(cpu_shard_t *shard) {
+    atomic_flag_clear_explicit(&shard->lock, memory_order_release);
+}
+
+/*
+ * shard_pop - takes a block of class cls from the current CPU's cache.
+ */
+static void *shard_pop(unsigned cls) {
+    cpu_shard_t *shard = lock_shard();
+    if (!shard) {
+        return NULL;
+    }
+    void *payload = shard->cache[cls];
+    if (payload) {
+        shard->cache[cls] = *(void **)payload;
+        shard->count[cls]--;
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    unlock_shard(shard);
+    return payload;
+}
+
+/*
+ * shard_push - puts a block of class cls in the current CPU's cache.
+ * Returns false if the cache is full or the shard could not be taken.
+ */
+static bool shard_push(void *payload, unsigned cls) {
+    cpu_shard_t *shard = lock_shard();
+    if (!shard) {
+        return false;
+    }
+    bool pushed = shard->count[cls] < SHARD_CACHE_LIMIT;
+    if (pushed) {
+        *(void **)payload = shard->cache[cls];
+        shard->cache[cls] = payload;
+        shard->count[cls]++;
+    }
+    unlock_shard(shard);
+    return pushed;
+}
+
+/*
+ * set_shard_mode - selects per-thread or per-CPU class caches.
+ */
+void set_shard_mode(shard_mode_t mode) {
+    shard_mode = mode;
+    ufast_limit = mode == SHARD_PER_CPU ? 0 : UFAST_CACHE_LIMIT;
+}
+
+/*
+ * print_shard_report - prints the per-CPU cache hit rates and how often
+ * the fallbacks were taken.
+ */
+void print_shard_report(FILE *out) {
+    fprintf(out, "Shard mode: %s\n", shard_mode == SHARD_PER_CPU ? "per-cpu" : "per-thread");
+    for (int cpu = 0; cpu < MAX_CPU_SHARDS; cpu++) {
+        cpu_shard_t *shard = &cpu_shards[cpu];
+        if (shard->hits + shard->misses) {
+            fprintf(out, "  cpu %3d: %zu hits, %zu misses\n", cpu, shard->hits, shard->misses);
+        }
+    }
+    fprintf(out, "  busy shards: %zu, migrations: %zu\n",
+        atomic_load(&shard_contended), atomic_load(&shard_migrations));
+}
+
 /*
  * The following are helper functions that can be implemented to assist in your
  * design, but they are not required. 
  */
 
 /*
- * find - finds a free block that can satisfy the umalloc request.
+ * Placement telemetry. Under set_placement_policy(ADAPTIVE), every
+ * POLICY_EPOCH searches in a size range the range's policy is re-evaluated;
+ * otherwise the set policy, best fit by default, is kept, since on the bundled
+ * traces switching costs some utilization. While a range runs best fit, find()
+ * walks the whole free list anyway, so it also notes which block first fit and
+ * good fit would have picked; if those picks would have wasted little and the
+ * searches are long, the range moves to the cheaper policy. A cheaper policy
+ * is abandoned again when the external fragmentation (1 - largest free block /
+ * free bytes) rises above what it was at the switch, or when searches start
+ * failing although enough free bytes exist in total. Entering and leaving use
+ * different signals, and every return to best fit doubles the number of epochs
+ * before the next attempt, so a range does not flip every epoch.
+ */
+#define POLICY_EPOCH 256
+#define SEARCH_HIGH 16     /* average nodes visited worth cutting down */
+#define WASTE_LOW 0.02     /* extra bytes per requested byte a policy may add */
+#define FRAG_RISE 0.10     /* fragmentation growth that ends a cheap policy */
+#define EXTEND_HIGH 0.01   /* searches failing despite enough free bytes */
+#define MAX_BACKOFF 64
+#define MAX_DECISIONS 64
+
+typedef struct {
+    policy_t policy;
+    bool adaptive;                  /* re-evaluated from the telemetry */
+    size_t searches;                /* searches in the current epoch */
+    size_t visited;                 /* free blocks visited this epoch */
+    size_t frag_extends;            /* failed searches with enough free bytes */
+    size_t requested;               /* bytes requested this epoch */
+    size_t first_waste;             /* extra bytes first fit would have used */
+    size_t good_waste;              /* extra bytes good fit would have used */
+    double switch_frag;             /* fragmentation when leaving best fit */
+    size_t backoff;                 /* epochs to wait before leaving best fit */
+    size_t backoff_len;
+    size_t epochs[NUM_POLICIES];    /* epochs spent under each policy */
+    size_t total_searches;
+    size_t total_visited;
+} placement_range_t;
+
+typedef struct {
+    size_t search;                  /* search number the switch happened at */
+    int range;
+    policy_t from;
+    policy_t to;
+    double frag;
+    double avg_visited;
+    double waste;                   /* estimated waste of the new policy */
+} placement_decision_t;
+
+static const char *policy_names[NUM_POLICIES] = {
+    "best-fit",
+    "good-fit",
+    "first-fit"
+};
+
+static const char *range_names[NUM_PLACEMENT_RANGES] = {
+    "<= 256",
+    "<= 4096",
+    "> 4096"
+};
+
+static placement_range_t placement[NUM_PLACEMENT_RANGES];
+static placement_decision_t decisions[MAX_DECISIONS];
+static size_t num_decisions;
+static size_t total_searches;
+
+/*
+ * placement_range - maps a (rounded) request size to its placement range.
+ */
+static int placement_range(size_t size) {
+    if (size <= 256) {
+        return 0;
+    }
+    return size <= 4096 ? 1 : 2;
+}
+
+/*
+ * sample_fragmentation - walks the free list and returns the external
+ * fragmentation, 0 when all free bytes sit in a single block.
+ */
+static double sample_fragmentation() {
+    size_t free_bytes = 0;
+    size_t largest = 0;
+    for (memory_block_t *cur = free_head; cur; cur = get_next(cur)) {
+        size_t cur_size = get_size(cur);
+        free_bytes += cur_size;
+        if (cur_size > largest) {
+            largest = cur_size;
+        }
+    }
+    return free_bytes ? 1.0 - (double)largest / free_bytes : 0.0;
+}
+
+/*
+ * record_decision - remembers a policy switch for print_placement_report.
+ */
+static void record_decision(int range, policy_t to, double frag, double waste) {
+    placement_range_t *r = &placement[range];
+    if (num_decisions < MAX_DECISIONS) {
+        placement_decision_t *d = &decisions[num_decisions++];
+        d->search = total_searches;
+        d->range = range;
+        d->from = r->policy;
+        d->to = to;
+        d->frag = frag;
+        d->avg_visited = (double)r->visited / r->searches;
+        d->waste = waste;
+    }
+}
+
+/*
+ * update_policy - closes the current epoch of a range and switches its
+ * policy if the telemetry asks for it.
+ */
+static void update_policy(int range) {
+    placement_range_t *r = &placement[range];
+    policy_t next = r->policy;
+
+    if (!r->adaptive) {
+        // keep the set policy, only account for the epoch
+    } else if (r->policy == BEST_FIT) {
+        double first_waste = (double)r->first_waste / r->requested;
+        double good_waste = (double)r->good_waste / r->requested;
+        if (r->backoff > 0) {
+            r->backoff--;
+        } else if (r->visited > SEARCH_HIGH * r->searches) {
+            if (first_waste < WASTE_LOW) {
+                next = FIRST_FIT;
+            } else if (good_waste < WASTE_LOW) {
+                next = GOOD_FIT;
+            }
+            if (next != BEST_FIT) {
+                r->switch_frag = sample_fragmentation();
+                record_decision(range, next, r->switch_frag,
+                    next == FIRST_FIT ? first_waste : good_waste);
+            }
+        }
+    } else {
+        double frag = sample_fragmentation();
+        if (r->frag_extends > EXTEND_HIGH * r->searches ||
+            frag > r->switch_frag + FRAG_RISE) {
+            next = BEST_FIT;
+            record_decision(range, next, frag, 0.0);
+            r->backoff_len = r->backoff_len ? 2 * r->backoff_len : 1;
+            if (r->backoff_len > MAX_BACKOFF) {
+                r->backoff_len = MAX_BACKOFF;
+            }
+            r->backoff = r->backoff_len;
+        }
+    }
+
+    r->epochs[r->policy]++;
+    r->policy = next;
+    r->searches = 0;
+    r->visited = 0;
+    r->frag_extends = 0;
+    r->requested = 0;
+    r->first_waste = 0;
+    r->good_waste = 0;
+}
+
+/*
+ * set_placement_policy - makes every range use policy, or hands the
+ * choice to the telemetry when policy is ADAPTIVE.
+ */
+void set_placement_policy(policy_t policy) {
+    for (int i = 0; i < NUM_PLACEMENT_RANGES; i++) {
+        placement[i].adaptive = policy == ADAPTIVE;
+        placement[i].policy = policy == ADAPTIVE ? BEST_FIT : policy;
+    }
+}
+
+/*
+ * parse_placement_policy - maps a policy name ("best", "good", "first" or
+ * "adaptive") to its policy. Returns NUM_POLICIES for unknown names.
+ */
+policy_t parse_placement_policy(char *name) {
+    if (strcmp(name, "adaptive") == 0) {
+        return ADAPTIVE;
+    }
+    for (int p = 0; p < NUM_POLICIES; p++) {
+        if (name[0] && strncmp(name, policy_names[p], strlen(name)) == 0) {
+            return p;
+        }
+    }
+    return NUM_POLICIES;
+}
+
+/*
+ * print_placement_report - prints the policy each range ended on, how its
+ * epochs were spent, and the switches that were made.
+ */
+void print_placement_report(FILE *out) {
+    fprintf(out, "Placement policy report (%zu searches):\n", total_searches);
+    for (int i = 0; i < NUM_PLACEMENT_RANGES; i++) {
+        placement_range_t *r = &placement[i];
+        fprintf(out, "  range %-8s %-10s%s avg visited %.1f, epochs:",
+            range_names[i], policy_names[r->policy], r->adaptive ? " (adaptive)" : "",
+            r->total_searches ? (double)r->total_visited / r->total_searches : 0.0);
+        for (int p = 0; p < NUM_POLICIES; p++) {
+            fprintf(out, " %s %zu", policy_names[p], r->epochs[p]);
+        }
+        fprintf(out, "\n");
+    }
+    for (size_t i = 0; i < num_decisions; i++) {
+        placement_decision_t *d = &decisions[i];
+        fprintf(out, "  search %zu: range %s %s -> %s (frag %.2f, visited %.1f, waste %.3f)\n",
+            d->search, range_names[d->range], policy_names[d->from], policy_names[d->to],
+            d->frag, d->avg_visited, d->waste);
+    }
+}
+
+/*
+ * find - finds a free block that can satisfy the umalloc request, using the
+ * placement policy currently selected for the request's size range.
  */
 memory_block_t *find(size_t size) {
     //* STUDENT TODO
     if(!free_head) {
         return NULL;
     }
-    int blockSize = get_size(free_head);
+    int range = placement_range(size);
+    placement_range_t *r = &placement[range];
+    size_t slack = r->policy == GOOD_FIT ? size / 8 : 0;
+    size_t blockSize = 0;
+    size_t firstSize = 0; // what first fit and good fit would have picked
+    size_t goodSize = 0;
+    size_t freeBytes = 0;
+    size_t visited = 0;
     memory_block_t *cur = free_head;
     memory_block_t *res = NULL;
-    bool minimize = false;
     while(cur) {
-        int curSize = get_size(cur);
+        size_t curSize = get_size(cur);
+        visited++;
+        UTRACE_VISIT();
+        freeBytes += curSize;
         if(curSize >= size) { // fits
-            if(!minimize) {
+            if(!res || curSize < blockSize) {
                 res = cur;
                 blockSize = curSize;
-                minimize = true;
-            } else {
-                if(curSize < blockSize) {
-                    res = cur;
-                    blockSize = curSize;
-                }
+            }
+            if(!firstSize) {
+                firstSize = curSize;
+            }
+            if(!goodSize && curSize - size <= size / 8) {
+                goodSize = curSize;
+            }
+            if(r->policy == FIRST_FIT || curSize - size <= slack) {
+                break;
             }
         }
-        cur = cur->next;
+        cur = get_next(cur);
+    }
+    total_searches++;
+    r->searches++;
+    r->visited += visited;
+    r->total_searches++;
+    r->total_visited += visited;
+    if(res) {
+        r->requested += size;
+        r->first_waste += firstSize - blockSize;
+        r->good_waste += (goodSize ? goodSize : blockSize) - blockSize;
+    } else if(freeBytes >= size) {
+        r->frag_extends++;
+    }
+    if(r->searches == POLICY_EPOCH) {
+        update_policy(range);
     }
     return res;
 }
@@ -125,23 +883,37 @@ memory_block_t *find(size_t size) {
  */
 memory_block_t *extend(size_t size) {
     //* STUDENT TODO
-    int extendSize = size + (2 * PAGESIZE);
-    memory_block_t *res = csbrk(extendSize);
-    res->block_size_alloc = extendSize - ALIGNMENT;
+    size_t extendSize = ALIGN(size + SEGMENT_PAD) + (2 * PAGESIZE);
+    char *segment = csbrk(extendSize);
+    if(!segment) {
+        return NULL;
+    }
+    USTAT_ADD(ustat_extends, 1);
+    memory_block_t *res;
+    if(segment == heap_end) { // contiguous with the last segment, reuse its pad
+        res = (memory_block_t *)(segment - SEGMENT_PAD);
+        put_block(res, extendSize - HEADER_SIZE, false);
+    } else {
+        res = (memory_block_t *)(segment + SEGMENT_PAD);
+        put_block(res, extendSize - 2 * SEGMENT_PAD - HEADER_SIZE, false);
+    }
+    heap_end = segment + extendSize;
+    add_segment(segment, heap_end);
     if(free_head == NULL) {
         free_head = res;
     } else if(res < free_head) {
-        res->next = free_head;
+        set_next(res, free_head);
         free_head = res;
-        return coalesce(res); // coalesce
+        return UTRACE_CALL(UTRACE_COALESCE, get_size(res), coalesce(res)); // coalesce
     } else {
         memory_block_t *cur = free_head;
-        while(cur->next) {
-            cur = cur->next;
+        while(get_next(cur)) {
+            UTRACE_VISIT();
+            cur = get_next(cur);
         }
-        cur->next = res;
+        set_next(cur, res);
     }
-    return coalesce(res); // coalesce
+    return UTRACE_CALL(UTRACE_COALESCE, get_size(res), coalesce(res)); // coalesce
 }
 
 /*
@@ -149,26 +921,26 @@ memory_block_t *extend(size_t size) {
  */
 memory_block_t *split(memory_block_t *block, size_t size) { // get a size sized block from block
     //* STUDENT TODO
-    int fullBlockSize = block->block_size_alloc;
+    size_t fullBlockSize = get_size(block);
+    memory_block_t *next = get_next(block);
     // block becomes allocated block to return
-    block->block_size_alloc = size;
-    allocate(block);
+    put_block(block, size, true);
     // free points to split off part
-    memory_block_t *free = (memory_block_t *)((char *)block + size + ALIGNMENT);
-    free->block_size_alloc = fullBlockSize - size - ALIGNMENT;
-    free->next = block->next;
-    deallocate(free);
+    memory_block_t *free = get_end(block);
+    put_block(free, fullBlockSize - size - HEADER_SIZE, false);
+    set_next(free, next);
     // fix free list
     if(block == free_head) { // first block was split
         free_head = free;
     } else {
         memory_block_t *prev = free_head;
-        while(prev->next) {
-            if(prev->next == block) {
-                prev->next = free;
+        while(get_next(prev)) {
+            UTRACE_VISIT();
+            if(get_next(prev) == block) {
+                set_next(prev, free);
                 return get_payload(block);
             }
-            prev = prev->next;
+            prev = get_next(prev);
         }
     }
     return get_payload(block);
@@ -182,31 +954,34 @@ memory_block_t *coalesce(memory_block_t *block) {
     //* STUDENT TODO
     memory_block_t *prev = free_head;
     memory_block_t *res = block;
-    memory_block_t *blockEnd = (memory_block_t *)((char *)block + block->block_size_alloc + ALIGNMENT);
+    memory_block_t *blockEnd = get_end(block);
+    memory_block_t *next = get_next(block);
+    USTAT_ADD(ustat_coalesces, 1);
     if(block == prev) { // coalescing at beginning
-        if(block->next) {
-            if(blockEnd == block->next) { // first and second are adjacent 
-            // IDEA: block->next - block == block size + alignment?
-                block->block_size_alloc += block->next->block_size_alloc + ALIGNMENT;
-                block->next = block->next->next;
-            }
+        if(next && blockEnd == next) { // first and second are adjacent 
+            absorb(block, next);
+            set_size(block, get_size(block) + get_size(next) + HEADER_SIZE);
+            set_next(block, get_next(next));
         }
     } else {
-        while(prev->next) {
-            if(prev->next == block) { // found the free block
-                if(block->next && blockEnd == block->next) { 
-                    block->block_size_alloc += block->next->block_size_alloc + ALIGNMENT;
-                    block->next = block->next->next;
+        while(get_next(prev)) {
+            USTAT_ADD(ustat_coalesce_visits, 1);
+            UTRACE_VISIT();
+            if(get_next(prev) == block) { // found the free block
+                if(next && blockEnd == next) { 
+                    absorb(block, next);
+                    set_size(block, get_size(block) + get_size(next) + HEADER_SIZE);
+                    set_next(block, get_next(next));
                 }
-                memory_block_t *prevEnd = (memory_block_t *)((uintptr_t)prev + prev->block_size_alloc + ALIGNMENT);
-                if(prevEnd == block) { 
-                    prev->block_size_alloc += block->block_size_alloc + ALIGNMENT;
-                    prev->next = block->next;
+                if(get_end(prev) == block) { 
+                    absorb(prev, block);
+                    set_size(prev, get_size(prev) + get_size(block) + HEADER_SIZE);
+                    set_next(prev, get_next(block));
                     res = prev;
                 }
                 return res;
             }
-            prev = prev->next;
+            prev = get_next(prev);
         }
     }
     return res;
@@ -215,92 +990,1351 @@ memory_block_t *coalesce(memory_block_t *block) {
 
 
 /*
- * uinit - Used initialize metadata required to manage the heap
- * along with allocating initial memory.
+ * Background maintenance. While the maintenance thread runs, ufree_slow only
+ * pushes blocks onto deferred_frees, a lock-free stack linked through the
+ * payloads. The thread periodically takes the whole stack, sorts it by
+ * address and merges it into the free list in one pass, hands the pages
+ * inside large free blocks back to the OS, and every REBALANCE_TICKS passes
+ * bumps rebalance_epoch, which makes each thread push half of its class
+ * caches onto the stack on its next slow path call. Consumers take the
+ * stack with a single exchange, so there is no ABA problem, and
+ * umalloc_slow drains it as well before it extends the heap.
  */
-int uinit() {
-    //* STUDENT TODO
-    // use csbrk, any mulitple of pagesize
-    int size = 5 * PAGESIZE;
-    void *ptr = csbrk(size);
-    if(!ptr) {
-        return -1;
-    }
-    free_head = ptr;
-    free_head->block_size_alloc = size - ALIGNMENT;
-    return 0;
+#define TRIM_THRESHOLD (16 * PAGESIZE)
+#define REBALANCE_TICKS 16
+
+static pthread_mutex_t heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(void *) deferred_frees;
+static atomic_bool maintenance_running;
+static atomic_uint rebalance_epoch;
+static __thread unsigned seen_rebalance_epoch;
+static pthread_t maintenance_thread;
+static unsigned maintenance_interval_us;
+static size_t trimmed_bytes;
+
+/*
+ * lock_heap - takes the lock that guards the free list and csbrk.
+ */
+void lock_heap() {
+    UTRACE_RUN(UTRACE_LOCK, 0, NULL, pthread_mutex_lock(&heap_mutex));
 }
 
 /*
- * umalloc -  allocates size bytes and returns a pointer to the allocated memory.
+ * unlock_heap - releases the heap lock.
  */
-void *umalloc(size_t size) {
-    //* STUDENT TODO
-    // call find to get free block
-    // check_heap();
-    while(size % ALIGNMENT != 0) {
-        size++;
-    }
-    memory_block_t *bptr = find(size);
-    if(!bptr) { // didn't find a block big enough
-        bptr = extend(size);
-        ufree(get_payload(bptr));
-    }
-    if(bptr->block_size_alloc > size) {
-        if((bptr->block_size_alloc - size) >= (ALIGNMENT * 3)) { // split
-            return split(bptr, size);
-        }
-    }
-    // allocating entire block so fix the free list
-    memory_block_t *prev = free_head;
-    if(prev == bptr) { // allocated free_head
-        free_head = free_head->next;
-    } else {
-        bool done = false;
-        while(!done) {
-            if(prev->next) {
-                if(prev->next == bptr) { // found bptr
-                    prev->next = prev->next->next; // bridging free list
-                    done = true;
-                }
-                prev = prev->next;
-            }
-            
-        }
-    }
-    // after free list is fixed, allocate the block
-    allocate(bptr);
-    return get_payload(bptr);
+void unlock_heap() {
+    pthread_mutex_unlock(&heap_mutex);
 }
 
 /*
- * ufree -  frees the memory space pointed to by ptr, which must have been called
- * by a previous call to malloc.
+ * push_deferred - pushes an allocated block's payload onto deferred_frees.
  */
-void ufree(void *ptr) {
-    //* STUDENT TODO
-    memory_block_t *bptr = get_block(ptr);
+static void push_deferred(void *payload) {
+    void *head = atomic_load_explicit(&deferred_frees, memory_order_relaxed);
+    do {
+        *(void **)payload = head;
+    } while (!atomic_compare_exchange_weak_explicit(&deferred_frees, &head, payload,
+        memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * sort_deferred - merge sorts a payload-linked list by address.
+ */
+static void *sort_deferred(void *list) {
+    if (!list || !*(void **)list) {
+        return list;
+    }
+    // split with a slow and a fast cursor
+    void *slow = list;
+    void *fast = *(void **)list;
+    while (fast && *(void **)fast) {
+        slow = *(void **)slow;
+        fast = *(void **)*(void **)fast;
+    }
+    void *right = sort_deferred(*(void **)slow);
+    *(void **)slow = NULL;
+    void *left = sort_deferred(list);
+
+    void *head = NULL;
+    void **tail = &head;
+    while (left && right) {
+        void **smaller = left < right ? &left : &right;
+        *tail = *smaller;
+        tail = (void **)*smaller;
+        *smaller = *(void **)*smaller;
+    }
+    *tail = left ? left : right;
+    return head;
+}
+
+/*
+ * merge_deferred - inserts an address-sorted list of blocks into the free
+ * list in a single pass, coalescing as it goes. The heap lock must be held.
+ */
+static void merge_deferred(void *list) {
+    memory_block_t *prev = NULL;
+    memory_block_t *cur = free_head;
+    while (list) {
+        memory_block_t *block = get_block(list);
+        list = *(void **)list;
+        deallocate(block);
+        while (cur && cur < block) {
+            prev = cur;
+            cur = get_next(cur);
+        }
+        if (prev && get_end(prev) == block) {
+            absorb(prev, block);
+            set_size(prev, get_size(prev) + get_size(block) + HEADER_SIZE);
+            block = prev;
+        } else {
+            set_next(block, cur);
+            if (prev) {
+                set_next(prev, block);
+            } else {
+                free_head = block;
+            }
+        }
+        if (cur && get_end(block) == cur) {
+            absorb(block, cur);
+            set_size(block, get_size(block) + get_size(cur) + HEADER_SIZE);
+            cur = get_next(cur);
+            set_next(block, cur);
+        }
+        prev = block;
+    }
+}
+
+/*
+ * drain_deferred - merges every deferred free into the free list. Returns
+ * false if there was nothing to merge. The heap lock must be held.
+ */
+static bool drain_deferred() {
+    void *list = atomic_exchange_explicit(&deferred_frees, NULL, memory_order_acquire);
+    if (!list) {
+        return false;
+    }
+    UTRACE_RUN(UTRACE_MERGE, 0, list, merge_deferred(sort_deferred(list)));
+    return true;
+}
+
+/*
+ * trim_free_blocks - returns the whole pages inside large free blocks to the
+ * OS. They read back as zeros when the block is reused. The heap lock must
+ * be held.
+ */
+static void trim_free_blocks() {
+    for (memory_block_t *cur = free_head; cur; cur = get_next(cur)) {
+        if (get_size(cur) < TRIM_THRESHOLD || (SIZE_WORD(cur) & TRIMMED_BIT)) {
+            continue;
+        }
+        uintptr_t start = ((uintptr_t)get_payload(cur) + PAGESIZE - 1) & ~(uintptr_t)(PAGESIZE - 1);
+        uintptr_t end = (uintptr_t)get_end(cur) & ~(uintptr_t)(PAGESIZE - 1);
+        if (end > start && madvise((void *)start, end - start, MADV_DONTNEED) == 0) {
+            trimmed_bytes += end - start;
+        }
+        SIZE_WORD(cur) |= TRIMMED_BIT;
+    }
+}
+
+/*
+ * rebalance_caches - if the maintenance thread asked for it since this
+ * thread last looked, hands half of every class cache back for merging.
+ */
+static void rebalance_caches() {
+    unsigned epoch = atomic_load_explicit(&rebalance_epoch, memory_order_relaxed);
+    if (epoch == seen_rebalance_epoch) {
+        return;
+    }
+    seen_rebalance_epoch = epoch;
+    for (int cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+        while (ufast_count[cls] > UFAST_CACHE_LIMIT / 2) {
+            void *payload = ufast_cache[cls];
+            ufast_cache[cls] = *(void **)payload;
+            ufast_count[cls]--;
+            push_deferred(payload);
+        }
+    }
+}
+
+/*
+ * maintenance_loop - body of the maintenance thread.
+ */
+static void *maintenance_loop(void *arg) {
+    unsigned ticks = 0;
+    while (atomic_load(&maintenance_running)) {
+        usleep(maintenance_interval_us);
+        lock_heap();
+        drain_deferred();
+        trim_free_blocks();
+        unlock_heap();
+        if (++ticks % REBALANCE_TICKS == 0) {
+            atomic_fetch_add_explicit(&rebalance_epoch, 1, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * start_maintenance - starts the maintenance thread, which wakes up every
+ * interval_us microseconds. Returns 0 on success and -1 otherwise.
+ */
+int start_maintenance(unsigned interval_us) {
+    if (atomic_load(&maintenance_running)) {
+        return -1;
+    }
+    maintenance_interval_us = interval_us;
+    atomic_store(&maintenance_running, true);
+    if (pthread_create(&maintenance_thread, NULL, maintenance_loop, NULL) != 0) {
+        atomic_store(&maintenance_running, false);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * stop_maintenance - stops the maintenance thread and merges whatever frees
+ * it had not picked up yet.
+ */
+void stop_maintenance() {
+    if (!atomic_load(&maintenance_running)) {
+        return;
+    }
+    atomic_store(&maintenance_running, false);
+    pthread_join(maintenance_thread, NULL);
+    lock_heap();
+    drain_deferred();
+    unlock_heap();
+}
+
+/*
+ * print_maintenance_report - prints how much memory was trimmed.
+ */
+void print_maintenance_report(FILE *out) {
+    fprintf(out, "Maintenance: %zu bytes trimmed\n", trimmed_bytes);
+}
+
+/*
+ * Heap profiler. Sampled allocations are grouped by call stack into sites,
+ * which count what they ever allocated and what is still live, and every
+ * live sampled block is kept in an open addressing map from its payload to
+ * its site, at most half full, with removals shifting later entries back.
+ * All of it lives in memory mapped for the profiler, never on the heap it
+ * watches, and is guarded by profile_mutex; only sampled calls take it.
+ */
+#include <execinfo.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_SITE_BUCKETS 4096
+#define PROFILE_ARENA_BYTES (1 << 20)     /* sites are carved from chunks this large */
+#define PROFILE_ENTRY_FRAMES 8            /* most allocator frames above a sampled call */
+#define LN_2 0.6931471805599453
+
+typedef struct profile_site {
+    struct profile_site *next;            /* chain in its bucket */
+    uint64_t hash;
+    int depth;
+    void *pcs[PROFILE_MAX_DEPTH];
+    size_t live_count;
+    size_t live_bytes;
+    size_t alloc_count;
+    size_t alloc_bytes;
+} profile_site_t;
+
+typedef struct {
+    void *payload;                        /* NULL for an empty slot */
+    profile_site_t *site;
+    size_t size;                          /* bytes requested */
+} profile_live_t;
+
+/*
+ * Per thread, the bytes left before the next profiled and the next guarded
+ * allocation, drawn at the rates last seen. The countdown runs to the
+ * nearer of the two and was last set to sample_armed; with both off it
+ * never runs out. Starting either bumps sample_epoch, and every thread
+ * arms its countdown when its next slow path call sees the new epoch.
+ */
+__thread int64_t uprof_countdown = INT64_MAX;
+static __thread int64_t sample_armed = INT64_MAX;
+static atomic_uint sample_epoch;
+static __thread unsigned seen_sample_epoch;
+static __thread int64_t profile_left;
+static __thread int64_t guard_left;
+static __thread size_t profile_seen_rate;
+static __thread size_t guard_seen_rate;
+static __thread uint64_t profile_rng;
+static __thread bool in_profiler;         /* backtrace may allocate */
+static atomic_size_t profile_rate;        /* mean bytes between samples, 0 when off */
+static size_t profile_dump_rate;          /* rate the profile was taken at */
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static profile_site_t *profile_sites[PROFILE_SITE_BUCKETS];
+static char *profile_arena;
+static size_t profile_arena_left;
+static profile_live_t *profile_live;
+static size_t profile_live_capacity;
+static size_t profile_live_count;
+
+/* Allocator entry points are kept in their own section, so sampled stacks can be cut above them. */
+extern char __start_umalloc_entry[] __attribute__((visibility("hidden")));
+extern char __stop_umalloc_entry[] __attribute__((visibility("hidden")));
+
+/*
+ * arm_sampling - makes the thread's next allocation look at the rates.
+ */
+static void arm_sampling() {
+    sample_armed -= uprof_countdown;
+    uprof_countdown = 0;
+}
+
+/*
+ * notice_sampling - arms the countdown if sampling was started since the
+ * thread last looked. Called on the slow paths.
+ */
+static inline void notice_sampling() {
+    unsigned epoch = atomic_load_explicit(&sample_epoch, memory_order_relaxed);
+    if (__builtin_expect(epoch != seen_sample_epoch, 0)) {
+        seen_sample_epoch = epoch;
+        arm_sampling();
+    }
+}
+
+/*
+ * start_sampling - lets every thread see a rate that was just set.
+ */
+static void start_sampling() {
+    atomic_fetch_add(&sample_epoch, 1);
+    notice_sampling();
+}
+
+static void *profile_map(size_t size) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+/*
+ * fast_log2 - log2 of a positive double, to about 0.01, without libm: the
+ * exponent plus a quadratic fit of the mantissa.
+ */
+static double fast_log2(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int exponent = (int)(bits >> 52) - 1023;
+    bits = (bits & ((1ULL << 52) - 1)) | (1023ULL << 52);
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    return exponent + (m - 1) * (1.3465 - 0.3465 * (m - 1));
+}
+
+/*
+ * next_sample - bytes to allocate before the next sample, drawn from an
+ * exponential distribution with a mean of rate, so every byte has the same
+ * chance of being the one sampled.
+ */
+static int64_t next_sample(size_t rate) {
+    if (!profile_rng) {
+        profile_rng = ((uintptr_t)&profile_rng ^ (uint64_t)time(NULL) << 20) | 1;
+    }
+    profile_rng ^= profile_rng << 13;
+    profile_rng ^= profile_rng >> 7;
+    profile_rng ^= profile_rng << 17;
+    double u = ((profile_rng >> 11) + 1) / 9007199254740992.0; /* in (0, 1] */
+    double interval = -fast_log2(u) * LN_2 * rate;
+    return interval < INT64_MAX / 2 ? (int64_t)interval + 1 : INT64_MAX / 2;
+}
+
+static size_t live_home(void *payload) {
+    uint64_t h = (uintptr_t)payload * 0x9E3779B97F4A7C15ULL;
+    return (h ^ (h >> 32)) & (profile_live_capacity - 1);
+}
+
+static profile_live_t *live_slot(void *payload) {
+    size_t i = live_home(payload);
+    while (profile_live[i].payload && profile_live[i].payload != payload) {
+        i = (i + 1) & (profile_live_capacity - 1);
+    }
+    return &profile_live[i];
+}
+
+/*
+ * live_reserve - makes room for one more live block. Returns -1 if the map
+ * cannot grow.
+ */
+static int live_reserve() {
+    if (2 * (profile_live_count + 1) <= profile_live_capacity) {
+        return 0;
+    }
+    size_t capacity = profile_live_capacity ? 2 * profile_live_capacity : 1024;
+    profile_live_t *old = profile_live;
+    size_t old_capacity = profile_live_capacity;
+    if ((profile_live = profile_map(capacity * sizeof(profile_live_t))) == NULL) {
+        profile_live = old;
+        return -1;
+    }
+    profile_live_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].payload) {
+            *live_slot(old[i].payload) = old[i];
+        }
+    }
+    if (old) {
+        munmap(old, old_capacity * sizeof(profile_live_t));
+    }
+    return 0;
+}
+
+static void live_remove(profile_live_t *slot) {
+    size_t mask = profile_live_capacity - 1;
+    size_t hole = slot - profile_live;
+    size_t i = hole;
+    while (profile_live[i = (i + 1) & mask].payload) {
+        size_t home = live_home(profile_live[i].payload);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            profile_live[hole] = profile_live[i];
+            hole = i;
+        }
+    }
+    profile_live[hole].payload = NULL;
+    profile_live_count--;
+}
+
+/*
+ * find_site - the site of a call stack, created on first sight. NULL if
+ * the profiler is out of memory.
+ */
+static profile_site_t *find_site(void **pcs, int depth) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)pcs[i]) * 0x100000001b3ULL;
+    }
+    profile_site_t **bucket = &profile_sites[hash % PROFILE_SITE_BUCKETS];
+    for (profile_site_t *site = *bucket; site; site = site->next) {
+        if (site->hash == hash && site->depth == depth && !memcmp(site->pcs, pcs, depth * sizeof(void *))) {
+            return site;
+        }
+    }
+    if (profile_arena_left < sizeof(profile_site_t)) {
+        if ((profile_arena = profile_map(PROFILE_ARENA_BYTES)) == NULL) {
+            profile_arena_left = 0;
+            return NULL;
+        }
+        profile_arena_left = PROFILE_ARENA_BYTES;
+    }
+    profile_site_t *site = (profile_site_t *)profile_arena;
+    profile_arena += sizeof(profile_site_t);
+    profile_arena_left -= sizeof(profile_site_t);
+    site->hash = hash;
+    site->depth = depth;
+    memcpy(site->pcs, pcs, depth * sizeof(void *));
+    site->next = *bucket;
+    *bucket = site;
+    return site;
+}
+
+/*
+ * profile_alloc - makes an allocation, marks it and records it under the
+ * caller's stack, from the first frame outside the allocator's entry
+ * points (umalloc_sample, umalloc, the shim's malloc and the like).
+ */
+UALLOC_ENTRY static void *profile_alloc(size_t size) {
+    void *pcs[PROFILE_ENTRY_FRAMES + PROFILE_MAX_DEPTH];
+    int depth = backtrace(pcs, PROFILE_ENTRY_FRAMES + PROFILE_MAX_DEPTH);
+    int skip = 0;
+    while (skip < depth && (char *)pcs[skip] >= __start_umalloc_entry && (char *)pcs[skip] < __stop_umalloc_entry) {
+        skip++;
+    }
+    depth = depth - skip < PROFILE_MAX_DEPTH ? depth - skip : PROFILE_MAX_DEPTH;
+    void *payload = umalloc_slow(size);
+    if (payload) {
+        pthread_mutex_lock(&profile_mutex);
+        profile_site_t *site = find_site(pcs + skip, depth);
+        if (site && live_reserve() == 0) {
+            *live_slot(payload) = (profile_live_t){payload, site, size};
+            profile_live_count++;
+            site->live_count++;
+            site->live_bytes += size;
+            site->alloc_count++;
+            site->alloc_bytes += size;
+            SIZE_WORD(get_block(payload)) |= SAMPLED_BIT;
+        }
+        pthread_mutex_unlock(&profile_mutex);
+    }
+    return payload;
+}
+
+/*
+ * profile_release - drops a sampled block that is being freed.
+ */
+static void profile_release(void *payload) {
+    pthread_mutex_lock(&profile_mutex);
+    profile_live_t *slot = live_slot(payload);
+    if (slot->payload) {
+        slot->site->live_count--;
+        slot->site->live_bytes -= slot->size;
+        live_remove(slot);
+    }
+    SIZE_WORD(get_block(payload)) &= ~SAMPLED_BIT;
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+/*
+ * profile_forget_live - empties the live profile, for ureset.
+ */
+static void profile_forget_live() {
+    pthread_mutex_lock(&profile_mutex);
+    if (profile_live) {
+        memset(profile_live, 0, profile_live_capacity * sizeof(profile_live_t));
+    }
+    profile_live_count = 0;
+    for (int i = 0; i < PROFILE_SITE_BUCKETS; i++) {
+        for (profile_site_t *site = profile_sites[i]; site; site = site->next) {
+            site->live_count = 0;
+            site->live_bytes = 0;
+        }
+    }
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+/*
+ * uprofile_start - samples an allocation every sample_bytes bytes on
+ * average from now on, adding to any profile taken before. The calling
+ * thread samples at once, other threads from their next slow path call.
+ * Returns -1 for a zero rate.
+ */
+int uprofile_start(size_t sample_bytes) {
+    void *warm[1];
+    if (!sample_bytes) {
+        return -1;
+    }
+    backtrace(warm, 1); /* loads the unwinder now rather than inside a sample */
+    profile_dump_rate = sample_bytes;
+    atomic_store(&profile_rate, sample_bytes);
+    start_sampling();
+    return 0;
+}
+
+/*
+ * uprofile_stop - stops sampling. Sampled blocks still leave the profile
+ * when they are freed, so the live profile stays accurate.
+ */
+void uprofile_stop() {
+    atomic_store(&profile_rate, 0);
+}
+
+bool uprofile_running() {
+    return atomic_load_explicit(&profile_rate, memory_order_relaxed) != 0;
+}
+
+/*
+ * uprofile_dump - writes the profile to fd in pprof's legacy heap format:
+ * a line per site with its live and its cumulative samples, then the
+ * mappings that resolve the addresses. Counts are of samples; pprof scales
+ * them up by the rate in the header. Returns 0 on success and -1 if a
+ * write fails or nothing was ever profiled.
+ */
+int uprofile_dump(int fd) {
+    char line[64 + PROFILE_MAX_DEPTH * 20];
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    int ret = 0;
+    if (!profile_dump_rate) {
+        return -1;
+    }
+    pthread_mutex_lock(&profile_mutex);
+    for (int i = 0; i < PROFILE_SITE_BUCKETS; i++) {
+        for (profile_site_t *site = profile_sites[i]; site; site = site->next) {
+            live_count += site->live_count;
+            live_bytes += site->live_bytes;
+            alloc_count += site->alloc_count;
+            alloc_bytes += site->alloc_bytes;
+        }
+    }
+    int len = snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+        live_count, live_bytes, alloc_count, alloc_bytes, profile_dump_rate);
+    ret = write_all(fd, line, len);
+    for (int i = 0; i < PROFILE_SITE_BUCKETS && ret == 0; i++) {
+        for (profile_site_t *site = profile_sites[i]; site && ret == 0; site = site->next) {
+            len = snprintf(line, sizeof(line), "%zu: %zu [%zu: %zu] @",
+                site->live_count, site->live_bytes, site->alloc_count, site->alloc_bytes);
+            for (int d = 0; d < site->depth; d++) {
+                len += snprintf(line + len, sizeof(line) - len, " %p", site->pcs[d]);
+            }
+            line[len++] = '\n';
+            ret = write_all(fd, line, len);
+        }
+    }
+    pthread_mutex_unlock(&profile_mutex);
+
+    int maps = open("/proc/self/maps", O_RDONLY);
+    ssize_t n;
+    if (ret == 0) {
+        ret = write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+    }
+    while (ret == 0 && maps != -1 && (n = read(maps, line, sizeof(line))) > 0) {
+        ret = write_all(fd, line, n);
+    }
+    if (maps != -1) {
+        close(maps);
+    }
+    return ret;
+}
+
+/*
+ * Guarded allocations. Like the profiler, they are picked by the sampling
+ * countdown, so they cost nothing on the fast path. A guarded allocation
+ * gets a page of its own in a pool where every such page sits between two
+ * PROT_NONE guard pages, with the payload pushed up against the guard above
+ * it: running off the end faults at once, and whatever alignment leaves
+ * between the block and the guard is filled with GUARD_FILL and checked
+ * when the block is freed. A freed page is protected too and goes to the
+ * back of a FIFO of free slots, so it stays in quarantine, faulting on use
+ * after free, until every other free slot has been used. The SIGSEGV
+ * handler reports faults inside the pool with the stacks that allocated and
+ * freed the block, then lets the signal kill the process. When every slot
+ * is in use the request is served from the heap as usual.
+ */
+#include <signal.h>
+#include <stddef.h>
+
+#define GUARD_STACK_DEPTH 16
+#define GUARD_FILL 0xAB
+#define GUARD_MAX_SIZE (PAGESIZE - HEADER_SIZE - 2 * ALIGNMENT) /* largest request a slot takes */
+
+typedef struct {
+    char *payload;
+    size_t size;                        /* bytes requested */
+    bool live;
+    int alloc_depth;
+    int free_depth;
+    void *alloc_pcs[GUARD_STACK_DEPTH];
+    void *free_pcs[GUARD_STACK_DEPTH];
+} guard_slot_t;
+
+static atomic_size_t guard_rate;        /* mean bytes between guarded allocations, 0 when off */
+static pthread_mutex_t guard_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *guard_pool;                /* guard, slot 0, guard, slot 1, ..., guard */
+static char *guard_pool_end;
+static guard_slot_t *guard_slots;
+static size_t guard_num_slots;
+static size_t *guard_queue;             /* free slots, least recently freed first */
+static size_t guard_queue_head;
+static size_t guard_queue_count;
+static size_t guard_allocs;
+static size_t guard_fallbacks;          /* sampled while every slot was in use */
+static struct sigaction guard_old_action;
+
+static inline char *slot_page(size_t slot) {
+    return guard_pool + (2 * slot + 1) * PAGESIZE;
+}
+
+/*
+ * is_guarded - whether ptr came from the guard pool.
+ */
+static inline bool is_guarded(void *ptr) {
+    return guard_pool && (char *)ptr >= guard_pool && (char *)ptr < guard_pool_end;
+}
+
+static void guard_print(const char *fmt, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    write_all(STDERR_FILENO, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+}
+
+static void guard_print_stack(const char *what, void **pcs, int depth) {
+    guard_print("  %s at:\n", what);
+    backtrace_symbols_fd(pcs, depth, STDERR_FILENO);
+}
+
+/*
+ * guard_report - describes an access or a free that hit trouble at addr.
+ */
+static void guard_report(const char *what, char *addr) {
+    size_t page = (addr - guard_pool) / PAGESIZE;
+    guard_slot_t *slot;
+    if (page % 2) {
+        slot = &guard_slots[page / 2];
+    } else if (page > 0 && (page == 2 * guard_num_slots || guard_slots[page / 2 - 1].live ||
+            !guard_slots[page / 2].live)) {
+        slot = &guard_slots[page / 2 - 1]; /* just past the end of the slot below */
+    } else {
+        slot = &guard_slots[page / 2];
+    }
+    guard_print("umalloc guard: %s at %p", what, addr);
+    if (slot->payload) {
+        ptrdiff_t offset = addr - slot->payload;
+        if (offset < 0) {
+            guard_print(", %td bytes before", -offset);
+        } else if (offset >= (ptrdiff_t)slot->size) {
+            guard_print(", %td bytes past the end of", offset - (ptrdiff_t)slot->size);
+        } else {
+            guard_print(", %td bytes into", offset);
+        }
+        guard_print(" the %zu-byte %s block at %p\n", slot->size, slot->live ? "live" : "freed", slot->payload);
+        guard_print_stack("allocated", slot->alloc_pcs, slot->alloc_depth);
+        if (!slot->live) {
+            guard_print_stack("freed", slot->free_pcs, slot->free_depth);
+        }
+    } else {
+        guard_print(", in a slot never used\n");
+    }
+}
+
+/*
+ * guard_fault - the SIGSEGV handler. Faults outside the pool go to the
+ * handler that was installed before.
+ */
+static void guard_fault(int sig, siginfo_t *info, void *context) {
+    char *addr = info->si_addr;
+    if (is_guarded(addr)) {
+        size_t page = (addr - guard_pool) / PAGESIZE;
+        guard_slot_t *slot = &guard_slots[page / 2];
+        const char *what = "buffer overflow";
+        if (page % 2 && !slot->live) {
+            /* free reads the header first */
+            what = addr < slot->payload && addr >= slot->payload - HEADER_SIZE ?
+                "double free or use after free" : "use after free";
+        }
+        guard_report(what, addr);
+        signal(SIGSEGV, SIG_DFL); /* the access faults again and kills the process */
+        return;
+    }
+    if (guard_old_action.sa_flags & SA_SIGINFO) {
+        guard_old_action.sa_sigaction(sig, info, context);
+    } else if (guard_old_action.sa_handler != SIG_DFL && guard_old_action.sa_handler != SIG_IGN) {
+        guard_old_action.sa_handler(sig);
+    } else {
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+/*
+ * guard_alloc - serves a request from a free slot, or returns NULL when
+ * none is free or the request does not fit in a page.
+ */
+static void *guard_alloc(size_t size) {
+    if (size > GUARD_MAX_SIZE) {
+        return NULL;
+    }
+    pthread_mutex_lock(&guard_mutex);
+    if (!guard_queue_count) {
+        guard_fallbacks++;
+        pthread_mutex_unlock(&guard_mutex);
+        return NULL;
+    }
+    size_t index = guard_queue[guard_queue_head];
+    guard_queue_head = (guard_queue_head + 1) % guard_num_slots;
+    guard_queue_count--;
+    guard_allocs++;
+    pthread_mutex_unlock(&guard_mutex);
+
+    guard_slot_t *slot = &guard_slots[index];
+    char *page = slot_page(index);
+    if (mprotect(page, PAGESIZE, PROT_READ | PROT_WRITE) == -1) {
+        return NULL; /* the slot stays out of the queue */
+    }
+    size_t block_size = BLOCK_SIZE(size ? size : 1);
+    char *payload = (char *)(((uintptr_t)page + PAGESIZE - block_size) & ~(uintptr_t)(ALIGNMENT - 1));
+    memory_block_t *block = get_block(payload);
+    put_block(block, block_size, true);
+    SIZE_WORD(block) |= SAMPLED_BIT;
+    memset(payload + block_size, GUARD_FILL, page + PAGESIZE - payload - block_size);
+    slot->payload = payload;
+    slot->size = size;
+    slot->alloc_depth = backtrace(slot->alloc_pcs, GUARD_STACK_DEPTH);
+    slot->free_depth = 0;
+    slot->live = true;
+    return payload;
+}
+
+/*
+ * guard_free - checks the padding of a guarded block, protects its page
+ * and queues the slot behind every other free one. An invalid or double
+ * free, or padding that was written to, is reported and aborts.
+ */
+static void guard_free(void *ptr) {
+    size_t page = ((char *)ptr - guard_pool) / PAGESIZE;
+    guard_slot_t *slot = &guard_slots[page / 2];
+    if (page % 2 == 0 || !slot->live || slot->payload != ptr) {
+        guard_report(slot->live || !slot->payload ? "invalid free" : "double free", ptr);
+        abort();
+    }
+    char *end = slot_page(page / 2) + PAGESIZE;
+    for (char *p = slot->payload + get_size(get_block(ptr)); p < end; p++) {
+        if (*(unsigned char *)p != GUARD_FILL) {
+            guard_report("buffer overflow into the padding, found on free,", p);
+            abort();
+        }
+    }
+    slot->free_depth = backtrace(slot->free_pcs, GUARD_STACK_DEPTH);
+    slot->live = false;
+    mprotect(slot_page(page / 2), PAGESIZE, PROT_NONE);
+    pthread_mutex_lock(&guard_mutex);
+    guard_queue[(guard_queue_head + guard_queue_count++) % guard_num_slots] = page / 2;
+    pthread_mutex_unlock(&guard_mutex);
+}
+
+/*
+ * uguard_start - serves an allocation every sample_bytes bytes on average
+ * from a pool of slots guarded pages. The pool is set up by the first call
+ * and kept; later calls only change the rate. Returns -1 if the pool or the
+ * SIGSEGV handler cannot be set up.
+ */
+int uguard_start(size_t sample_bytes, size_t slots) {
+    if (!sample_bytes || !slots) {
+        return -1;
+    }
+    if (!guard_pool) {
+        size_t pool_bytes = (2 * slots + 1) * PAGESIZE;
+        char *pool = mmap(NULL, pool_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        guard_slots = profile_map(slots * sizeof(guard_slot_t));
+        guard_queue = profile_map(slots * sizeof(size_t));
+        if (pool == MAP_FAILED || !guard_slots || !guard_queue) {
+            return -1;
+        }
+        for (size_t i = 0; i < slots; i++) {
+            guard_queue[i] = i;
+        }
+        guard_num_slots = guard_queue_count = slots;
+        struct sigaction action = {.sa_sigaction = guard_fault, .sa_flags = SA_SIGINFO | SA_NODEFER};
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGSEGV, &action, &guard_old_action) == -1) {
+            return -1;
+        }
+        void *warm[1];
+        backtrace(warm, 1); /* loads the unwinder now rather than inside an allocation */
+        guard_pool_end = pool + pool_bytes;
+        guard_pool = pool;
+    }
+    atomic_store(&guard_rate, sample_bytes);
+    start_sampling();
+    return 0;
+}
+
+/*
+ * uguard_stop - stops guarding new allocations. Guarded blocks stay guarded
+ * until they are freed.
+ */
+void uguard_stop() {
+    atomic_store(&guard_rate, 0);
+}
+
+/*
+ * uguard_owns - whether ptr is a guarded block, which lies outside the heap.
+ */
+bool uguard_owns(void *ptr) {
+    return is_guarded(ptr);
+}
+
+void print_guard_report(FILE *out) {
+    pthread_mutex_lock(&guard_mutex);
+    fprintf(out, "Guarded allocations: %zu, %zu of %zu slots live, %zu fell back to the heap\n",
+        guard_allocs, guard_num_slots - guard_queue_count, guard_num_slots, guard_fallbacks);
+    pthread_mutex_unlock(&guard_mutex);
+}
+
+/*
+ * umalloc_sample - called by umalloc_fast when the thread's countdown runs
+ * out. Takes the bytes allocated since the countdown was set off both
+ * distances (drawing a fresh one for a rate that changed), serves the
+ * request guarded or profiled if either ran out (guarded first, as a
+ * guarded block cannot also be profiled), and sets the countdown again.
+ * With both off it is set so it never runs out.
+ */
+UALLOC_ENTRY void *umalloc_sample(size_t size) {
+    if (in_profiler) { /* backtrace allocating */
+        return umalloc_slow(size);
+    }
+    size_t profile_bytes = atomic_load_explicit(&profile_rate, memory_order_relaxed);
+    size_t guard_bytes = atomic_load_explicit(&guard_rate, memory_order_relaxed);
+    int64_t spent = sample_armed - uprof_countdown;
+    bool profile = false;
+    void *payload = NULL;
+    in_profiler = true;
+    if (guard_bytes != guard_seen_rate) { /* started, stopped or changed */
+        guard_seen_rate = guard_bytes;
+        guard_left = guard_bytes ? next_sample(guard_bytes) : 0;
+    } else if (guard_bytes && (guard_left -= spent) <= 0) {
+        guard_left = next_sample(guard_bytes);
+        payload = guard_alloc(size);
+    }
+    if (profile_bytes != profile_seen_rate) {
+        profile_seen_rate = profile_bytes;
+        profile_left = profile_bytes ? next_sample(profile_bytes) : 0;
+    } else if (profile_bytes && (profile_left -= spent) <= 0) {
+        profile_left = next_sample(profile_bytes);
+        profile = !payload;
+    }
+    if (!payload) {
+        payload = profile ? profile_alloc(size) : umalloc_slow(size);
+    }
+    in_profiler = false;
+
+    int64_t next = INT64_MAX;
+    if (profile_bytes && profile_left < next) {
+        next = profile_left;
+    }
+    if (guard_bytes && guard_left < next) {
+        next = guard_left;
+    }
+    uprof_countdown = sample_armed = next;
+    return payload;
+}
+
+/*
+ * forget_blocks - drops every cached and deferred block, which belong to
+ * a heap that is being started over, along with the live heap profile, and
+ * restarts the placement telemetry, keeping the policy that was set. Only the
+ * calling thread's class caches can be reached.
+ */
+static void forget_blocks() {
+    atomic_store(&deferred_frees, NULL);
+    memset(ufast_cache, 0, sizeof(ufast_cache));
+    memset(ufast_count, 0, sizeof(ufast_count));
+    profile_forget_live();
+    for (int cpu = 0; cpu < MAX_CPU_SHARDS; cpu++) {
+        memset(cpu_shards[cpu].cache, 0, sizeof(cpu_shards[cpu].cache));
+        memset(cpu_shards[cpu].count, 0, sizeof(cpu_shards[cpu].count));
+    }
+    for (int i = 0; i < NUM_PLACEMENT_RANGES; i++) {
+        placement_range_t *r = &placement[i];
+        bool adaptive = r->adaptive;
+        policy_t policy = adaptive ? BEST_FIT : r->policy;
+        memset(r, 0, sizeof(*r));
+        r->adaptive = adaptive;
+        r->policy = policy;
+    }
+    num_decisions = 0;
+    total_searches = 0;
+}
+
+/*
+ * uinit - Used initialize metadata required to manage the heap
+ * along with allocating initial memory. Calling it again starts a new
+ * heap, so the caches of the old one are emptied first.
+ */
+int uinit() {
+    //* STUDENT TODO
+    // use csbrk, any mulitple of pagesize
+    int size = 5 * PAGESIZE;
+    char *ptr = csbrk(size);
+    if(!ptr) {
+        return -1;
+    }
+#ifdef UMALLOC_COMPACT
+    heap_base = ptr;
+#endif
+    heap_end = ptr + size;
+    forget_blocks();
+    num_segments = 0;
+    segments_lost = false;
+    tracking_segments = true;
+    check_cursor = NULL;
+#ifdef UTRACE
+    utrace_start();
+#endif
+    add_segment(ptr, heap_end);
+    free_head = (memory_block_t *)(ptr + SEGMENT_PAD);
+    put_block(free_head, size - 2 * SEGMENT_PAD - HEADER_SIZE, false);
+    return 0;
+}
+
+/*
+ * ureset - frees everything at once: every segment the heap has taken from
+ * csbrk becomes a single free block again, the calling thread's class
+ * caches, the per-CPU caches and the live heap profile are emptied, and the
+ * placement telemetry starts over, keeping the policy that was set. No
+ * other thread may hold blocks or cached blocks, and the maintenance thread
+ * must be stopped. Returns 0 on success and -1 if the heap cannot be reset.
+ */
+int ureset() {
+    if (!num_segments || segments_lost || atomic_load(&maintenance_running)) {
+        return -1;
+    }
+    lock_heap();
+    forget_blocks();
+
+    // csbrk hands out ascending addresses, but the shim's mmap fallback may not
+    for (int i = 1; i < num_segments; i++) {
+        for (int j = i; j > 0 && segments[j].start < segments[j - 1].start; j--) {
+            heap_segment_t tmp = segments[j];
+            segments[j] = segments[j - 1];
+            segments[j - 1] = tmp;
+        }
+    }
+    check_cursor = NULL;
+    memory_block_t *prev = NULL;
+    for (int i = 0; i < num_segments; i++) {
+        memory_block_t *block = (memory_block_t *)(segments[i].start + SEGMENT_PAD);
+        put_block(block, segments[i].end - segments[i].start - 2 * SEGMENT_PAD - HEADER_SIZE, false);
+        if (prev) {
+            set_next(prev, block);
+        } else {
+            free_head = block;
+        }
+        prev = block;
+    }
+    unlock_heap();
+    return 0;
+}
+
+/*
+ * alloc_block - allocates a block of (payload) size bytes from the free list,
+ * extending the heap if needed. The heap lock must be held.
+ */
+static void *alloc_block(size_t size) {
+    //* STUDENT TODO
+    // call find to get free block
+    // check_heap();
+    memory_block_t *bptr = UTRACE_CALL(UTRACE_FIND, size, find(size));
+    if(!bptr && drain_deferred()) { // pending frees may hold a fit
+        bptr = UTRACE_CALL(UTRACE_FIND, size, find(size));
+    }
+    if(!bptr) { // didn't find a block big enough
+        bptr = UTRACE_CALL(UTRACE_EXTEND, size, extend(size)); // already free, in the list and coalesced
+        if(!bptr) {
+            return NULL;
+        }
+    }
+    if(get_size(bptr) > size) {
+        if((get_size(bptr) - size) >= MIN_SPLIT) { // split
+            return UTRACE_CALL(UTRACE_SPLIT, size, split(bptr, size));
+        }
+    }
+    // allocating entire block so fix the free list
+    memory_block_t *prev = free_head;
+    if(prev == bptr) { // allocated free_head
+        free_head = get_next(free_head);
+    } else {
+        bool done = false;
+        while(!done) {
+            UTRACE_VISIT();
+            if(get_next(prev)) {
+                if(get_next(prev) == bptr) { // found bptr
+                    set_next(prev, get_next(bptr)); // bridging free list
+                    done = true;
+                }
+                prev = get_next(prev);
+            }
+            
+        }
+    }
+    // after free list is fixed, allocate the block
+    allocate(bptr);
+    return get_payload(bptr);
+}
+
+/*
+ * umalloc_slow - allocates from the free list when the class cache missed.
+ * Requests served by the fast path are rounded up to their class, so the
+ * block can be cached once it is freed.
+ */
+void *umalloc_slow(size_t size) {
+    notice_sampling();
+    if(size <= UFAST_MAX_SIZE) {
+        unsigned cls = ufast_alloc_class[(size + ALIGNMENT - 1) / ALIGNMENT];
+        if(shard_mode == SHARD_PER_CPU) {
+            void *payload = shard_pop(cls);
+            if(payload) {
+                USTAT_ADD(ustat_class_allocs[cls], 1);
+                return payload;
+            }
+        }
+        USTAT_ADD(ustat_class_allocs[cls], 1);
+        size = ufast_class_size[cls];
+    }
+    rebalance_caches();
+    lock_heap();
+    void *payload = UTRACE_CALL(UTRACE_MALLOC, size, alloc_block(BLOCK_SIZE(size)));
+    unlock_heap();
+    UTRACE_START_DRAIN();
+    return payload;
+}
+
+/*
+ * umalloc -  allocates size bytes and returns a pointer to the allocated memory.
+ */
+UALLOC_ENTRY void *umalloc(size_t size) {
+    return umalloc_fast(size);
+}
+
+/*
+ * free_block - returns a block to the address-ordered free list and
+ * coalesces it with its neighbors. The heap lock must be held.
+ */
+static void free_block(void *ptr) {
+    //* STUDENT TODO
+    memory_block_t *bptr = get_block(ptr);
     deallocate(bptr);
     memory_block_t *prev = free_head;
     if(!free_head) {
-        free_head = ptr;
+        set_next(bptr, NULL);
+        free_head = bptr;
     } else if(prev > bptr) { // new free_head
-        bptr->next = free_head;
+        set_next(bptr, free_head);
         free_head = bptr;
-        coalesce(bptr);
+        UTRACE_RUN(UTRACE_COALESCE, get_size(bptr), bptr, coalesce(bptr));
     } else {
-        while(prev->next) {
-            if(prev->next > bptr) { // insert free block after prev
-                bptr->next = prev->next;
-                prev->next = bptr;
-                coalesce(bptr);
+        while(get_next(prev)) {
+            UTRACE_VISIT();
+            if(get_next(prev) > bptr) { // insert free block after prev
+                set_next(bptr, get_next(prev));
+                set_next(prev, bptr);
+                UTRACE_RUN(UTRACE_COALESCE, get_size(bptr), bptr, coalesce(bptr));
                 return;
             }
-            prev = prev->next;
+            prev = get_next(prev);
         }
         if(bptr > prev) { // add to the end of the list
-            prev->next = bptr;
+            set_next(bptr, NULL);
+            set_next(prev, bptr);
+        }
+        UTRACE_RUN(UTRACE_COALESCE, get_size(bptr), bptr, coalesce(bptr));
+    }
+}
+
+/*
+ * ufree_slow - frees a block the class cache did not take, dropping it from
+ * the heap profile if it was sampled. While the maintenance thread runs,
+ * the block is only queued for it.
+ */
+void ufree_slow(void *ptr) {
+    notice_sampling();
+    size_t size = get_size(get_block(ptr));
+    if (SIZE_WORD(get_block(ptr)) & SAMPLED_BIT) {
+        if (is_guarded(ptr)) {
+            guard_free(ptr);
+            return;
         }
-        coalesce(bptr);
+        profile_release(ptr);
+    }
+    if (shard_mode == SHARD_PER_CPU && size <= BLOCK_SIZE(UFAST_MAX_SIZE) &&
+        ufast_free_class[size / ALIGNMENT] != UFAST_NO_CLASS && shard_push(ptr, ufast_free_class[size / ALIGNMENT])) {
+        return;
+    }
+    rebalance_caches();
+    if (atomic_load_explicit(&maintenance_running, memory_order_relaxed)) {
+        push_deferred(ptr);
+        return;
+    }
+    lock_heap();
+    UTRACE_RUN(UTRACE_FREE, size, ptr, free_block(ptr));
+    unlock_heap();
+}
+
+/*
+ * ufree -  frees the memory space pointed to by ptr, which must have been called
+ * by a previous call to malloc.
+ */
+void ufree(void *ptr) {
+    ufree_fast(ptr);
+}
+
+/*
+ * urealloc - resizes the block at ptr to hold size bytes, in place when it
+ * already does, moving it otherwise. Follows realloc(): a NULL ptr
+ * allocates and a zero size frees.
+ */
+UALLOC_ENTRY void *urealloc(void *ptr, size_t size) {
+    if(!ptr) {
+        return umalloc(size);
+    }
+    if(size == 0) {
+        ufree(ptr);
+        return NULL;
+    }
+    size_t old_size = get_size(get_block(ptr));
+    if(BLOCK_SIZE(size) <= old_size) {
+        return ptr;
     }
-}
\ No newline at end of file
+    void *payload = umalloc(size);
+    if(payload) {
+        memcpy(payload, ptr, old_size);
+        ufree(ptr);
+    }
+    return payload;
+}
+
+/*
+ * umemalign - allocates size bytes aligned to alignment, a power of two.
+ * A block with room to spare is taken from the free list, the payload is
+ * placed on the first boundary that leaves a splittable gap in front, and
+ * the gap and any spare tail go straight back to the free list.
+ */
+UALLOC_ENTRY void *umemalign(size_t alignment, size_t size) {
+    if(alignment <= ALIGNMENT) {
+        return umalloc(size);
+    }
+    size = BLOCK_SIZE(size);
+    lock_heap();
+    void *payload = alloc_block(BLOCK_SIZE(size + alignment + MIN_SPLIT));
+    if(!payload) {
+        unlock_heap();
+        return NULL;
+    }
+    memory_block_t *block = get_block(payload);
+    size_t total = get_size(block);
+    char *aligned = (char *)(((uintptr_t)payload + MIN_SPLIT + alignment - 1) & ~(alignment - 1));
+    size_t front = aligned - HEADER_SIZE - (char *)payload;
+    memory_block_t *aligned_block = get_block(aligned);
+    put_block(aligned_block, total - front - HEADER_SIZE, true);
+    put_block(block, front, true);
+    free_block(payload);
+    if(get_size(aligned_block) - size >= MIN_SPLIT) {
+        size_t tail = get_size(aligned_block) - size - HEADER_SIZE;
+        put_block(aligned_block, size, true);
+        put_block(get_end(aligned_block), tail, true);
+        free_block(get_payload(get_end(aligned_block)));
+    }
+    unlock_heap();
+    return aligned;
+}
+
+/*
+ * uusable_size - returns how many bytes the block at ptr can hold.
+ */
+size_t uusable_size(void *ptr) {
+    return get_size(get_block(ptr));
+}
+
+#define DUMP_BATCH 256 /* block records written per write() */
+
+/*
+ * uheap_dump - writes a snapshot of every block, in the format described
+ * in umalloc.h, to fd. The heap is walked twice under the heap lock, once
+ * to count the blocks and once to write them in batches from the stack, so
+ * the dump never allocates and sees the heap as it was at a single moment.
+ * Returns 0 on success and -1 before uinit, if segments were lost (the
+ * snapshot would miss their blocks) or if a write fails.
+ */
+int uheap_dump(int fd) {
+    uheap_dump_header_t header = {.magic = UHEAP_DUMP_MAGIC, .header_size = HEADER_SIZE};
+    uheap_dump_block_t batch[DUMP_BATCH];
+    size_t batched = 0;
+    int ret = 0;
+    if(!num_segments || segments_lost) {
+        return -1;
+    }
+    lock_heap();
+    char *base = segments[0].start;
+    header.num_segments = num_segments;
+    for(int i = 0; i < num_segments; i++) {
+        char *end = segments[i].end - SEGMENT_PAD;
+        for(memory_block_t *cur = (memory_block_t *)(segments[i].start + SEGMENT_PAD);
+                (char *)cur < end; cur = get_end(cur)) {
+            header.num_blocks++;
+        }
+    }
+    ret = write_all(fd, &header, sizeof(header));
+    for(int i = 0; i < num_segments && ret == 0; i++) {
+        uheap_dump_segment_t segment = {segments[i].start - base, segments[i].end - segments[i].start};
+        ret = write_all(fd, &segment, sizeof(segment));
+    }
+    for(int i = 0; i < num_segments && ret == 0; i++) {
+        char *end = segments[i].end - SEGMENT_PAD;
+        for(memory_block_t *cur = (memory_block_t *)(segments[i].start + SEGMENT_PAD);
+                (char *)cur < end && ret == 0; cur = get_end(cur)) {
+            size_t size = get_size(cur);
+            unsigned cls = size <= BLOCK_SIZE(UFAST_MAX_SIZE) ? ufast_free_class[size / ALIGNMENT] : NUM_SIZE_CLASSES;
+            batch[batched++] = (uheap_dump_block_t){
+                .offset = (char *)cur - base,
+                .size = size,
+                .segment = i,
+                .class_size = cls < NUM_SIZE_CLASSES ? ufast_class_size[cls] : 0,
+                .allocated = is_allocated(cur),
+            };
+            if(batched == DUMP_BATCH) {
+                ret = write_all(fd, batch, sizeof(batch));
+                batched = 0;
+            }
+        }
+    }
+    if(ret == 0 && batched) {
+        ret = write_all(fd, batch, batched * sizeof(uheap_dump_block_t));
+    }
+    unlock_heap();
+    return ret;
+}
+
+/*
+ * ustats - fills in a snapshot of the heap. The block counts come from a
+ * walk of every segment by address under the heap lock, so this costs a
+ * pass over the heap; the event counters are only kept with USTATS.
+ * Returns -1 before uinit, and if segments were lost, as the walk would
+ * then miss blocks the free list still counts.
+ */
+int ustats(struct ustats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if(!num_segments || segments_lost) {
+        return -1;
+    }
+    lock_heap();
+    for(int i = 0; i < num_segments; i++) {
+        stats->heap_bytes += segments[i].end - segments[i].start;
+        char *end = segments[i].end - SEGMENT_PAD;
+        for(memory_block_t *cur = (memory_block_t *)(segments[i].start + SEGMENT_PAD);
+                (char *)cur < end; cur = get_end(cur)) {
+            if(is_allocated(cur)) {
+                stats->in_use_bytes += get_size(cur);
+                stats->allocated_blocks++;
+            }
+        }
+    }
+    for(memory_block_t *cur = free_head; cur; cur = get_next(cur)) {
+        size_t size = get_size(cur);
+        stats->free_bytes += size;
+        stats->free_blocks++;
+        if(size > stats->largest_free) {
+            stats->largest_free = size;
+        }
+    }
+    size_t visited = 0;
+    for(int i = 0; i < NUM_PLACEMENT_RANGES; i++) {
+        stats->finds += placement[i].total_searches;
+        visited += placement[i].total_visited;
+    }
+    stats->find_visits = stats->finds ? (double)visited / stats->finds : 0.0;
+    unlock_heap();
+#ifdef USTATS
+    stats->counting = true;
+    stats->extend_calls = atomic_load_explicit(&ustat_extends, memory_order_relaxed);
+    stats->coalesces = atomic_load_explicit(&ustat_coalesces, memory_order_relaxed);
+    stats->coalesce_visits = stats->coalesces ? (double)atomic_load_explicit(&ustat_coalesce_visits,
+        memory_order_relaxed) / stats->coalesces : 0.0;
+    for(int cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+        stats->class_allocs[cls] = atomic_load_explicit(&ustat_class_allocs[cls], memory_order_relaxed);
+    }
+#endif
+    return 0;
+}
+
+/*
+ * print_ustats - prints a ustats snapshot.
+ */
+void print_ustats(FILE *out) {
+    struct ustats stats;
+    if(ustats(&stats) == -1) {
+        fprintf(out, "Heap statistics: %s\n", num_segments ? "segments were lost, so the heap cannot be walked"
+            : "heap not initialized");
+        return;
+    }
+    fprintf(out, "Heap statistics:\n");
+    fprintf(out, "  heap %zu bytes, in use %zu bytes in %zu blocks, free %zu bytes in %zu blocks\n",
+        stats.heap_bytes, stats.in_use_bytes, stats.allocated_blocks, stats.free_bytes, stats.free_blocks);
+    fprintf(out, "  largest free block %zu bytes, %zu finds visiting %.1f blocks each\n",
+        stats.largest_free, stats.finds, stats.find_visits);
+    if(!stats.counting) {
+        fprintf(out, "  (build with make stats for extend, coalesce and size class counts)\n");
+        return;
+    }
+    fprintf(out, "  %zu extends, %zu coalesces visiting %.1f blocks each\n",
+        stats.extend_calls, stats.coalesces, stats.coalesce_visits);
+    fprintf(out, "  allocations per size class:");
+    for(int cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+        if(stats.class_allocs[cls]) {
+            fprintf(out, " %zu:%zu", ufast_class_size[cls], stats.class_allocs[cls]);
+        }
+    }
+    fprintf(out, "\n");
+}
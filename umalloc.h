@@ -1,5 +1,10 @@
+#ifndef UMALLOC_H
+#define UMALLOC_H
+
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #define ALIGNMENT 16 /* The alignment of all payloads returned by umalloc */
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
@@ -8,14 +13,56 @@
  * memory_block_t - Represents a block of memory managed by the heap. The 
  * struct can be left as is, or modified for your design.
  * In the current design bit0 is the allocated bit
- * bits 1-3 are unused.
+ * bit1 marks a free block whose inner pages were trimmed,
+ * bit2 marks an allocated block sampled by the heap profiler,
+ * bit3 is unused.
  * and the remaining 60 bit represent the size.
  */
+#ifndef UMALLOC_COMPACT
 typedef struct memory_block_struct {
     size_t block_size_alloc;
     struct memory_block_struct *next;
 } memory_block_t;
 
+#define SEGMENT_PAD 0 /* bytes left unused at each end of a csbrk segment */
+#define BLOCK_SIZE(size) ALIGN(size) /* payload size that serves a request */
+#define PAYLOAD_SIZE(block) ((block)->block_size_alloc & ~(size_t)(ALIGNMENT-1))
+#define IS_SAMPLED(block) ((block)->block_size_alloc & SAMPLED_BIT)
+#else
+/*
+ * Compact layout (make compact): the heap never exceeds 4 GiB, so the size
+ * word holds the byte size of the whole block, header included, which is a
+ * multiple of 16 whose low four bits carry the same flags as above, and
+ * next is a 32-bit offset from the heap base, 0 meaning NULL. The header
+ * is 8 bytes, so headers sit 8 bytes below a 16-byte boundary and payloads
+ * are 16n + 8 bytes long.
+ */
+typedef struct memory_block_struct {
+    uint32_t block_size_alloc;
+    uint32_t next;
+} memory_block_t;
+
+#define SEGMENT_PAD (ALIGNMENT - sizeof(memory_block_t))
+#define BLOCK_SIZE(size) (ALIGN((size) + sizeof(memory_block_t)) - sizeof(memory_block_t))
+#define PAYLOAD_SIZE(block) \
+    (((block)->block_size_alloc & ~(ALIGNMENT-1)) - sizeof(memory_block_t))
+#define IS_SAMPLED(block) ((block)->block_size_alloc & SAMPLED_BIT)
+#endif
+
+#define SAMPLED_BIT 0x4
+
+#define HEADER_SIZE sizeof(memory_block_t)
+
+/*
+ * A run of memory taken from csbrk, contiguous runs merged. Blocks tile
+ * [start + SEGMENT_PAD, end - SEGMENT_PAD) exactly.
+ */
+typedef struct {
+    char *start;
+    char *end;
+} heap_segment_t;
+#define MIN_SPLIT (3 * HEADER_SIZE) /* smallest remainder worth splitting off */
+
 // Helper Functions. Their parameters may be edited if you change their 
 // signature in umalloc.c. Do not change their purpose.
 bool is_allocated(memory_block_t *block);
@@ -23,6 +70,7 @@ void allocate(memory_block_t *block);
 void deallocate(memory_block_t *block);
 size_t get_size(memory_block_t *block);
 memory_block_t *get_next(memory_block_t *block);
+void set_next(memory_block_t *block, memory_block_t *next);
 void put_block(memory_block_t *block, size_t size, bool alloc);
 void *get_payload(memory_block_t *block);
 memory_block_t *get_block(void *payload);
@@ -32,8 +80,256 @@ memory_block_t *extend(size_t size);
 memory_block_t *split(memory_block_t *block, size_t size);
 memory_block_t *coalesce(memory_block_t *block);
 
+/*
+ * Placement policies used by find(). Requests are bucketed into size ranges
+ * and each range runs its own policy: best fit unless another one is set,
+ * or, under ADAPTIVE, whichever the fragmentation telemetry picks.
+ */
+typedef enum {
+    BEST_FIT,       // smallest block that fits, walks the whole free list
+    GOOD_FIT,       // first block within 1/8 of the request, else best fit
+    FIRST_FIT,      // lowest addressed block that fits
+    NUM_POLICIES,
+    ADAPTIVE = -1   // let the telemetry pick
+} policy_t;
+
+#define NUM_PLACEMENT_RANGES 3 /* <= 256, <= 4096 and larger requests */
+
+/*
+ * The heap lock guards the free list. The optional maintenance thread takes
+ * frees off the ufree path, merges them in batches and trims free memory.
+ */
+void lock_heap();
+void unlock_heap();
+int start_maintenance(unsigned interval_us);
+void stop_maintenance();
+void print_maintenance_report(FILE *out);
+
+/*
+ * Where the class caches live. Per thread (the default) keeps the inline
+ * fast path free of calls, but every thread holds its own cached blocks.
+ * Per CPU replaces them with one cache per CPU, picked with sched_getcpu()
+ * and guarded by a spinlock, so cached memory scales with the core count.
+ * Select the mode before the first allocation.
+ */
+typedef enum {
+    SHARD_PER_THREAD,
+    SHARD_PER_CPU
+} shard_mode_t;
+
+#define MAX_CPU_SHARDS 256
+#define SHARD_CACHE_LIMIT (4 * UFAST_CACHE_LIMIT) /* blocks per class and CPU */
+
+void set_shard_mode(shard_mode_t mode);
+void print_shard_report(FILE *out);
+
+void set_placement_policy(policy_t policy);
+policy_t parse_placement_policy(char *name);
+void print_placement_report(FILE *out);
+
+/*
+ * Size classes served by the inline fast path. USIZE_CLASSES lists the
+ * largest request of every class in ascending order, at most 1024 bytes.
+ * Requests up to UFAST_MAX_SIZE are rounded up to their class on the slow
+ * path, and freed blocks of those classes are kept in a small per-thread
+ * cache per class instead of going back to the free list. A table fitted
+ * to traces by sizeclass_gen is compiled in from USIZE_CLASSES_FILE.
+ */
+#ifdef USIZE_CLASSES_FILE
+#include USIZE_CLASSES_FILE
+#endif
+#ifndef USIZE_CLASSES
+#define USIZE_CLASSES(X, arg) \
+    X(16, arg) X(32, arg) X(48, arg) X(64, arg) X(80, arg) X(96, arg) \
+    X(112, arg) X(128, arg) X(144, arg) X(160, arg) X(176, arg) X(192, arg) \
+    X(208, arg) X(224, arg) X(240, arg) X(256, arg) X(288, arg) X(320, arg) \
+    X(352, arg) X(384, arg) X(416, arg) X(448, arg) X(480, arg) X(512, arg)
+#define UFAST_MAX_SIZE 512
+#endif
+
+#define UFAST_CACHE_LIMIT 32 /* blocks cached per class and thread */
+#define UFAST_TABLE_SIZE (1024 / ALIGNMENT + 1)
+
+#define UCOUNT_CLASS(c, arg) + 1
+#define NUM_SIZE_CLASSES (0 USIZE_CLASSES(UCOUNT_CLASS, 0))
+
+/*
+ * ufast_alloc_class maps a request, in ALIGNMENT units rounded up, to the
+ * smallest class that holds it; ufast_free_class maps a block's payload
+ * size, in ALIGNMENT units rounded down, to the largest class it can serve,
+ * or to UFAST_NO_CLASS for a payload too small for any class.
+ * Both tables are built by the compiler from USIZE_CLASSES in umalloc.c.
+ */
+extern const unsigned char ufast_alloc_class[UFAST_TABLE_SIZE];
+extern const unsigned char ufast_free_class[UFAST_TABLE_SIZE];
+#define UFAST_NO_CLASS NUM_SIZE_CLASSES
+_Static_assert(NUM_SIZE_CLASSES < 256, "class numbers and UFAST_NO_CLASS must fit the class tables");
+extern const size_t ufast_class_size[NUM_SIZE_CLASSES];
+extern __thread void *ufast_cache[NUM_SIZE_CLASSES];
+extern __thread unsigned ufast_count[NUM_SIZE_CLASSES];
+extern unsigned ufast_limit; /* UFAST_CACHE_LIMIT, 0 while sharding per CPU */
+
+void *umalloc_slow(size_t size);
+void ufree_slow(void *ptr);
+
+/*
+ * Sampling heap profiler. Every thread counts down the bytes it allocates
+ * and samples the allocation that takes the count below zero, so an
+ * unsampled umalloc pays one subtraction, and while nothing samples the
+ * count starts too high to ever run out; the distance to the next sample
+ * is drawn from an exponential distribution with a mean of sample_bytes.
+ * Sampled blocks carry SAMPLED_BIT and leave through ufree_slow, which
+ * drops them from the profile. uprofile_dump writes the live and the
+ * cumulative profile in the text format pprof reads.
+ */
+extern __thread int64_t uprof_countdown;
+
+/* Allocator entry points, which sampled stacks are cut above. */
+#define UALLOC_ENTRY __attribute__((section("umalloc_entry")))
+
+void *umalloc_sample(size_t size);
+int uprofile_start(size_t sample_bytes);
+void uprofile_stop();
+bool uprofile_running();
+int uprofile_dump(int fd);
+
+/*
+ * Guarded allocations, for catching overflows and uses after free in long
+ * runs. The same countdown picks an allocation every sample_bytes on
+ * average to get a page of its own between two inaccessible guard pages,
+ * from a pool of slots; a freed slot stays inaccessible until every other
+ * free slot has been reused. Bad accesses, double frees and overflows into
+ * the padding are reported on stderr with the stacks of the block.
+ */
+#define UGUARD_DEFAULT_SLOTS 1024
+
+int uguard_start(size_t sample_bytes, size_t slots);
+void uguard_stop();
+bool uguard_owns(void *ptr);
+void print_guard_report(FILE *out);
+
+/*
+ * Event counters for ustats, compiled in with -DUSTATS (make stats). They
+ * are relaxed atomics, so threads never wait on each other to count, and
+ * without USTATS every USTAT_ADD disappears.
+ */
+#ifdef USTATS
+#include <stdatomic.h>
+extern atomic_size_t ustat_class_allocs[NUM_SIZE_CLASSES];
+#define USTAT_ADD(counter, n) atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+#else
+#define USTAT_ADD(counter, n) ((void)0)
+#endif
+
+struct ustats {
+    size_t heap_bytes;          /* taken from csbrk */
+    size_t in_use_bytes;        /* payloads of allocated blocks, class caches included */
+    size_t allocated_blocks;
+    size_t free_bytes;          /* payloads of free-list blocks */
+    size_t largest_free;
+    size_t free_blocks;
+    size_t finds;               /* free-list searches */
+    double find_visits;         /* free blocks visited per search */
+    bool counting;              /* the fields below are counted (USTATS) */
+    size_t extend_calls;
+    size_t coalesces;
+    double coalesce_visits;     /* free blocks visited per coalesce */
+    size_t class_allocs[NUM_SIZE_CLASSES]; /* allocations served per class */
+};
+
+int ustats(struct ustats *stats);
+void print_ustats(FILE *out);
+
+/*
+ * Heap snapshot written by uheap_dump: a uheap_dump_header_t, then one
+ * uheap_dump_segment_t per segment and one uheap_dump_block_t per block,
+ * both in address order. Offsets count from the start of the first
+ * segment. heapview (heapmap.c) reads it back.
+ */
+#define UHEAP_DUMP_MAGIC "UHEAPDM1"
+
+typedef struct {
+    char magic[8];
+    uint64_t num_segments;
+    uint64_t num_blocks;
+    uint64_t header_size;   /* HEADER_SIZE of the heap that wrote it */
+} uheap_dump_header_t;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} uheap_dump_segment_t;
+
+typedef struct {
+    uint64_t offset;        /* of the block header */
+    uint64_t size;          /* payload bytes */
+    uint32_t segment;
+    uint16_t class_size;    /* largest request of the size class the block serves, 0 if none */
+    uint8_t allocated;      /* cached blocks count as allocated */
+    uint8_t unused;
+} uheap_dump_block_t;
+
+int uheap_dump(int fd);
+
+/*
+ * umalloc_fast - pops a block from the request's class cache, or falls back
+ * to umalloc_slow on a miss or a request above UFAST_MAX_SIZE. Requests the
+ * profiler samples go to umalloc_sample.
+ */
+static inline void *umalloc_fast(size_t size) {
+    if (__builtin_expect((uprof_countdown -= (int64_t)size) < 0, 0)) {
+        return umalloc_sample(size);
+    }
+    if (size <= UFAST_MAX_SIZE) {
+        unsigned cls = ufast_alloc_class[(size + ALIGNMENT - 1) / ALIGNMENT];
+        void *payload = ufast_cache[cls];
+        if (payload) {
+            ufast_cache[cls] = *(void **)payload;
+            ufast_count[cls]--;
+            USTAT_ADD(ustat_class_allocs[cls], 1);
+            return payload;
+        }
+    }
+    return umalloc_slow(size);
+}
+
+/*
+ * ufree_fast - pushes a block onto its class cache, or falls back to
+ * ufree_slow when the block is too large, the cache is full or the block
+ * was sampled.
+ */
+static inline void ufree_fast(void *ptr) {
+    memory_block_t *block = (memory_block_t *)ptr - 1;
+    size_t size = PAYLOAD_SIZE(block);
+    if (size <= BLOCK_SIZE(UFAST_MAX_SIZE) && !IS_SAMPLED(block)) {
+        unsigned cls = ufast_free_class[size / ALIGNMENT];
+        if (cls != UFAST_NO_CLASS && ufast_count[cls] < ufast_limit) {
+            *(void **)ptr = ufast_cache[cls];
+            ufast_cache[cls] = ptr;
+            ufast_count[cls]++;
+            return;
+        }
+    }
+    ufree_slow(ptr);
+}
+
+/*
+ * realloc and memalign counterparts, and the usable size of a block, for
+ * callers such as the malloc shim (ushim.c) that need the full C interface.
+ */
+void *urealloc(void *ptr, size_t size);
+void *umemalign(size_t alignment, size_t size);
+size_t uusable_size(void *ptr);
+
+/*
+ * ureset - returns every block to the free list in one go, so benchmarks can
+ * replay a trace many times on the same heap without growing it.
+ */
+int ureset();
 
 // Portion that may not be edited
 int uinit();
 void *umalloc(size_t size);
-void ufree(void *ptr);
\ No newline at end of file
+void ufree(void *ptr);
+
+#endif
\ No newline at end of file
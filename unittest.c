@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define COMMENT '#'
 #define BLANK '\n'
@@ -15,6 +17,12 @@
 #define EXTEND 'E'
 #define SPLIT 'S'
 #define COALESCE 'C'
+#define ROUNDTRIP 'O'
+#define TRUNCATED 'T'
+#define IDMAP 'M'
+#define REALLOC 'R'
+#define MEMALIGN 'A'
+#define RESET 'Z'
 #define MAX_LINE_LENGTH 160
 
 static char printbuf[MAX_LINE_LENGTH];
@@ -46,6 +54,12 @@ static void test_find(size_t size);
 static void test_extend(size_t size);
 static void test_split(record_t **record_table, uint32_t id, size_t size);
 static void test_coalesce(record_t **record_table, uint32_t id);
+static void test_roundtrip(size_t size);
+static void test_truncated(size_t num_ops);
+static void test_id_map(size_t num_ids);
+static void test_realloc(size_t old_size, size_t size);
+static void test_memalign(size_t alignment, size_t size);
+static void test_reset(size_t num_blocks);
 
 /* Run all tests */
 int main(int argc, char **argv) {
@@ -93,7 +107,7 @@ static FILE *read_args(int argc, char **argv) {
     int option;
     FILE *infile = NULL;
 
-    while ((option = getopt(argc, argv, ":i:s:c")) != -1) {
+    while ((option = getopt(argc, argv, ":i:sc")) != -1) {
         switch(option) {
             case 'i':
                 if ((infile = fopen(optarg, "r")) == NULL) {
@@ -129,7 +143,7 @@ static void list_add(record_t **record_table, uint32_t id) {
             block = record_table[i-1]->addr;
         }
     }
-    if (block) block->next = record_table[id-1]->addr;
+    if (block) set_next(block, record_table[id-1]->addr);
 }
 
 static void list_remove(record_t **record_table, uint32_t id) {
@@ -139,7 +153,7 @@ static void list_remove(record_t **record_table, uint32_t id) {
             block = record_table[i-1]->addr;
         }
     }
-    if (block) block->next = record_table[id-1]->addr->next;
+    if (block) set_next(block, get_next(record_table[id-1]->addr));
 }
 
 static memory_block_t *initialize_list(void *heap, record_t **record_table, FILE* infile) {
@@ -216,7 +230,7 @@ static void backup_list(record_t **dest, record_t **source, size_t len) {
 static void run_tests(record_t **record_table, record_t **backup, size_t len, FILE *infile) {
     char op;
     uint32_t id;
-    size_t size;
+    size_t size, old_size, alignment;
 
     if (fgets(linebuf, sizeof(linebuf), infile) == NULL) {
         logging(LOG_FATAL, "Could not read from input file.\n");
@@ -249,6 +263,30 @@ static void run_tests(record_t **record_table, record_t **backup, size_t len, FI
                 sscanf(linebuf, "%c %d", &op, &id);
                 test_coalesce(record_table, id);
                 break;
+            case ROUNDTRIP:
+                sscanf(linebuf, "%c %ld", &op, &size);
+                test_roundtrip(size);
+                break;
+            case TRUNCATED:
+                sscanf(linebuf, "%c %ld", &op, &size);
+                test_truncated(size);
+                break;
+            case IDMAP:
+                sscanf(linebuf, "%c %ld", &op, &size);
+                test_id_map(size);
+                break;
+            case REALLOC:
+                sscanf(linebuf, "%c %ld %ld", &op, &old_size, &size);
+                test_realloc(old_size, size);
+                break;
+            case MEMALIGN:
+                sscanf(linebuf, "%c %ld %ld", &op, &alignment, &size);
+                test_memalign(alignment, size);
+                break;
+            case RESET:
+                sscanf(linebuf, "%c %ld", &op, &size);
+                test_reset(size);
+                break;
             default:
                 break;
         }
@@ -280,7 +318,7 @@ static void print_block(memory_block_t *block) {
 static void print_list(memory_block_t *head) {
     while(head) {
         print_block(head);
-        head = head->next;
+        head = get_next(head);
     }
     sprintf(printbuf, "End of free list.\n");
     logging(LOG_INFO, printbuf);
@@ -344,7 +382,7 @@ static void test_extend(size_t size) {
 static void test_split(record_t **record_table, uint32_t id, size_t size) {
     memory_block_t *block = record_table[id-1]->addr;
     size_t original_size = get_size(block);
-    memory_block_t *original_next = block->next;
+    memory_block_t *original_next = get_next(block);
 
     sprintf(printbuf, "Testing split on a block with an initial size of %ld:", get_size(block));
     logging(LOG_INFO, printbuf);
@@ -358,7 +396,7 @@ static void test_split(record_t **record_table, uint32_t id, size_t size) {
         logging(LOG_WARNING, printbuf);
     }
     else if (original_size <= size+2*sizeof(memory_block_t)-size_offset) {
-        if (get_size(split_block) == original_size && split_block->next == original_next) {
+        if (get_size(split_block) == original_size && get_next(split_block) == original_next) {
             sprintf(printbuf, "Block was not split.\n");
             logging(LOG_INFO, printbuf);
         }
@@ -369,7 +407,7 @@ static void test_split(record_t **record_table, uint32_t id, size_t size) {
     }
     else {
         
-        if (get_size(split_block) == original_size && split_block->next == original_next) {
+        if (get_size(split_block) == original_size && get_next(split_block) == original_next) {
             sprintf(printbuf, "Block was not split.\n");
             logging(LOG_WARNING, printbuf);
             return;
@@ -512,4 +550,254 @@ static void test_coalesce(record_t **record_table, uint32_t id) {
             }
         }
     }
-}
\ No newline at end of file
+}
+
+/*
+ * The tests below go through the public interface, on a heap that uinit
+ * sets up the first time one of them runs; keep them out of files that
+ * test find, extend, split and coalesce on a hand-built heap.
+ */
+static void ensure_heap() {
+    static bool initialized = false;
+    if (!initialized && uinit() == -1) {
+        logging(LOG_FATAL, "uinit failed.");
+        exit(EXIT_FAILURE);
+    }
+    initialized = true;
+}
+
+static void test_roundtrip(size_t size) {
+    ensure_heap();
+    sprintf(printbuf, "Testing the header round trip with a size of %ld:", size);
+    logging(LOG_INFO, printbuf);
+
+    void *payload = umalloc(size);
+    void *other = umalloc(size);
+    if (!payload || !other) {
+        sprintf(printbuf, "umalloc returned NULL.\n");
+        logging(LOG_ERROR, printbuf);
+        return;
+    }
+    memory_block_t *block = get_block(payload);
+    memory_block_t saved = *block;
+    size_t target_size = BLOCK_SIZE(size);
+
+    put_block(block, target_size, false);
+    set_next(block, get_block(other));
+    bool next_ok = get_next(block) == get_block(other);
+    set_next(block, NULL);
+    bool null_ok = get_next(block) == NULL;
+    allocate(block);
+    if (get_size(block) == target_size && is_allocated(block) && next_ok && null_ok) {
+        sprintf(printbuf, "Size %ld and next link survived the round trip.\n", get_size(block));
+        logging(LOG_INFO, printbuf);
+    }
+    else {
+        sprintf(printbuf, "Round trip gave size %ld, allocated %d, next %s, NULL next %s.\n",
+            get_size(block), is_allocated(block), next_ok ? "kept" : "lost", null_ok ? "kept" : "lost");
+        logging(LOG_ERROR, printbuf);
+    }
+    *block = saved;
+    ufree(other);
+    ufree(payload);
+}
+
+static void test_truncated(size_t num_ops) {
+    char filename[] = "/tmp/unittest.XXXXXX";
+    int fd;
+    trace_t trace = {.num_ids = num_ops, .num_ops = num_ops};
+
+    sprintf(printbuf, "Testing a binary trace of %ld ops cut short by one op:", num_ops);
+    logging(LOG_INFO, printbuf);
+
+    if ((fd = mkstemp(filename)) == -1) {
+        logging(LOG_ERROR, "mkstemp failed.\n");
+        return;
+    }
+    close(fd);
+    trace.ops = (traceop_t *)calloc(num_ops, sizeof(traceop_t));
+    for (int i = 0; i < num_ops; i++) {
+        trace.ops[i].type = ALLOC;
+        trace.ops[i].index = i;
+        trace.ops[i].size = 16 * (i + 1);
+    }
+    write_trace(&trace, filename, true);
+    free(trace.ops);
+
+    trace_t *whole = read_trace(filename, 0);
+    bool whole_ok = whole->num_ops == num_ops && whole->ops[num_ops - 1].size == 16 * num_ops;
+    free_trace(whole);
+
+    /* map_trace exits on a bad file, so read the cut file in a child. */
+    int status = 0;
+    pid_t pid;
+    if (truncate(filename, sizeof(trace_header_t) + (num_ops - 1) * sizeof(traceop_t)) == -1 ||
+        (pid = fork()) == -1) {
+        logging(LOG_ERROR, "Could not cut the trace short.\n");
+        unlink(filename);
+        return;
+    }
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        freopen("/dev/null", "w", stderr);
+        read_trace(filename, 0);
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    unlink(filename);
+
+    if (whole_ok && WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        sprintf(printbuf, "The whole trace read back and the cut one was rejected.\n");
+        logging(LOG_INFO, printbuf);
+    }
+    else {
+        sprintf(printbuf, "Whole trace %s, cut trace %s.\n", whole_ok ? "read back" : "misread",
+            WIFEXITED(status) && WEXITSTATUS(status) != 0 ? "rejected" : "accepted");
+        logging(LOG_ERROR, printbuf);
+    }
+}
+
+static void test_id_map(size_t num_ids) {
+    id_map_t *map = new_id_map();
+    int *ids = (int *)malloc(num_ids * sizeof(int));
+    size_t lost = 0, stale = 0;
+
+    sprintf(printbuf, "Testing an id map of %ld ids with every third one removed:", num_ids);
+    logging(LOG_INFO, printbuf);
+
+    /* scattered ids, as consecutive ones hash to nearly disjoint slots */
+    srand(num_ids);
+    for (int i = 0; i < num_ids; i++) {
+        ids[i] = i * 7919 + rand() % 7919;
+        id_map_insert(map, ids[i])->block_size = i;
+    }
+    /* remove from the back too, so removals shift runs both ways round */
+    for (int i = 0; i < num_ids / 2; i += 3)
+        id_map_remove(map, ids[i]);
+    for (int i = num_ids - 1 - (num_ids - 1) % 3; i >= num_ids / 2; i -= 3)
+        id_map_remove(map, ids[i]);
+
+    for (int i = 0; i < num_ids; i++) {
+        allocated_block_t *block = id_map_find(map, ids[i]);
+        if (i % 3 == 0 && block != NULL)
+            stale++;
+        else if (i % 3 != 0 && (block == NULL || block->block_size != i))
+            lost++;
+    }
+    if (lost == 0 && stale == 0 && map->count == num_ids - (num_ids + 2) / 3) {
+        sprintf(printbuf, "All %ld kept ids were found and no removed id was.\n", map->count);
+        logging(LOG_INFO, printbuf);
+    }
+    else {
+        sprintf(printbuf, "%ld kept ids were lost, %ld removed ids were found, count is %ld.\n",
+            lost, stale, map->count);
+        logging(LOG_ERROR, printbuf);
+    }
+    free(ids);
+    free_id_map(map);
+}
+
+static void test_realloc(size_t old_size, size_t size) {
+    ensure_heap();
+    sprintf(printbuf, "Testing urealloc from %ld to %ld bytes:", old_size, size);
+    logging(LOG_INFO, printbuf);
+
+    unsigned char *payload = (unsigned char *)umalloc(old_size);
+    if (!payload) {
+        logging(LOG_ERROR, "umalloc returned NULL.\n");
+        return;
+    }
+    for (size_t i = 0; i < old_size; i++)
+        payload[i] = (unsigned char)i;
+    bool fits = size <= uusable_size(payload);
+
+    unsigned char *resized = (unsigned char *)urealloc(payload, size);
+    size_t kept = old_size < size ? old_size : size;
+    bool contents_ok = resized != NULL;
+    for (size_t i = 0; contents_ok && i < kept; i++)
+        contents_ok = resized[i] == (unsigned char)i;
+
+    if (resized && (resized == payload) == fits && uusable_size(resized) >= size && contents_ok) {
+        sprintf(printbuf, "The block %s with its contents intact.\n", fits ? "stayed in place" : "moved");
+        logging(LOG_INFO, printbuf);
+    }
+    else {
+        sprintf(printbuf, "Expected it to %s, got %p from %p with %ld usable bytes; contents %s.\n",
+            fits ? "stay" : "move", resized, payload, resized ? uusable_size(resized) : 0,
+            contents_ok ? "intact" : "lost");
+        logging(LOG_ERROR, printbuf);
+    }
+    ufree(resized ? resized : payload);
+}
+
+static void test_memalign(size_t alignment, size_t size) {
+    ensure_heap();
+    sprintf(printbuf, "Testing umemalign of %ld bytes at %ld-byte alignment:", size, alignment);
+    logging(LOG_INFO, printbuf);
+
+    void *payload = umemalign(alignment, size);
+    if (!payload) {
+        logging(LOG_ERROR, "umemalign returned NULL.\n");
+        return;
+    }
+    memset(payload, 0xA5, size);
+    bool aligned = (uintptr_t)payload % alignment == 0;
+    bool big_enough = uusable_size(payload) >= size;
+    int heap_status = check_heap();
+
+    if (aligned && big_enough && heap_status == 0) {
+        sprintf(printbuf, "Got %p with %ld usable bytes, and the heap checks out.\n", payload, uusable_size(payload));
+        logging(LOG_INFO, printbuf);
+    }
+    else {
+        snprintf(printbuf, sizeof(printbuf), "Got %p with %ld usable bytes; heap checker: %s.\n", payload,
+            uusable_size(payload), heap_status ? check_heap_error() : "all good");
+        logging(LOG_ERROR, printbuf);
+    }
+    ufree(payload);
+}
+
+static void test_reset(size_t num_blocks) {
+    void *first = NULL, *again = NULL;
+    struct ustats before, cleared, after;
+
+    ensure_heap();
+    sprintf(printbuf, "Testing ureset after %ld allocations, then the same allocations again:", num_blocks);
+    logging(LOG_INFO, printbuf);
+
+    /* start from a reset heap so both rounds see the same free list */
+    if (ureset() == -1) {
+        logging(LOG_ERROR, "ureset failed.\n");
+        return;
+    }
+    for (size_t i = 0; i < num_blocks; i++) {
+        void *payload = umalloc(16 * (i % 13 + 1));
+        if (i == 0)
+            first = payload;
+    }
+    ustats(&before);
+
+    int status = ureset();
+    ustats(&cleared);
+    for (size_t i = 0; i < num_blocks; i++) {
+        void *payload = umalloc(16 * (i % 13 + 1));
+        if (i == 0)
+            again = payload;
+    }
+    ustats(&after);
+    int heap_status = check_heap();
+
+    if (status == 0 && cleared.allocated_blocks == 0 && cleared.in_use_bytes == 0 && again == first &&
+        after.heap_bytes == before.heap_bytes && heap_status == 0) {
+        sprintf(printbuf, "The heap emptied, and took the blocks back from the same %ld heap bytes.\n",
+            after.heap_bytes);
+        logging(LOG_INFO, printbuf);
+    }
+    else {
+        snprintf(printbuf, sizeof(printbuf), "ureset gave %d, %ld blocks left, first at %p then %p, heap bytes %ld then %ld; %s.\n",
+            status, cleared.allocated_blocks, first, again, before.heap_bytes, after.heap_bytes,
+            heap_status ? check_heap_error() : "heap good");
+        logging(LOG_ERROR, printbuf);
+    }
+    ureset();
+}
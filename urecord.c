@@ -0,0 +1,292 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * urecord.c - Records every allocator call of a live program:
+ *     LD_PRELOAD=./liburecord.so program
+ *     ./rec2rep urecord.<pid>.raw program.rep
+ * Calls are passed on to glibc. Each thread appends to its own buffer of
+ * records without locking; full buffers are pushed onto a lock-free stack
+ * that a flush thread writes out to urecord.<pid>.raw (or the prefix given
+ * in URECORD_PREFIX) while the program keeps running. The buffers still
+ * being filled are written when the program exits.
+ **************************************************************************/
+
+#define _GNU_SOURCE
+#include "urecord.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define CHUNK_RECORDS 8192      /* records per buffer */
+#define FLUSH_INTERVAL_US 10000 /* how often the flush thread wakes up */
+
+void *__libc_malloc(size_t size);
+void __libc_free(void *ptr);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+typedef struct chunk {
+    struct chunk *next;          /* link on the full_chunks stack */
+    atomic_size_t count;
+    urecord_t records[CHUNK_RECORDS];
+} chunk_t;
+
+/* Per-thread state, kept on a global list so exit can flush every thread. */
+typedef struct thread_log {
+    struct thread_log *next;
+    chunk_t *chunk;
+} thread_log_t;
+
+static atomic_uint_fast64_t next_seq;
+static _Atomic(chunk_t *) full_chunks;
+static _Atomic(thread_log_t *) thread_logs;
+static atomic_bool recording = true;
+static atomic_bool flushing;
+static pthread_t flush_thread;
+static pid_t recorder_pid;
+static int log_fd = -1;
+static size_t lost_records;
+
+static __thread thread_log_t *my_log;
+
+/*
+ * map_zeroed - memory for the recorder itself, which must not come from
+ * the allocator it is watching.
+ */
+static void *map_zeroed(size_t size) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        static const char err[] = "urecord: out of memory for records\n";
+        write(STDERR_FILENO, err, sizeof(err) - 1);
+        abort();
+    }
+    return mem;
+}
+
+/*
+ * push_chunk - hands a buffer to the flush thread.
+ */
+static void push_chunk(chunk_t *chunk) {
+    chunk_t *head = atomic_load_explicit(&full_chunks, memory_order_relaxed);
+    do {
+        chunk->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&full_chunks, &head, chunk,
+                 memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * thread_log - the calling thread's log, created and registered on first use.
+ */
+static thread_log_t *thread_log(void) {
+    thread_log_t *log = my_log;
+    if (!log) {
+        log = map_zeroed(sizeof(thread_log_t));
+        log->chunk = map_zeroed(sizeof(chunk_t));
+        thread_log_t *head = atomic_load_explicit(&thread_logs, memory_order_relaxed);
+        do {
+            log->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&thread_logs, &head, log,
+                     memory_order_release, memory_order_relaxed));
+        my_log = log;
+    }
+    return log;
+}
+
+/*
+ * record - appends one call to the calling thread's buffer.
+ */
+static void record(uint64_t seq, char type, void *ptr, void *old, size_t size) {
+    if (!atomic_load_explicit(&recording, memory_order_relaxed)) {
+        return;
+    }
+    thread_log_t *log = thread_log();
+    chunk_t *chunk = log->chunk;
+    if (!chunk) {            /* already flushed at exit */
+        return;
+    }
+    size_t count = atomic_load_explicit(&chunk->count, memory_order_relaxed);
+    if (count == CHUNK_RECORDS) {
+        push_chunk(chunk);
+        chunk = log->chunk = map_zeroed(sizeof(chunk_t));
+        count = 0;
+    }
+    chunk->records[count] = (urecord_t){seq, (uintptr_t)ptr, (uintptr_t)old, size, type};
+    atomic_store_explicit(&chunk->count, count + 1, memory_order_release);
+}
+
+static inline uint64_t take_seq(void) {
+    return atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed);
+}
+
+/*
+ * write_chunks - writes out and releases every buffer on the full stack.
+ * The stack is taken with one exchange and written oldest first.
+ */
+static void write_chunks(void) {
+    chunk_t *chunk = atomic_exchange_explicit(&full_chunks, NULL, memory_order_acquire);
+    chunk_t *oldest = NULL;
+    while (chunk) {
+        chunk_t *next = chunk->next;
+        chunk->next = oldest;
+        oldest = chunk;
+        chunk = next;
+    }
+    while (oldest) {
+        chunk_t *next = oldest->next;
+        size_t bytes = atomic_load_explicit(&oldest->count, memory_order_acquire) * sizeof(urecord_t);
+        char *buf = (char *)oldest->records;
+        while (bytes > 0) {
+            ssize_t written = log_fd == -1 ? -1 : write(log_fd, buf, bytes);
+            if (written <= 0) {
+                if (written == -1 && errno == EINTR) {
+                    continue;
+                }
+                lost_records += bytes / sizeof(urecord_t);
+                break;
+            }
+            buf += written;
+            bytes -= written;
+        }
+        munmap(oldest, sizeof(chunk_t));
+        oldest = next;
+    }
+}
+
+static void *flush_loop(void *arg) {
+    while (atomic_load_explicit(&flushing, memory_order_relaxed)) {
+        usleep(FLUSH_INTERVAL_US);
+        write_chunks();
+    }
+    return NULL;
+}
+
+/*
+ * A forked child inherits the buffers and the log file but not the flush
+ * thread; it stops recording rather than interleave with its parent.
+ */
+static void fork_child(void) {
+    atomic_store(&recording, false);
+}
+
+__attribute__((constructor))
+static void recorder_start(void) {
+    char path[4096];
+    const char *prefix = getenv("URECORD_PREFIX");
+    recorder_pid = getpid();
+    snprintf(path, sizeof(path), "%s.%d.raw", prefix ? prefix : "urecord", (int)recorder_pid);
+    log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (log_fd == -1) {
+        static const char err[] = "urecord: could not open the log file, not recording\n";
+        write(STDERR_FILENO, err, sizeof(err) - 1);
+        atomic_store(&recording, false);
+        return;
+    }
+    pthread_atfork(NULL, NULL, fork_child);
+    atomic_store(&flushing, true);
+    if (pthread_create(&flush_thread, NULL, flush_loop, NULL) != 0) {
+        atomic_store(&flushing, false);
+    }
+}
+
+/*
+ * recorder_stop - flushes the remaining records. Threads still running at
+ * exit may lose the calls they make from here on.
+ */
+__attribute__((destructor))
+static void recorder_stop(void) {
+    if (log_fd == -1 || getpid() != recorder_pid) {
+        return;
+    }
+    atomic_store(&recording, false);
+    if (atomic_exchange(&flushing, false)) {
+        pthread_join(flush_thread, NULL);
+    }
+    for (thread_log_t *log = atomic_load(&thread_logs); log; log = log->next) {
+        push_chunk(log->chunk);
+        log->chunk = NULL;
+    }
+    write_chunks();
+    close(log_fd);
+    log_fd = -1;
+    if (lost_records) {
+        fprintf(stderr, "urecord: %zu records could not be written\n", lost_records);
+    }
+}
+
+EXPORT void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    if (ptr) {
+        record(take_seq(), URECORD_ALLOC, ptr, NULL, size);
+    }
+    return ptr;
+}
+
+EXPORT void free(void *ptr) {
+    if (ptr) {
+        record(take_seq(), URECORD_FREE, ptr, NULL, 0);
+    }
+    __libc_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+    void *ptr = __libc_calloc(nmemb, size);
+    if (ptr) {
+        record(take_seq(), URECORD_ALLOC, ptr, NULL, nmemb * size);
+    }
+    return ptr;
+}
+
+EXPORT void *realloc(void *old, size_t size) {
+    void *ptr = __libc_realloc(old, size);
+    if (ptr || size == 0) {
+        record(take_seq(), URECORD_REALLOC, ptr, old, size);
+    }
+    return ptr;
+}
+
+EXPORT void *reallocarray(void *old, size_t nmemb, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(old, bytes);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+    void *ptr = __libc_memalign(alignment, size);
+    if (ptr) {
+        record(take_seq(), URECORD_ALLOC, ptr, NULL, size);
+    }
+    return ptr;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    void *ptr = memalign(alignment, size);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
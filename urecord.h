@@ -0,0 +1,30 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * urecord.h - Raw log format shared by the allocation recorder (urecord.c)
+ * and the tool that turns its logs into traces (rec2rep.c).
+ **************************************************************************/
+
+#ifndef URECORD_H
+#define URECORD_H
+
+#include <stdint.h>
+
+#define URECORD_ALLOC 'a'
+#define URECORD_FREE 'f'
+#define URECORD_REALLOC 'r'
+
+/*
+ * One allocator call. seq orders calls across threads: allocations take it
+ * after the call returns and frees before they are made, so an address is
+ * always freed before it is handed out again.
+ */
+typedef struct {
+    uint64_t seq;
+    uint64_t ptr;   /* block returned, or freed */
+    uint64_t old;   /* block passed to realloc */
+    uint64_t size;  /* bytes requested */
+    uint64_t type;  /* URECORD_ALLOC, URECORD_FREE or URECORD_REALLOC */
+} urecord_t;
+
+#endif
@@ -0,0 +1,223 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * ushim.c - Interposes the C allocation interface on umalloc, so unmodified
+ * programs can run on the allocator with
+ *     LD_PRELOAD=./libumalloc.so program
+ * The heap is initialized by the first call. csbrk is provided here on top
+ * of sbrk, without the lab's 64 KiB cap, since real programs make larger
+ * requests than the traces do.
+ **************************************************************************/
+
+#define _GNU_SOURCE
+#include "umalloc.h"
+#include "csbrk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static atomic_bool initialized;
+
+/*
+ * csbrk - grows the heap with sbrk, falling back to an anonymous mapping
+ * when the break cannot move. The fallback is left out of the compact
+ * layout, whose offsets only reach segments above the first one.
+ */
+void *csbrk(intptr_t increment) {
+    void *segment = sbrk(increment);
+    if (segment != (void *)-1) {
+        return segment;
+    }
+#ifndef UMALLOC_COMPACT
+    segment = mmap(NULL, increment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (segment != MAP_FAILED) {
+        return segment;
+    }
+#endif
+    return NULL;
+}
+
+/*
+ * shim_init - sets up the heap. Runs once, from the first allocation call,
+ * which may come from the dynamic loader before any constructor has run.
+ * UPROFILE_RATE turns on the heap profiler and UGUARD_RATE guarded
+ * allocations, from UGUARD_SLOTS slots.
+ */
+static void shim_init(void) {
+    if (uinit() == -1) {
+        static const char err[] = "ushim: uinit failed\n";
+        write(STDERR_FILENO, err, sizeof(err) - 1);
+        abort();
+    }
+    atomic_store_explicit(&initialized, true, memory_order_release);
+    const char *rate = getenv("UPROFILE_RATE");
+    if (rate && atol(rate) > 0) {
+        uprofile_start(atol(rate));
+    }
+    const char *guard = getenv("UGUARD_RATE");
+    const char *slots = getenv("UGUARD_SLOTS");
+    if (guard && atol(guard) > 0) {
+        uguard_start(atol(guard), slots && atol(slots) > 0 ? atol(slots) : UGUARD_DEFAULT_SLOTS);
+    }
+}
+
+/*
+ * shim_dump_profile - with UPROFILE_RATE set, writes the heap profile to
+ * uprofile.<pid>.heap (or the prefix in UPROFILE_PREFIX) at exit, showing
+ * what the program never freed and everything it allocated.
+ */
+__attribute__((destructor))
+static void shim_dump_profile(void) {
+    char path[4096];
+    const char *prefix = getenv("UPROFILE_PREFIX");
+    if (!uprofile_running()) {
+        return;
+    }
+    uprofile_stop();
+    snprintf(path, sizeof(path), "%s.%d.heap", prefix ? prefix : "uprofile", (int)getpid());
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1) {
+        uprofile_dump(fd);
+        close(fd);
+    }
+}
+
+static inline void ensure_init(void) {
+    if (!atomic_load_explicit(&initialized, memory_order_acquire)) {
+        pthread_once(&init_once, shim_init);
+    }
+}
+
+/*
+ * The heap lock is held across fork() so the child never inherits a free
+ * list that another thread was halfway through changing. Class caches of
+ * the other threads are simply lost in the child.
+ */
+static void fork_prepare(void) {
+    ensure_init();
+    lock_heap();
+}
+
+static void fork_release(void) {
+    unlock_heap();
+}
+
+__attribute__((constructor))
+static void shim_register_fork(void) {
+    pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+
+/*
+ * too_large - requests that cannot be rounded up without overflowing.
+ */
+static inline bool too_large(size_t size) {
+    return size > PTRDIFF_MAX;
+}
+
+EXPORT UALLOC_ENTRY void *malloc(size_t size) {
+    if (too_large(size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    ensure_init();
+    void *payload = umalloc_fast(size);
+    if (!payload) {
+        errno = ENOMEM;
+    }
+    return payload;
+}
+
+EXPORT void free(void *ptr) {
+    if (ptr) {
+        ufree_fast(ptr);
+    }
+}
+
+EXPORT UALLOC_ENTRY void *calloc(size_t nmemb, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *payload = malloc(bytes);
+    if (payload) {
+        memset(payload, 0, bytes);
+    }
+    return payload;
+}
+
+EXPORT UALLOC_ENTRY void *realloc(void *ptr, size_t size) {
+    if (too_large(size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    ensure_init();
+    void *payload = urealloc(ptr, size);
+    if (!payload && size) {
+        errno = ENOMEM;
+    }
+    return payload;
+}
+
+EXPORT UALLOC_ENTRY void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, bytes);
+}
+
+EXPORT UALLOC_ENTRY int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    if (too_large(size) || too_large(alignment)) {
+        return ENOMEM;
+    }
+    ensure_init();
+    void *payload = umemalign(alignment, size);
+    if (!payload) {
+        return ENOMEM;
+    }
+    *memptr = payload;
+    return 0;
+}
+
+EXPORT UALLOC_ENTRY void *memalign(size_t alignment, size_t size) {
+    void *payload;
+    if (alignment & (alignment - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int err = posix_memalign(&payload, alignment < sizeof(void *) ? sizeof(void *) : alignment, size);
+    if (err) {
+        errno = err;
+        return NULL;
+    }
+    return payload;
+}
+
+EXPORT UALLOC_ENTRY void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+EXPORT UALLOC_ENTRY void *valloc(size_t size) {
+    return memalign(PAGESIZE, size);
+}
+
+EXPORT UALLOC_ENTRY void *pvalloc(size_t size) {
+    return memalign(PAGESIZE, (size + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    return ptr ? uusable_size(ptr) : 0;
+}
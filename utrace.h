@@ -0,0 +1,50 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * utrace.h - Event log format shared by the tracing layer compiled into
+ * umalloc.c with -DUTRACE (make trace) and its analyzer (utraceprof.c).
+ **************************************************************************/
+
+#ifndef UTRACE_H
+#define UTRACE_H
+
+#include <stdint.h>
+
+#define UTRACE_MAGIC "UTRACE01"
+
+/* What an event times. The first two are whole slow-path calls. */
+enum {
+    UTRACE_MALLOC,      /* alloc_block: find, split and extend included */
+    UTRACE_FREE,        /* free_block: coalesce included */
+    UTRACE_FIND,
+    UTRACE_SPLIT,
+    UTRACE_EXTEND,      /* coalesce included */
+    UTRACE_COALESCE,
+    UTRACE_MERGE,       /* merging the deferred frees */
+    UTRACE_LOCK,        /* waiting for the heap lock */
+    NUM_UTRACE_EVENTS
+};
+
+/*
+ * The log starts with a header, then holds events. Each thread's events
+ * are in the order its calls returned, so a call comes after everything
+ * it called; depth tells a call from its callees.
+ */
+typedef struct {
+    char magic[8];
+    double ticks_per_ns;    /* measured when tracing started */
+} utrace_header_t;
+
+typedef struct {
+    uint64_t start;         /* ticks when the call began */
+    uint32_t ticks;         /* ticks it took, callees included */
+    uint32_t visited;       /* free blocks it visited */
+    uint64_t size;          /* bytes asked for */
+    uint64_t addr;          /* block returned, or freed */
+    uint32_t thread;        /* numbered from 0 as threads first trace */
+    uint8_t type;
+    uint8_t depth;          /* 0 for calls not made by another traced call */
+    uint16_t unused;
+} utrace_event_t;
+
+#endif
@@ -0,0 +1,160 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * utraceprof.c - Profiles umalloc from an event log written by a tracing
+ * build (make trace). Unlike gprof_performance, which only works on an
+ * -O0 build, the log comes from the optimized allocator. Time is given to
+ * each internal function both with and without the traced calls it made
+ * (self), together with its latency distribution and how many free
+ * blocks it visited per call.
+ **************************************************************************/
+
+#include "support.h"
+#include "histogram.h"
+#include "utrace.h"
+
+#define READ_BATCH 4096 /* events read at once */
+#define MAX_DEPTH 256   /* depth is a byte */
+
+static const char *event_names[NUM_UTRACE_EVENTS] = {
+    "malloc", "free", "find", "split", "extend", "coalesce", "merge", "lock wait",
+};
+
+typedef struct {
+    uint64_t calls;
+    uint64_t ticks;     /* callees included */
+    uint64_t self;
+    uint64_t visited;
+    histogram_t latency; /* ticks per call */
+} event_stats_t;
+
+/* Ticks of the calls finished at each depth that their caller has not yet claimed. */
+typedef struct {
+    uint64_t pending[MAX_DEPTH + 1];
+} thread_state_t;
+
+static event_stats_t stats[NUM_UTRACE_EVENTS];
+static thread_state_t *threads;
+static size_t num_threads;
+
+static thread_state_t *thread_state(uint32_t thread) {
+    if (thread >= num_threads) {
+        size_t grown = num_threads ? num_threads : 8;
+        while (grown <= thread) {
+            grown *= 2;
+        }
+        if ((threads = realloc(threads, grown * sizeof(thread_state_t))) == NULL) {
+            appl_error("Failed to grow the thread table");
+        }
+        memset(threads + num_threads, 0, (grown - num_threads) * sizeof(thread_state_t));
+        num_threads = grown;
+    }
+    return &threads[thread];
+}
+
+/*
+ * account - adds one event. A thread's calls are logged as they return,
+ * so by the time a call shows up every traced call it made is already
+ * pending one level deeper, and its self time is what they leave.
+ */
+static void account(utrace_event_t *e) {
+    thread_state_t *t = thread_state(e->thread);
+    event_stats_t *s = &stats[e->type];
+    uint64_t callees = t->pending[e->depth + 1];
+    t->pending[e->depth + 1] = 0;
+    t->pending[e->depth] += e->ticks;
+    s->calls++;
+    s->ticks += e->ticks;
+    s->self += e->ticks > callees ? e->ticks - callees : 0;
+    s->visited += e->visited;
+    hist_record(&s->latency, e->ticks);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: utraceprof [-t] logfile\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-t         Report ticks of the cycle counter instead of nanoseconds.\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    bool ticks = false;
+    FILE *log;
+    utrace_header_t header;
+    utrace_event_t *batch;
+    size_t n, total = 0, bogus = 0;
+    char err_msg[MAXLINE];
+
+    while ((c = getopt(argc, argv, "t")) != -1) {
+        switch (c) {
+        case 't':
+            ticks = true;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (argc - optind != 1) {
+        usage();
+        appl_error("Expected one log file.");
+    }
+    if ((log = fopen(argv[optind], "r")) == NULL || fread(&header, sizeof(header), 1, log) != 1 ||
+            memcmp(header.magic, UTRACE_MAGIC, sizeof(header.magic)) != 0) {
+        sprintf(err_msg, "%s is not a utrace log", argv[optind]);
+        appl_error(err_msg);
+    }
+    if ((batch = malloc(READ_BATCH * sizeof(utrace_event_t))) == NULL) {
+        appl_error("Failed to allocate the read buffer");
+    }
+    while ((n = fread(batch, sizeof(utrace_event_t), READ_BATCH, log)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (batch[i].type >= NUM_UTRACE_EVENTS || batch[i].depth >= MAX_DEPTH) {
+                bogus++;
+                continue;
+            }
+            account(&batch[i]);
+        }
+        total += n;
+    }
+    fclose(log);
+    free(batch);
+
+    /* without a rate the log was cut short; fall back to ticks */
+    double scale = 1.0;
+    if (!ticks && header.ticks_per_ns > 0) {
+        scale = 1.0 / header.ticks_per_ns;
+    } else {
+        ticks = true;
+    }
+    const char *unit = ticks ? "ticks" : "ns";
+    uint64_t all_self = 0;
+    for (int i = 0; i < NUM_UTRACE_EVENTS; i++) {
+        all_self += stats[i].self;
+    }
+    printf("%zu events", total);
+    if (header.ticks_per_ns > 0) {
+        printf(", %.3f ticks per ns", header.ticks_per_ns);
+    }
+    printf("%s\n", bogus ? " (some corrupt, skipped)" : "");
+    printf("%-10s %10s %12s %12s %7s %9s %9s %9s %9s %8s\n", "function", "calls",
+        ticks ? "total Mtick" : "total ms", ticks ? "self Mtick" : "self ms", "self %",
+        "mean", "p50", "p99", "max", "visited");
+    for (int i = 0; i < NUM_UTRACE_EVENTS; i++) {
+        event_stats_t *s = &stats[i];
+        if (!s->calls) {
+            continue;
+        }
+        double per_ms = ticks ? 1e-6 : scale * 1e-6;
+        printf("%-10s %10lu %12.3f %12.3f %6.1f%% %9.0f %9.0f %9.0f %9.0f %8.1f\n", event_names[i], s->calls,
+            s->ticks * per_ms, s->self * per_ms, all_self ? 100.0 * s->self / all_self : 0.0,
+            scale * s->ticks / s->calls, scale * hist_percentile(&s->latency, 50),
+            scale * hist_percentile(&s->latency, 99), scale * s->latency.max, (double)s->visited / s->calls);
+    }
+    printf("mean, p50, p99 and max per call in %s; visited is free blocks per call\n", unit);
+    free(threads);
+    return 0;
+}